@@ -0,0 +1,261 @@
+/* agent <agent@local>
+ * Batched connection acceptor and fd-indexed connection table.
+ *
+ * The kernel hands out the lowest free descriptor, so open descriptors
+ * are dense and make good array indices.  Looking a connection up is a
+ * bounds check and an index instead of a hash and a pointer chase.
+ */
+#define _GNU_SOURCE  /* for accept4() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "acceptor.h"
+
+/* Initial table size.  Most processes have a few descriptors open
+ * before accepting anything, and doubling from 64 reaches tens of
+ * thousands of connections in a handful of reallocations. */
+static const int INITIAL_TABLE_SIZE = 64;
+
+/* Dense table of connections indexed by file descriptor */
+struct _ConnectionTable {
+    Connection *conns;
+    int size;     // number of slots in conns
+    int count;    // number of open connections
+    int reserve;  // spare descriptor for shedding, or -1
+};
+
+/*
+ * Allocates an empty connection table, or returns NULL if memory or
+ * descriptors are exhausted.  The table holds one spare descriptor so
+ * that acceptor_drain() can shed connections when the process is out
+ * of descriptors.
+ */
+ConnectionTable *conntable_create(void) {
+    ConnectionTable *table = malloc(sizeof(ConnectionTable));
+
+    if (table == NULL) {
+        return NULL;
+    }
+    table->conns = calloc(INITIAL_TABLE_SIZE, sizeof(Connection));
+    if (table->conns == NULL) {
+        free(table);
+        return NULL;
+    }
+    table->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (table->reserve < 0) {
+        free(table->conns);
+        free(table);
+        return NULL;
+    }
+    table->size = INITIAL_TABLE_SIZE;
+    table->count = 0;
+
+    return table;
+}
+
+/*
+ * Closes every connection in a table and frees it.
+ */
+void conntable_destroy(ConnectionTable *table) {
+    if (table == NULL) {
+        return;
+    }
+    for (int fd = 0; fd < table->size && table->count > 0; fd++) {
+        if (table->conns[fd].flags & CONNECTION_OPEN) {
+            conntable_close(table, fd);
+        }
+    }
+    if (table->reserve >= 0) {
+        close(table->reserve);
+    }
+    free(table->conns);
+    free(table);
+}
+
+/*
+ * Returns the connection for a given file descriptor, or NULL if that
+ * descriptor is not an open connection in this table.  The pointer is
+ * valid until the next conntable_open().
+ */
+Connection *conntable_get(ConnectionTable *table, int fd) {
+    if (fd < 0 || fd >= table->size
+        || !(table->conns[fd].flags & CONNECTION_OPEN)) {
+        return NULL;
+    }
+
+    return &table->conns[fd];
+}
+
+/*
+ * Adds a connection for a given file descriptor and attaches an input
+ * IOBuffer.  The buffer starts on its inline storage and takes a block
+ * from the IOBuffer pool only once it holds more than that.  Returns
+ * the new connection, or NULL with errno set to ENOMEM if memory is
+ * exhausted, EEXIST if the descriptor is already in the table, or EBADF
+ * if it is negative.
+ */
+Connection *conntable_open(ConnectionTable *table, int fd) {
+    Connection *conn;
+    int size = table->size;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    if (conntable_get(table, fd) != NULL) {
+        errno = EEXIST;
+        return NULL;
+    }
+
+    if (fd >= size) {
+        while (fd >= size) {
+            size *= 2;
+        }
+        conn = realloc(table->conns, size * sizeof(Connection));
+        if (conn == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memset(conn + table->size, 0,
+               (size - table->size) * sizeof(Connection));
+        table->conns = conn;
+        table->size = size;
+    }
+
+    conn = &table->conns[fd];
+    conn->in = iobuffer_create();
+    if (conn->in == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    conn->flags = CONNECTION_OPEN;
+    conn->user = 0;
+    table->count++;
+
+    return conn;
+}
+
+/*
+ * Removes the connection for a given file descriptor, releasing its
+ * IOBuffer and closing the descriptor.  Does nothing if the descriptor
+ * is not in the table.
+ */
+void conntable_close(ConnectionTable *table, int fd) {
+    Connection *conn = conntable_get(table, fd);
+
+    if (conn == NULL) {
+        return;
+    }
+    iobuffer_destroy(conn->in);
+    memset(conn, 0, sizeof(Connection));
+    table->count--;
+    close(fd);
+}
+
+/*
+ * Returns the number of open connections in a table.
+ */
+int conntable_count(ConnectionTable *table) {
+    return table->count;
+}
+
+/*
+ * Turns away one pending connection when the process is out of
+ * descriptors.  The spare descriptor is closed so that accept4() has
+ * one to hand out, the connection is accepted and closed at once, and
+ * the spare is taken back.  Returns 0 if a connection was shed, or -1
+ * if there was no spare or nothing was pending.
+ */
+static int acceptor_shed(int listenfd, ConnectionTable *table) {
+    int fd;
+
+    if (table->reserve < 0) {
+        return -1;
+    }
+    close(table->reserve);
+    fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd >= 0) {
+        close(fd);
+    }
+    table->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    return fd >= 0 ? 0 : -1;
+}
+
+/* Accept every pending connection on a listening socket, up to a limit.
+ *
+ * Called when the (non-blocking) listening socket is readable, this
+ * drains the backlog in one wakeup instead of returning to the event
+ * loop after each connection.  Accepted sockets are non-blocking and
+ * close-on-exec, and are added to the table with an input buffer.  The
+ * new descriptors are stored in fds so that the caller can register
+ * them with its event loop.
+ *
+ * This function returns < 0 on error if nothing was accepted, or the
+ * number of connections accepted.  A return of maxfds means more may be
+ * pending.  When the process or system runs out of descriptors, pending
+ * connections are accepted and closed at once using the table's spare
+ * descriptor, so that they do not stay in the backlog and keep the
+ * listening socket readable; up to maxfds are shed per call.  If the
+ * spare has been lost as well, -1 is returned with errno set to EMFILE
+ * or ENFILE, and the caller should stop polling the listening socket
+ * for a while.
+ *
+ * If a connection cannot be added to the table, it is closed and the
+ * batch ends; -1 is returned with errno set to ENOMEM if nothing else
+ * was accepted.  Otherwise the next call reports it.
+ *
+ * listenfd: the listening socket
+ * table:    the table to which connections are added
+ * fds:      array receiving accepted descriptors
+ * maxfds:   size of fds, and the most connections to accept
+ */
+int acceptor_drain(int listenfd, ConnectionTable *table, int *fds,
+                   int maxfds) {
+    int count = 0;
+    int shed = 0;
+    int err;
+    int fd;
+
+    while (count < maxfds) {
+        fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && shed < maxfds) {
+                err = errno;
+                if (acceptor_shed(listenfd, table) == 0) {
+                    shed++;
+                    continue;
+                }
+                if (table->reserve >= 0) {
+                    break;  // the backlog is empty
+                }
+                errno = err;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK || count > 0
+                || shed > 0) {
+                break;
+            }
+            return -1;
+        }
+        if (conntable_open(table, fd) == NULL) {
+            err = errno;
+            close(fd);
+            if (count > 0) {
+                break;
+            }
+            errno = err;
+            return -1;
+        }
+        fds[count++] = fd;
+    }
+
+    return count;
+}
@@ -0,0 +1,53 @@
+/* agent <agent@local>
+ * Batched connection acceptor and fd-indexed connection table.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in acceptor.c.
+ */
+
+#ifndef ACCEPTOR_H_
+#define ACCEPTOR_H_
+
+#include "example.h"
+
+/* Per-connection state
+ *
+ * Connections are stored by value in an array indexed by file
+ * descriptor, so this header is kept small; sixteen bytes puts four
+ * connections in each cache line.
+ */
+typedef struct {
+    IOBuffer *in;          /* Input buffer, or NULL if the slot is free */
+    unsigned int flags;    /* CONNECTION_* flags */
+    unsigned int user;     /* Free for the application's use */
+} Connection;
+
+/*
+ * Connection flags.  These are bits in Connection.flags rather than an
+ * enumeration, as several may be set at once.
+ */
+#define CONNECTION_OPEN     0x1  /* Slot holds an accepted connection */
+#define CONNECTION_EOF      0x2  /* Peer has closed its side */
+
+/* Dense table of connections indexed by file descriptor
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _ConnectionTable ConnectionTable;
+
+ConnectionTable *conntable_create(void);
+
+void conntable_destroy(ConnectionTable *table);
+
+Connection *conntable_get(ConnectionTable *table, int fd);
+
+Connection *conntable_open(ConnectionTable *table, int fd);
+
+void conntable_close(ConnectionTable *table, int fd);
+
+int conntable_count(ConnectionTable *table);
+
+int acceptor_drain(int listenfd, ConnectionTable *table, int *fds,
+                   int maxfds);
+
+#endif /* ACCEPTOR_H_ */
@@ -0,0 +1,671 @@
+/* agent <agent@local>
+ * User-space block cache for positional reads into IOBuffers.
+ *
+ * A service doing small random reads in large files pays a pread()
+ * system call for each, even when the page cache holds the data.  A
+ * BlockCache keeps recently used BLOCK_SIZE-byte blocks of files in
+ * process memory, so a hit is a hash lookup and a copy into the
+ * IOBuffer.  The files must not be modified while they are open.
+ *
+ * Blocks are spread over shards by a hash of file and block number,
+ * each with its own lock, table, and replacement state, so threads
+ * reading different blocks rarely contend.  Hits copy under the shard
+ * lock, so no block is freed while being copied.
+ *
+ * Replacement is CLOCK-Pro, which, unlike LRU or CLOCK, is not flushed
+ * by a scan.  Blocks are hot or cold, and a cold block that is evicted
+ * stays on the clock as a non-resident "test" entry for a while.  A
+ * block that misses while still being tested was reused at a short
+ * enough distance to deserve a place, and comes back hot; each such
+ * hit also grows the share of memory given to cold blocks, and each
+ * test entry that expires shrinks it.  A one-pass scan only ever
+ * passes through cold blocks and leaves the hot ones alone.
+ *
+ * Concurrent misses on the same block are coalesced: the first thread
+ * reads it, and the others wait for that read instead of issuing their
+ * own.
+ *
+ * Files may be opened with O_DIRECT, bypassing the page cache so that
+ * data is not cached twice.  Blocks are aligned to BLOCK_SIZE in both
+ * the file and memory, which satisfies O_DIRECT on devices with
+ * logical blocks of up to that size.
+ */
+#define _GNU_SOURCE  /* for O_DIRECT */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blockcache.h"
+
+/* Size and alignment of a cached block.  One page, and a multiple of
+ * the logical block size of nearly all devices, for O_DIRECT. */
+static const size_t BLOCK_SIZE = 4096;
+
+/* Shards used when the caller does not choose.  Enough that a few
+ * dozen threads rarely meet on one lock. */
+static const int DEFAULT_SHARDS = 16;
+
+/* CLOCK-Pro entry types */
+typedef enum {
+    BLOCK_HOT,
+    BLOCK_COLD,
+    BLOCK_TEST          // evicted cold block, remembered but not resident
+} BlockType;
+
+/* One block on a shard's clock */
+typedef struct BlockEntry {
+    uint64_t file;
+    uint64_t block;
+    char *data;               // NULL for a test entry
+    size_t length;            // < BLOCK_SIZE at the end of the file
+    BlockType type;
+    bool referenced;          // hit since a hand last passed
+    struct BlockEntry *hnext; // hash chain
+    struct BlockEntry *prev;  // clock
+    struct BlockEntry *next;
+} BlockEntry;
+
+/* A block being read; others missing on it wait for it */
+typedef struct BlockLoad {
+    struct BlockLoad *next;
+    uint64_t file;
+    uint64_t block;
+    int refs;           // the reader and its waiters
+    bool done;
+    int error;          // errno of a failed read, or 0
+} BlockLoad;
+
+/* One shard of the cache */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;    // broadcast when a load finishes
+    BlockEntry **buckets;
+    size_t mask;              // buckets - 1
+    BlockEntry *hand_hot;     // each hand walks the one clock
+    BlockEntry *hand_cold;
+    BlockEntry *hand_test;
+    size_t mem_max;           // resident blocks
+    size_t mem_cold;          // target resident cold blocks; adapts
+    size_t count_hot;
+    size_t count_cold;
+    size_t count_test;
+    char *free;               // unused block memory, linked through it
+    BlockLoad *loading;
+    BlockCacheStats stats;
+} BlockShard;
+
+/* Cache of file blocks */
+struct _BlockCache {
+    BlockShard *shards;
+    int nshards;
+    atomic_ullong next_file;  // identifies BlockFiles; never reused
+};
+
+/* A file read through the cache */
+struct _BlockFile {
+    int fd;
+    uint64_t id;
+};
+
+/*
+ * Returns a hash of a block's key.  The high bits choose the shard and
+ * the low bits the bucket.
+ */
+static uint64_t block_hash(uint64_t file, uint64_t block) {
+    uint64_t h = (file * 0x9E3779B97F4A7C15ULL) ^ block;
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/*
+ * Returns the entry for a block in a shard, or NULL.
+ */
+static BlockEntry *shard_lookup(BlockShard *s, uint64_t file,
+                                uint64_t block, uint64_t hash) {
+    BlockEntry *e = s->buckets[hash & s->mask];
+
+    while (e != NULL && (e->file != file || e->block != block)) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+/*
+ * Returns block memory to a shard's free list.
+ */
+static void shard_free_block(BlockShard *s, char *data) {
+    *(char **)data = s->free;
+    s->free = data;
+}
+
+/*
+ * Removes an entry from its shard's table and clock and frees it, but
+ * not its data.  A hand on the entry moves back one, so that its next
+ * step lands where it would have.
+ */
+static void clock_remove(BlockShard *s, BlockEntry *e) {
+    BlockEntry **link = &s->buckets[block_hash(e->file, e->block)
+                                    & s->mask];
+    BlockEntry *prev = e->prev != e ? e->prev : NULL;
+
+    while (*link != e) {
+        link = &(*link)->hnext;
+    }
+    *link = e->hnext;
+
+    if (s->hand_hot == e) {
+        s->hand_hot = prev;
+    }
+    if (s->hand_cold == e) {
+        s->hand_cold = prev;
+    }
+    if (s->hand_test == e) {
+        s->hand_test = prev;
+    }
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    free(e);
+}
+
+/*
+ * Removes a test entry.  Its block was not reused soon enough, so cold
+ * blocks get less of the memory.
+ */
+static void test_expire(BlockShard *s, BlockEntry *e) {
+    clock_remove(s, e);
+    s->count_test--;
+    if (s->mem_cold > 1) {
+        s->mem_cold--;
+    }
+}
+
+/*
+ * Advances the test hand one entry, expiring a test entry there.
+ */
+static void run_hand_test(BlockShard *s) {
+    if (s->hand_test->type == BLOCK_TEST) {
+        test_expire(s, s->hand_test);
+    }
+    s->hand_test = s->hand_test->next;
+}
+
+/*
+ * Advances the hot hand one entry, demoting an unreferenced hot block
+ * to cold.  Test entries it passes have outlived the hot blocks around
+ * them, and expire.
+ */
+static void run_hand_hot(BlockShard *s) {
+    BlockEntry *e = s->hand_hot;
+
+    if (e->type == BLOCK_HOT) {
+        if (e->referenced) {
+            e->referenced = false;
+        } else {
+            e->type = BLOCK_COLD;
+            s->count_hot--;
+            s->count_cold++;
+        }
+    } else if (e->type == BLOCK_TEST) {
+        test_expire(s, e);
+    }
+    s->hand_hot = s->hand_hot->next;
+}
+
+/*
+ * Advances the cold hand one entry.  A referenced cold block is
+ * promoted to hot; an unreferenced one is evicted, leaving a test
+ * entry.  The hot hand then runs until hot blocks are within their
+ * share.
+ */
+static void run_hand_cold(BlockShard *s) {
+    BlockEntry *e = s->hand_cold;
+
+    if (e->type == BLOCK_COLD) {
+        if (e->referenced) {
+            e->type = BLOCK_HOT;
+            e->referenced = false;
+            s->count_cold--;
+            s->count_hot++;
+        } else {
+            e->type = BLOCK_TEST;
+            shard_free_block(s, e->data);
+            e->data = NULL;
+            s->count_cold--;
+            s->count_test++;
+            s->stats.evictions++;
+            while (s->count_test > s->mem_max) {
+                run_hand_test(s);
+            }
+        }
+    }
+    s->hand_cold = s->hand_cold->next;
+    while (s->count_hot > s->mem_max - s->mem_cold) {
+        run_hand_hot(s);
+    }
+}
+
+/*
+ * Adds an entry to a shard's table and to its clock just behind the
+ * hot hand, first evicting to make room for a resident block.
+ */
+static void clock_add(BlockShard *s, BlockEntry *e, uint64_t hash) {
+    while (s->count_hot + s->count_cold >= s->mem_max) {
+        run_hand_cold(s);
+    }
+    e->hnext = s->buckets[hash & s->mask];
+    s->buckets[hash & s->mask] = e;
+
+    if (s->hand_hot == NULL) {
+        e->prev = e;
+        e->next = e;
+        s->hand_hot = e;
+        s->hand_cold = e;
+        s->hand_test = e;
+    } else {
+        e->next = s->hand_hot;
+        e->prev = s->hand_hot->prev;
+        e->prev->next = e;
+        s->hand_hot->prev = e;
+    }
+    if (s->hand_cold == s->hand_hot) {
+        s->hand_cold = s->hand_cold->prev;
+    }
+}
+
+/*
+ * Caches a block that was just read, taking ownership of data.  A block
+ * with a test entry was reused while being tested, so it comes back
+ * hot, and cold blocks get more of the memory.  Returns < 0 if memory
+ * is exhausted, in which case data is returned to the free list.
+ */
+static int shard_insert(BlockShard *s, uint64_t file, uint64_t block,
+                        uint64_t hash, char *data, size_t length) {
+    BlockEntry *e = shard_lookup(s, file, block, hash);
+    BlockType type = BLOCK_COLD;
+
+    if (e != NULL) {
+        /* A test entry; resident blocks are never read again. */
+        if (s->mem_cold < s->mem_max) {
+            s->mem_cold++;
+        }
+        clock_remove(s, e);
+        s->count_test--;
+        type = BLOCK_HOT;
+    }
+    e = malloc(sizeof(BlockEntry));
+    if (e == NULL) {
+        shard_free_block(s, data);
+        return -1;
+    }
+    e->file = file;
+    e->block = block;
+    e->data = data;
+    e->length = length;
+    e->type = type;
+    e->referenced = false;
+    clock_add(s, e, hash);
+    if (type == BLOCK_HOT) {
+        s->count_hot++;
+    } else {
+        s->count_cold++;
+    }
+
+    return 0;
+}
+
+/* Create a block cache.
+ *
+ * This function returns NULL if memory is exhausted.
+ *
+ * capacity: the most bytes of blocks to keep, which is rounded down to
+ *           whole blocks, but is at least one block per shard
+ * shards:   the number of independently locked shards, or <= 0 for a
+ *           default
+ */
+BlockCache *blockcache_create(size_t capacity, int shards) {
+    BlockCache *bc = calloc(1, sizeof(BlockCache));
+    size_t per_shard;
+    size_t buckets;
+    BlockShard *s;
+
+    if (bc == NULL) {
+        return NULL;
+    }
+    bc->nshards = shards > 0 ? shards : DEFAULT_SHARDS;
+    bc->shards = calloc(bc->nshards, sizeof(BlockShard));
+    if (bc->shards == NULL) {
+        free(bc);
+        return NULL;
+    }
+    atomic_init(&bc->next_file, 1);
+    per_shard = capacity / BLOCK_SIZE / bc->nshards;
+    if (per_shard == 0) {
+        per_shard = 1;
+    }
+    /* Resident and test entries each number at most per_shard. */
+    for (buckets = 1; buckets < 2 * per_shard; buckets *= 2) {
+    }
+
+    for (int i = 0; i < bc->nshards; i++) {
+        s = &bc->shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->loaded, NULL);
+        s->mem_max = per_shard;
+        /* Half of memory for cold blocks until reuse says otherwise. */
+        s->mem_cold = per_shard > 1 ? per_shard / 2 : 1;
+        s->mask = buckets - 1;
+        s->buckets = calloc(buckets, sizeof(BlockEntry *));
+        if (s->buckets == NULL) {
+            bc->nshards = i + 1;
+            blockcache_destroy(bc);
+            return NULL;
+        }
+    }
+
+    return bc;
+}
+
+/* Destroy a block cache.
+ *
+ * No thread may be using the cache.  Its BlockFiles remain open, and
+ * must be closed with blockcache_close().
+ */
+void blockcache_destroy(BlockCache *bc) {
+    BlockShard *s;
+    char *data;
+
+    if (bc == NULL) {
+        return;
+    }
+    for (int i = 0; i < bc->nshards; i++) {
+        s = &bc->shards[i];
+        while (s->hand_hot != NULL) {
+            if (s->hand_hot->data != NULL) {
+                free(s->hand_hot->data);
+            }
+            clock_remove(s, s->hand_hot);
+        }
+        while ((data = s->free) != NULL) {
+            s->free = *(char **)data;
+            free(data);
+        }
+        free(s->buckets);
+        pthread_cond_destroy(&s->loaded);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(bc->shards);
+    free(bc);
+}
+
+/* Open a file to be read through a block cache.
+ *
+ * This function returns NULL with errno set on error, including EINVAL
+ * if direct is requested and the file system does not support it.
+ *
+ * bc:     the cache
+ * path:   the file to open for reading
+ * direct: bypass the page cache with O_DIRECT
+ */
+BlockFile *blockcache_open(BlockCache *bc, const char *path, bool direct) {
+    BlockFile *bf = malloc(sizeof(BlockFile));
+
+    if (bf == NULL) {
+        return NULL;
+    }
+    bf->fd = open(path, O_RDONLY | O_CLOEXEC | (direct ? O_DIRECT : 0));
+    if (bf->fd < 0) {
+        free(bf);
+        return NULL;
+    }
+    bf->id = atomic_fetch_add(&bc->next_file, 1);
+
+    return bf;
+}
+
+/*
+ * Closes a file opened with blockcache_open().  Its cached blocks are
+ * no longer found, and age out of the cache.
+ */
+void blockcache_close(BlockFile *bf) {
+    if (bf != NULL) {
+        close(bf->fd);
+        free(bf);
+    }
+}
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns how many of len bytes wanted at within can be copied from a
+ * block of length bytes.
+ */
+static size_t block_span(size_t length, size_t within, size_t len) {
+    if (length <= within) {
+        return 0;
+    }
+    return length - within < len ? length - within : len;
+}
+
+/*
+ * Copies up to len bytes at offset within one block of a file to dst,
+ * reading the block if it is not cached.  Returns < 0 with errno set on
+ * error, 0 at end of file, or the number of bytes copied.
+ */
+static int block_copy(BlockCache *bc, BlockFile *bf, char *dst, size_t len,
+                      off_t offset) {
+    uint64_t block = offset / BLOCK_SIZE;
+    size_t within = offset % BLOCK_SIZE;
+    uint64_t hash = block_hash(bf->id, block);
+    BlockShard *s = &bc->shards[(hash >> 32) % bc->nshards];
+    unsigned long long start;
+    unsigned long long elapsed;
+    BlockEntry *e;
+    BlockLoad *load;
+    BlockLoad **link;
+    char *data;
+    ssize_t n;
+    int error;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        e = shard_lookup(s, bf->id, block, hash);
+        if (e != NULL && e->data != NULL) {
+            e->referenced = true;
+            s->stats.hits++;
+            n = block_span(e->length, within, len);
+            memcpy(dst, e->data + within, n);
+            pthread_mutex_unlock(&s->lock);
+            return n;
+        }
+        for (load = s->loading; load != NULL; load = load->next) {
+            if (load->file == bf->id && load->block == block) {
+                break;
+            }
+        }
+        if (load == NULL) {
+            break;
+        }
+
+        /* Another thread is reading the block; wait and look again. */
+        load->refs++;
+        s->stats.coalesced++;
+        while (!load->done) {
+            pthread_cond_wait(&s->loaded, &s->lock);
+        }
+        error = load->error;
+        if (--load->refs == 0) {
+            free(load);
+        }
+        if (error != 0) {
+            pthread_mutex_unlock(&s->lock);
+            errno = error;
+            return -1;
+        }
+    }
+
+    load = calloc(1, sizeof(BlockLoad));
+    if (load == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    s->stats.misses++;
+    load->file = bf->id;
+    load->block = block;
+    load->refs = 1;
+    load->next = s->loading;
+    s->loading = load;
+    data = s->free;
+    if (data != NULL) {
+        s->free = *(char **)data;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (data == NULL && posix_memalign((void **)&data, BLOCK_SIZE,
+                                       BLOCK_SIZE) != 0) {
+        data = NULL;
+        errno = ENOMEM;
+    }
+    start = now_ns();
+    n = -1;
+    if (data != NULL) {
+        do {
+            n = pread(bf->fd, data, BLOCK_SIZE, block * BLOCK_SIZE);
+        } while (n < 0 && errno == EINTR);
+    }
+    elapsed = now_ns() - start;
+    error = n < 0 ? errno : 0;
+
+    pthread_mutex_lock(&s->lock);
+    for (link = &s->loading; *link != load; link = &(*link)->next) {
+    }
+    *link = load->next;
+    load->done = true;
+    load->error = error;
+    pthread_cond_broadcast(&s->loaded);
+    s->stats.read_ns += elapsed;
+    if (elapsed > s->stats.read_ns_max) {
+        s->stats.read_ns_max = elapsed;
+    }
+
+    if (n >= 0) {
+        /* The copy comes first; inserting may not keep the block. */
+        len = block_span(n, within, len);
+        memcpy(dst, data + within, len);
+        if (shard_insert(s, bf->id, block, hash, data, n) < 0) {
+            /* Not cached; the reader still has its data. */
+        }
+        n = len;
+    } else if (data != NULL) {
+        shard_free_block(s, data);
+    }
+    if (--load->refs == 0) {
+        free(load);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (n < 0) {
+        errno = error;
+    }
+    return n;
+}
+
+/* Read a given number of bytes into a buffer from a given offset in a
+ * file, through a block cache.
+ *
+ * This function behaves as iobuffer_pread(), but the data comes from
+ * cached blocks where possible, and otherwise whole blocks are read
+ * from the file and cached.  It returns < 0 on error, 0 if the buffer
+ * is full or offset is at or past the end of the file, or the number
+ * of bytes read.  If an error occurs after some bytes were read, those
+ * bytes are returned and the error is reported by the next call.
+ *
+ * bc:     the cache
+ * bf:     the file, from blockcache_open() on bc
+ * buf:    the buffer to fill
+ * bytes:  the number of bytes to read
+ * offset: the file offset at which to start reading
+ */
+int blockcache_pread(BlockCache *bc, BlockFile *bf, IOBuffer *buf,
+                     size_t bytes, off_t offset) {
+    size_t done = 0;
+    size_t size;
+    char *dst;
+    int n;
+
+    dst = iobuffer_reserve(buf, bytes, NULL);
+    if (dst == NULL && errno == ENOBUFS) {
+        /* Read as much as fits. */
+        if (iobuffer_storage(buf, &size) == NULL) {
+            return -1;
+        }
+        bytes = size - iobuffer_length(buf);
+        if (bytes == 0) {
+            return 0;
+        }
+        dst = iobuffer_reserve(buf, bytes, NULL);
+    }
+    if (dst == NULL) {
+        return -1;
+    }
+
+    while (done < bytes) {
+        n = block_copy(bc, bf, dst + done, bytes - done, offset + done);
+        if (n < 0 && done == 0) {
+            return -1;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    iobuffer_commit(buf, done);
+
+    return done;
+}
+
+/* Report cache statistics.
+ *
+ * The hit rate is hits / (hits + misses + coalesced), and the mean
+ * read latency read_ns / misses.
+ *
+ * bc:    the cache
+ * stats: set to the totals over all shards
+ */
+void blockcache_stats(BlockCache *bc, BlockCacheStats *stats) {
+    BlockShard *s;
+
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < bc->nshards; i++) {
+        s = &bc->shards[i];
+        pthread_mutex_lock(&s->lock);
+        stats->hits += s->stats.hits;
+        stats->misses += s->stats.misses;
+        stats->coalesced += s->stats.coalesced;
+        stats->evictions += s->stats.evictions;
+        stats->read_ns += s->stats.read_ns;
+        if (s->stats.read_ns_max > stats->read_ns_max) {
+            stats->read_ns_max = s->stats.read_ns_max;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
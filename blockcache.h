@@ -0,0 +1,52 @@
+/* agent <agent@local>
+ * User-space block cache for positional reads into IOBuffers.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in blockcache.c.
+ */
+
+#ifndef BLOCKCACHE_H_
+#define BLOCKCACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "example.h"
+
+/* Cache statistics, summed over all shards */
+typedef struct {
+    unsigned long hits;       /* Blocks copied from the cache */
+    unsigned long misses;     /* Blocks read from their file */
+    unsigned long coalesced;  /* Misses that waited for another's read */
+    unsigned long evictions;  /* Blocks dropped to make room */
+    unsigned long long read_ns;      /* Total time in file reads */
+    unsigned long long read_ns_max;  /* Longest file read */
+} BlockCacheStats;
+
+/* Cache of file blocks shared by all threads
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _BlockCache BlockCache;
+
+/* A file read through a BlockCache
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _BlockFile BlockFile;
+
+BlockCache *blockcache_create(size_t capacity, int shards);
+
+void blockcache_destroy(BlockCache *bc);
+
+BlockFile *blockcache_open(BlockCache *bc, const char *path, bool direct);
+
+void blockcache_close(BlockFile *bf);
+
+int blockcache_pread(BlockCache *bc, BlockFile *bf, IOBuffer *buf,
+                     size_t bytes, off_t offset);
+
+void blockcache_stats(BlockCache *bc, BlockCacheStats *stats);
+
+#endif /* BLOCKCACHE_H_ */
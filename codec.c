@@ -0,0 +1,526 @@
+/* agent <agent@local>
+ * Vectorized Base64 and hex encoding and decoding of IOBuffer data.
+ *
+ * Base64 and hex blobs carried in text frames are decoded straight out
+ * of the IOBuffer they were read into.  Since decoded data is always
+ * shorter than its encoding, base64_decode() and hex_decode() may write
+ * their output over their input, leaving the decoded bytes at the start
+ * of the field; the *_append() functions instead write into the free
+ * space of another IOBuffer, with no intermediate copy.
+ *
+ * The vector paths follow the well-known pshufb techniques of Wojciech
+ * Mula and Daniel Lemire.  Base64 encoding spreads each 3 input bytes
+ * into 4 6-bit indices with shuffles and multiplies, and maps indices
+ * to characters with a small table of offsets.  Decoding classifies
+ * every character by its high and low nibbles in two table lookups,
+ * which at once rejects invalid characters (a whole register with one
+ * test) and gives the offset that maps it back to its value; the values
+ * are then packed with multiply-adds.  Hex works the same way with
+ * simpler arithmetic.
+ *
+ * Base64 uses 32-byte AVX2 registers when compiled for AVX2, and 16-byte
+ * SSSE3 registers when compiled for SSSE3; hex uses SSSE3.  Otherwise,
+ * and for the last partial block of each input, scalar code is used.
+ * Loops stop early enough that no vector load or store reaches past the
+ * ends of the input or output.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include "codec.h"
+
+static const char BASE64_ALPHABET[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static const char BASE64_PAD = '=';
+
+/* Returned by the scalar value functions for an invalid character */
+static const int INVALID = -1;
+
+/*
+ * Returns the 6-bit value of a Base64 character, or INVALID.
+ */
+static int base64_value(unsigned char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    } else if (c == '+') {
+        return 62;
+    } else if (c == '/') {
+        return 63;
+    }
+
+    return INVALID;
+}
+
+/*
+ * Returns the 4-bit value of a hex digit of either case, or INVALID.
+ */
+static int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;  // lower case
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    return INVALID;
+}
+
+/*
+ * Returns the length of the padded Base64 encoding of len bytes.
+ */
+size_t base64_encoded_length(size_t len) {
+    return (len + 2) / 3 * 4;
+}
+
+/*
+ * Returns the most bytes that len Base64 characters can decode to.
+ */
+size_t base64_decoded_max(size_t len) {
+    return len / 4 * 3 + (len % 4 > 1 ? len % 4 - 1 : 0);
+}
+
+#ifdef __SSSE3__
+/*
+ * Encodes the first 12 of 16 loaded bytes as 16 Base64 characters.
+ * With AVX2 this is applied to each 128-bit lane at once, so it is
+ * written as a macro over the register width W (128 or 256) and the
+ * intrinsic prefix S (empty or 256).
+ */
+#define BASE64_ENCODE_BLOCK(in, W, S)                                      \
+    do {                                                                   \
+        __m##W##i indices;                                                 \
+        __m##W##i shift;                                                   \
+                                                                           \
+        /* Each 32-bit lane gets bytes b1 b0 b2 b1 of one triple. */       \
+        in = _mm##S##_shuffle_epi8(in, _mm##S##_set_epi8(                  \
+            BASE64_ENCODE_SHUFFLE_##W));                                   \
+        /* Shift each 6-bit index into its own byte. */                    \
+        indices = _mm##S##_or_si##W(                                       \
+            _mm##S##_mulhi_epu16(                                          \
+                _mm##S##_and_si##W(in, _mm##S##_set1_epi32(0x0fc0fc00)),   \
+                _mm##S##_set1_epi32(0x04000040)),                          \
+            _mm##S##_mullo_epi16(                                          \
+                _mm##S##_and_si##W(in, _mm##S##_set1_epi32(0x003f03f0)),   \
+                _mm##S##_set1_epi32(0x01000010)));                         \
+        /* Reduce indices to 0-13 by range, and add the offset from the    \
+         * range to the character. */                                      \
+        shift = _mm##S##_or_si##W(                                         \
+            _mm##S##_subs_epu8(indices, _mm##S##_set1_epi8(51)),           \
+            _mm##S##_and_si##W(                                            \
+                _mm##S##_cmpgt_epi8(_mm##S##_set1_epi8(26), indices),      \
+                _mm##S##_set1_epi8(13)));                                  \
+        in = _mm##S##_add_epi8(indices, _mm##S##_shuffle_epi8(             \
+            _mm##S##_setr_epi8(BASE64_ENCODE_OFFSETS_##W), shift));        \
+    } while (0)
+
+/*
+ * Decodes 16 Base64 characters per 128-bit lane into 12 bytes at the
+ * start of the lane, setting valid to false if any character is
+ * invalid.
+ */
+#define BASE64_DECODE_BLOCK(in, valid, W, S)                               \
+    do {                                                                   \
+        __m##W##i hi = _mm##S##_and_si##W(_mm##S##_srli_epi32(in, 4),      \
+                                          _mm##S##_set1_epi8(0x0f));       \
+        __m##W##i lo = _mm##S##_and_si##W(in, _mm##S##_set1_epi8(0x0f));   \
+        __m##W##i roll;                                                    \
+                                                                           \
+        /* A character is invalid iff its nibble classes intersect. */     \
+        valid = _mm##S##_movemask_epi8(_mm##S##_cmpgt_epi8(                \
+            _mm##S##_and_si##W(                                            \
+                _mm##S##_shuffle_epi8(                                     \
+                    _mm##S##_setr_epi8(BASE64_DECODE_LO_##W), lo),         \
+                _mm##S##_shuffle_epi8(                                     \
+                    _mm##S##_setr_epi8(BASE64_DECODE_HI_##W), hi)),        \
+            _mm##S##_setzero_si##W())) == 0;                               \
+        /* The high nibble (and '/') selects the offset to the value. */   \
+        roll = _mm##S##_shuffle_epi8(                                      \
+            _mm##S##_setr_epi8(BASE64_DECODE_ROLL_##W),                    \
+            _mm##S##_add_epi8(                                             \
+                _mm##S##_cmpeq_epi8(in, _mm##S##_set1_epi8('/')), hi));    \
+        in = _mm##S##_add_epi8(in, roll);                                  \
+        /* Pack 4 6-bit values into 3 bytes, in order. */                  \
+        in = _mm##S##_madd_epi16(                                          \
+            _mm##S##_maddubs_epi16(in, _mm##S##_set1_epi32(0x01400140)),   \
+            _mm##S##_set1_epi32(0x00011000));                              \
+        in = _mm##S##_shuffle_epi8(in, _mm##S##_setr_epi8(                 \
+            BASE64_DECODE_PACK_##W));                                      \
+    } while (0)
+
+/* Table contents for the block macros, by register width; AVX2
+ * shuffles work within 128-bit lanes, so its tables repeat per lane. */
+#define BASE64_ENCODE_SHUFFLE_128 \
+    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1
+#define BASE64_ENCODE_OFFSETS_128 \
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, \
+    '/' - 63, 'A', 0, 0
+#define BASE64_DECODE_LO_128 \
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, \
+    0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+#define BASE64_DECODE_HI_128 \
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, \
+    0x10, 0x10, 0x10, 0x10, 0x10
+#define BASE64_DECODE_ROLL_128 \
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define BASE64_DECODE_PACK_128 \
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+#define BASE64_ENCODE_SHUFFLE_256 \
+    BASE64_ENCODE_SHUFFLE_128, BASE64_ENCODE_SHUFFLE_128
+#define BASE64_ENCODE_OFFSETS_256 \
+    BASE64_ENCODE_OFFSETS_128, BASE64_ENCODE_OFFSETS_128
+#define BASE64_DECODE_LO_256 BASE64_DECODE_LO_128, BASE64_DECODE_LO_128
+#define BASE64_DECODE_HI_256 BASE64_DECODE_HI_128, BASE64_DECODE_HI_128
+#define BASE64_DECODE_ROLL_256 BASE64_DECODE_ROLL_128, BASE64_DECODE_ROLL_128
+#define BASE64_DECODE_PACK_256 BASE64_DECODE_PACK_128, BASE64_DECODE_PACK_128
+#endif /* __SSSE3__ */
+
+/* Encode bytes as padded Base64.
+ *
+ * This function returns the length of the encoding, which is
+ * base64_encoded_length(len).
+ *
+ * dst: space for the encoding; it must not overlap src
+ * src: the bytes to encode
+ * len: the number of bytes to encode
+ */
+size_t base64_encode(char *dst, const char *src, size_t len) {
+    const unsigned char *s = (const unsigned char *)src;
+    char *d = dst;
+    size_t i = 0;
+    uint32_t triple;
+
+#ifdef __AVX2__
+    /* 24 bytes per step, loaded as two overlapping 16-byte halves. */
+    for (; i + 28 <= len; i += 24, d += 32) {
+        __m256i in = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(s + i))),
+            _mm_loadu_si128((const __m128i *)(s + i + 12)), 1);
+
+        BASE64_ENCODE_BLOCK(in, 256, 256);
+        _mm256_storeu_si256((__m256i *)d, in);
+    }
+#endif
+#ifdef __SSSE3__
+    for (; i + 16 <= len; i += 12, d += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+
+        BASE64_ENCODE_BLOCK(in, 128, );
+        _mm_storeu_si128((__m128i *)d, in);
+    }
+#endif
+    for (; i + 3 <= len; i += 3, d += 4) {
+        triple = s[i] << 16 | s[i + 1] << 8 | s[i + 2];
+        d[0] = BASE64_ALPHABET[triple >> 18];
+        d[1] = BASE64_ALPHABET[(triple >> 12) & 0x3F];
+        d[2] = BASE64_ALPHABET[(triple >> 6) & 0x3F];
+        d[3] = BASE64_ALPHABET[triple & 0x3F];
+    }
+    if (i < len) {
+        triple = s[i] << 16 | (i + 1 < len ? s[i + 1] << 8 : 0);
+        d[0] = BASE64_ALPHABET[triple >> 18];
+        d[1] = BASE64_ALPHABET[(triple >> 12) & 0x3F];
+        d[2] = i + 1 < len ? BASE64_ALPHABET[(triple >> 6) & 0x3F]
+                           : BASE64_PAD;
+        d[3] = BASE64_PAD;
+        d += 4;
+    }
+
+    return d - dst;
+}
+
+/* Decode Base64.
+ *
+ * Padding is optional, but if present must be correct.  Any other
+ * character outside the Base64 alphabet, including whitespace, makes
+ * the input invalid.
+ *
+ * This function returns the number of bytes decoded, or -1 with errno
+ * set to EINVAL if the input is not valid Base64.  On error, the
+ * contents of dst are unspecified.
+ *
+ * dst: space for base64_decoded_max(len) bytes; it may be the same as
+ *      src, to decode in place, but may not otherwise overlap it
+ * src: the Base64 characters
+ * len: the number of characters
+ */
+ssize_t base64_decode(char *dst, const char *src, size_t len) {
+    const unsigned char *s = (const unsigned char *)src;
+    char *d = dst;
+    size_t i = 0;
+    uint32_t quad;
+    int value;
+    size_t tail;
+
+    if (len > 0 && len % 4 == 0 && s[len - 1] == BASE64_PAD) {
+        len -= s[len - 2] == BASE64_PAD ? 2 : 1;
+    }
+    if (len % 4 == 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Each step stores a whole register, of which 3/4 is output; the
+     * bounds keep that store inside the output and behind the input. */
+#ifdef __AVX2__
+    for (; i + 48 <= len; i += 32, d += 24) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(s + i));
+        bool valid;
+
+        BASE64_DECODE_BLOCK(in, valid, 256, 256);
+        if (!valid) {
+            errno = EINVAL;
+            return -1;
+        }
+        in = _mm256_permutevar8x32_epi32(in, _mm256_setr_epi32(0, 1, 2, 4,
+                                                               5, 6, 7, 7));
+        _mm256_storeu_si256((__m256i *)d, in);
+    }
+#endif
+#ifdef __SSSE3__
+    for (; i + 24 <= len; i += 16, d += 12) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+        bool valid;
+
+        BASE64_DECODE_BLOCK(in, valid, 128, );
+        if (!valid) {
+            errno = EINVAL;
+            return -1;
+        }
+        _mm_storeu_si128((__m128i *)d, in);
+    }
+#endif
+    while (i < len) {
+        tail = len - i < 4 ? len - i : 4;
+        quad = 0;
+        for (size_t j = 0; j < 4; j++) {
+            value = j < tail ? base64_value(s[i + j]) : 0;
+            if (value == INVALID) {
+                errno = EINVAL;
+                return -1;
+            }
+            quad = quad << 6 | value;
+        }
+        d[0] = quad >> 16;
+        if (tail > 2) {
+            d[1] = quad >> 8;
+        }
+        if (tail > 3) {
+            d[2] = quad;
+        }
+        d += tail - 1;
+        i += tail;
+    }
+
+    return d - dst;
+}
+
+/* Append the padded Base64 encoding of some bytes to an IOBuffer.
+ *
+ * The encoding is written directly into the free space of out.
+ *
+ * This function returns 0, or -1 with errno set to ENOBUFS if out
+ * cannot hold the encoding or ENOMEM if storage cannot be allocated.
+ */
+int base64_encode_append(IOBuffer *out, const char *src, size_t len) {
+    size_t length = base64_encoded_length(len);
+    char *dst = iobuffer_reserve(out, length, NULL);
+
+    if (dst == NULL) {
+        return -1;
+    }
+    iobuffer_commit(out, base64_encode(dst, src, len));
+
+    return 0;
+}
+
+/* Decode Base64 and append the result to an IOBuffer.
+ *
+ * The decoded bytes are written directly into the free space of out.
+ * Nothing is appended if the input is invalid.
+ *
+ * This function returns the number of bytes appended, or -1 with errno
+ * set to EINVAL for invalid input, ENOBUFS if out cannot hold the
+ * result, or ENOMEM if storage cannot be allocated.
+ */
+ssize_t base64_decode_append(IOBuffer *out, const char *src, size_t len) {
+    char *dst = iobuffer_reserve(out, base64_decoded_max(len), NULL);
+    ssize_t decoded;
+
+    if (dst == NULL) {
+        return -1;
+    }
+    decoded = base64_decode(dst, src, len);
+    if (decoded >= 0) {
+        iobuffer_commit(out, decoded);
+    }
+
+    return decoded;
+}
+
+/* Encode bytes as lower-case hex.
+ *
+ * This function returns the length of the encoding, 2 * len.
+ *
+ * dst: space for 2 * len characters; it must not overlap src
+ * src: the bytes to encode
+ * len: the number of bytes to encode
+ */
+size_t hex_encode(char *dst, const char *src, size_t len) {
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i = 0;
+
+#ifdef __SSSE3__
+    __m128i digits = _mm_loadu_si128((const __m128i *)HEX_DIGITS);
+    __m128i mask = _mm_set1_epi8(0x0f);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i hi = _mm_shuffle_epi8(digits,
+            _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(in, mask));
+
+        _mm_storeu_si128((__m128i *)(dst + 2 * i),
+                         _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 16),
+                         _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+    for (; i < len; i++) {
+        dst[2 * i] = HEX_DIGITS[s[i] >> 4];
+        dst[2 * i + 1] = HEX_DIGITS[s[i] & 0x0f];
+    }
+
+    return 2 * len;
+}
+
+#ifdef __SSSE3__
+/*
+ * Converts 16 hex digits of either case to their values, setting valid
+ * to false if any is not a hex digit.
+ */
+static __m128i hex_values(__m128i in, bool *valid) {
+    __m128i digit = _mm_sub_epi8(in, _mm_set1_epi8('0'));
+    __m128i letter = _mm_sub_epi8(_mm_or_si128(in, _mm_set1_epi8(0x20)),
+                                  _mm_set1_epi8('a'));
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)),
+                                      digit);
+    __m128i is_letter = _mm_cmpeq_epi8(
+        _mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+
+    *valid = _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) == 0xFFFF;
+
+    return _mm_or_si128(_mm_and_si128(is_digit, digit),
+        _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+#endif
+
+/* Decode hex digits of either case.
+ *
+ * This function returns the number of bytes decoded, len / 2, or -1
+ * with errno set to EINVAL if len is odd or any character is not a hex
+ * digit.  On error, the contents of dst are unspecified.
+ *
+ * dst: space for len / 2 bytes; it may be the same as src, to decode in
+ *      place, but may not otherwise overlap it
+ * src: the hex digits
+ * len: the number of digits
+ */
+ssize_t hex_decode(char *dst, const char *src, size_t len) {
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i = 0;
+    int hi;
+    int lo;
+
+    if (len % 2 != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef __SSSE3__
+    __m128i weights = _mm_set1_epi16(0x0110);  // 16 * high + low
+    bool valid1;
+    bool valid2;
+
+    for (; i + 32 <= len; i += 32) {
+        __m128i a = hex_values(_mm_loadu_si128((const __m128i *)(s + i)),
+                               &valid1);
+        __m128i b = hex_values(
+            _mm_loadu_si128((const __m128i *)(s + i + 16)), &valid2);
+
+        if (!valid1 || !valid2) {
+            errno = EINVAL;
+            return -1;
+        }
+        _mm_storeu_si128((__m128i *)(dst + i / 2),
+                         _mm_packus_epi16(_mm_maddubs_epi16(a, weights),
+                                          _mm_maddubs_epi16(b, weights)));
+    }
+#endif
+    for (; i < len; i += 2) {
+        hi = hex_value(s[i]);
+        lo = hex_value(s[i + 1]);
+        if (hi == INVALID || lo == INVALID) {
+            errno = EINVAL;
+            return -1;
+        }
+        dst[i / 2] = hi << 4 | lo;
+    }
+
+    return len / 2;
+}
+
+/* Append the hex encoding of some bytes to an IOBuffer.
+ *
+ * This function returns 0, or -1 with errno set to ENOBUFS if out
+ * cannot hold the encoding or ENOMEM if storage cannot be allocated.
+ */
+int hex_encode_append(IOBuffer *out, const char *src, size_t len) {
+    char *dst = iobuffer_reserve(out, 2 * len, NULL);
+
+    if (dst == NULL) {
+        return -1;
+    }
+    iobuffer_commit(out, hex_encode(dst, src, len));
+
+    return 0;
+}
+
+/* Decode hex digits and append the result to an IOBuffer.
+ *
+ * Nothing is appended if the input is invalid.
+ *
+ * This function returns the number of bytes appended, or -1 with errno
+ * set to EINVAL for invalid input, ENOBUFS if out cannot hold the
+ * result, or ENOMEM if storage cannot be allocated.
+ */
+ssize_t hex_decode_append(IOBuffer *out, const char *src, size_t len) {
+    char *dst = iobuffer_reserve(out, len / 2, NULL);
+    ssize_t decoded;
+
+    if (dst == NULL) {
+        return -1;
+    }
+    decoded = hex_decode(dst, src, len);
+    if (decoded >= 0) {
+        iobuffer_commit(out, decoded);
+    }
+
+    return decoded;
+}
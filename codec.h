@@ -0,0 +1,36 @@
+/* agent <agent@local>
+ * Vectorized Base64 and hex encoding and decoding of IOBuffer data.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in codec.c.
+ */
+
+#ifndef CODEC_H_
+#define CODEC_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "example.h"
+
+size_t base64_encoded_length(size_t len);
+
+size_t base64_decoded_max(size_t len);
+
+size_t base64_encode(char *dst, const char *src, size_t len);
+
+ssize_t base64_decode(char *dst, const char *src, size_t len);
+
+int base64_encode_append(IOBuffer *out, const char *src, size_t len);
+
+ssize_t base64_decode_append(IOBuffer *out, const char *src, size_t len);
+
+size_t hex_encode(char *dst, const char *src, size_t len);
+
+ssize_t hex_decode(char *dst, const char *src, size_t len);
+
+int hex_encode_append(IOBuffer *out, const char *src, size_t len);
+
+ssize_t hex_decode_append(IOBuffer *out, const char *src, size_t len);
+
+#endif /* CODEC_H_ */
@@ -0,0 +1,221 @@
+/* agent <agent@local>
+ * Epoch-based deferred reclamation of shared objects.
+ *
+ * This is quiescent-state-based reclamation.  A global epoch counter is
+ * advanced every time an object is retired, and every registered thread
+ * publishes the last epoch it observed at a quiescent point.  An object
+ * retired at epoch e can be reclaimed once every registered thread has
+ * published an epoch greater than e, because each of them has since
+ * been at a point where it held no references.
+ *
+ * The reader side costs one load and one store per quiescent point and
+ * nothing at all per access.  Retiring and reclaiming take a mutex.
+ *
+ * Objects are reclaimed without the caller asking in two places: at a
+ * quiescent point of a thread that may have been the last one holding
+ * back the oldest retired object, and from epoch_retire() once enough
+ * objects have piled up.  The pile-up threshold doubles with whatever
+ * a scan leaves behind, so a thread that stops calling
+ * epoch_quiescent() makes retiring no worse than amortized constant
+ * time, though its objects wait until it does.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+/* Retired entries are reclaimed in batches; reclaiming on every retire
+ * would scan the thread list once per destroyed object.  After a scan,
+ * the next is due when the entries it left have doubled, or after this
+ * many more, whichever is later.  This initializes reclaim_at, so it
+ * must be a #define (and not a const int) due to restrictions in the C
+ * language. */
+#define RECLAIM_BATCH 64
+
+/* Registered reader thread */
+typedef struct EpochThread {
+    struct EpochThread *next;
+    atomic_ulong seen;  // last epoch observed at a quiescent point
+} EpochThread;
+
+/* Global epoch; only advanced by epoch_retire(). */
+static atomic_ulong global_epoch = 1;
+
+/* Registered threads and retired entries, protected by epoch_lock. */
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static EpochThread *threads = NULL;
+static EpochEntry *retired = NULL;
+static int retired_count = 0;
+static int reclaim_at = RECLAIM_BATCH;  // retired_count that triggers a scan
+
+/* Epoch of the oldest retired entry, or ULONG_MAX if there are none.
+ * Written under epoch_lock, read without it by epoch_quiescent(). */
+static atomic_ulong oldest_retired = ULONG_MAX;
+
+/* This thread's registration, or NULL. */
+static _Thread_local EpochThread *self = NULL;
+
+/*
+ * Registers the calling thread as a reader.  Registering twice has no
+ * effect.  If memory is exhausted, the thread is not registered and
+ * must not hold references across another thread's epoch_retire().
+ */
+void epoch_register(void) {
+    EpochThread *thr;
+
+    if (self != NULL) {
+        return;
+    }
+    thr = malloc(sizeof(EpochThread));
+    if (thr == NULL) {
+        return;
+    }
+    atomic_init(&thr->seen, atomic_load(&global_epoch));
+
+    pthread_mutex_lock(&epoch_lock);
+    thr->next = threads;
+    threads = thr;
+    pthread_mutex_unlock(&epoch_lock);
+
+    self = thr;
+}
+
+/*
+ * Unregisters the calling thread.  The thread must hold no references
+ * to shared objects, exactly as at a quiescent point.
+ */
+void epoch_unregister(void) {
+    EpochThread **link;
+
+    if (self == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&epoch_lock);
+    for (link = &threads; *link != NULL; link = &(*link)->next) {
+        if (*link == self) {
+            *link = self->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&epoch_lock);
+
+    free(self);
+    self = NULL;
+    epoch_reclaim();
+}
+
+/*
+ * Declares that the calling thread holds no references to shared
+ * objects.  This should be called regularly, e.g. once per event loop
+ * iteration; objects retired by other threads are not reclaimed until
+ * every registered thread has called it.  If this thread had not yet
+ * passed the oldest retired object, the objects it may have been
+ * holding back are reclaimed here, so reclaim functions can run on
+ * any reader thread.
+ *
+ * The release store orders every earlier access to shared objects
+ * before the announcement, and on common hardware is a plain store.
+ */
+void epoch_quiescent(void) {
+    unsigned long before;
+    unsigned long now;
+
+    if (self == NULL) {
+        return;
+    }
+    before = atomic_load_explicit(&self->seen, memory_order_relaxed);
+    now = atomic_load_explicit(&global_epoch, memory_order_acquire);
+    atomic_store_explicit(&self->seen, now, memory_order_release);
+    if (before <= atomic_load_explicit(&oldest_retired,
+                                       memory_order_relaxed)
+        && now > atomic_load_explicit(&oldest_retired,
+                                      memory_order_relaxed)) {
+        epoch_reclaim();
+    }
+}
+
+/*
+ * Retires an object that has already been unlinked from every shared
+ * structure.  reclaim is called with entry once no registered thread
+ * can still hold a reference, possibly from another thread.
+ *
+ * entry:   the reclamation record embedded in the retired object
+ * reclaim: the function that frees the object
+ */
+void epoch_retire(EpochEntry *entry, void (*reclaim)(EpochEntry *entry)) {
+    bool flush;
+
+    entry->reclaim = reclaim;
+
+    pthread_mutex_lock(&epoch_lock);
+    entry->epoch = atomic_fetch_add(&global_epoch, 1);
+    if (retired == NULL) {
+        atomic_store(&oldest_retired, entry->epoch);
+    }
+    entry->next = retired;
+    retired = entry;
+    retired_count++;
+    flush = threads == NULL || retired_count >= reclaim_at;
+    pthread_mutex_unlock(&epoch_lock);
+
+    if (flush) {
+        epoch_reclaim();
+    }
+}
+
+/*
+ * Reclaims every retired object that no registered thread can still
+ * reference.  Returns the number of objects reclaimed.
+ */
+int epoch_reclaim(void) {
+    unsigned long oldest = atomic_load(&global_epoch);
+    unsigned long left = ULONG_MAX;  // oldest epoch left retired
+    EpochEntry *ready = NULL;
+    EpochEntry **link;
+    EpochEntry *entry;
+    EpochThread *thr;
+    int count = 0;
+
+    pthread_mutex_lock(&epoch_lock);
+    for (thr = threads; thr != NULL; thr = thr->next) {
+        unsigned long seen = atomic_load_explicit(&thr->seen,
+                                                  memory_order_acquire);
+        if (seen < oldest) {
+            oldest = seen;
+        }
+    }
+
+    link = &retired;
+    while (*link != NULL) {
+        entry = *link;
+        if (entry->epoch < oldest) {
+            *link = entry->next;
+            entry->next = ready;
+            ready = entry;
+            retired_count--;
+        } else {
+            if (entry->epoch < left) {
+                left = entry->epoch;
+            }
+            link = &entry->next;
+        }
+    }
+    atomic_store(&oldest_retired, left);
+    reclaim_at = 2 * retired_count > RECLAIM_BATCH ? 2 * retired_count
+                                                   : RECLAIM_BATCH;
+    pthread_mutex_unlock(&epoch_lock);
+
+    /* Reclaim outside the lock; reclaim functions may take their own. */
+    while (ready != NULL) {
+        entry = ready;
+        ready = entry->next;
+        entry->reclaim(entry);
+        count++;
+    }
+
+    return count;
+}
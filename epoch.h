@@ -0,0 +1,40 @@
+/* agent <agent@local>
+ * Epoch-based deferred reclamation of shared objects.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the epoch-based deferred reclamation functions in epoch.c.
+ */
+
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/* Deferred reclamation record
+ *
+ * An object that may be retired embeds one of these.  The fields are
+ * private to epoch.c; they are only visible here so that the record can
+ * be embedded without a separate allocation.
+ */
+typedef struct EpochEntry {
+    struct EpochEntry *next;
+    void (*reclaim)(struct EpochEntry *entry);
+    unsigned long epoch;
+} EpochEntry;
+
+/*
+ * Reader threads register once, call epoch_quiescent() whenever they
+ * hold no references to shared objects, and unregister before exiting.
+ * Between quiescent points they may use any object they found without
+ * locks or atomic operations.
+ */
+
+void epoch_register(void);
+
+void epoch_unregister(void);
+
+void epoch_quiescent(void);
+
+void epoch_retire(EpochEntry *entry, void (*reclaim)(EpochEntry *entry));
+
+int epoch_reclaim(void);
+
+#endif /* EPOCH_H_ */
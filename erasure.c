@@ -0,0 +1,456 @@
+/* agent <agent@local>
+ * Reed-Solomon erasure coding of IOBuffer blocks.
+ *
+ * Instead of writing three full copies of each block, a block is split
+ * into k data shards and m parity shards are computed from them, so
+ * that the block survives the loss of any m shards at a storage cost of
+ * (k + m) / k.
+ *
+ * Arithmetic is in GF(2^8) with the polynomial x^8 + x^4 + x^3 + x + 1
+ * (0x11B), the one built into the GFNI instructions.  The code is
+ * systematic: data shards are stored as they are, and parity shard j is
+ * the sum over data shards i of C[j][i] times shard i, where C is the
+ * Cauchy matrix C[j][i] = 1 / ((k + j) xor i).  Every k rows of the
+ * identity stacked on a Cauchy matrix are independent, so any k
+ * surviving shards determine the rest.
+ *
+ * All of the work is multiplying a whole shard by a constant and adding
+ * (xor) it into another.  With GFNI, one instruction multiplies 32
+ * bytes by a constant.  Otherwise, the product of a constant c and a
+ * byte b is split by nibbles, c * b = c * (b & 0xF) xor c * (b & 0xF0),
+ * and each half is a 16-entry table lookup, so two PSHUFBs multiply 32
+ * (AVX2) or 16 (SSSE3) bytes at once.  The tables for the encoding
+ * coefficients are built once per code.
+ *
+ * Data shards are views into the block's own IOBuffer, padded with zeros
+ * to a multiple of k bytes; only parity is written to new memory.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__GFNI__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include "erasure.h"
+
+/* Bytes of multiplication table per coefficient: 16 low-nibble
+ * products and 16 high-nibble products */
+#define GF_TABLE_SIZE 32
+
+/* Low byte of the field polynomial 0x11B */
+static const uint8_t GF_POLYNOMIAL = 0x1B;
+
+/* Powers of 3, which generates the multiplicative group of the field,
+ * repeated so that a sum of two logarithms indexes it */
+static uint8_t gf_exp[2 * 255];
+static uint8_t gf_log[256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+/* A k data plus m parity shard code */
+struct _ErasureCode {
+    int k;
+    int m;
+    uint8_t *matrix;  // m x k parity coefficients
+    uint8_t *tables;  // GF_TABLE_SIZE bytes per coefficient
+};
+
+/*
+ * Multiplies by x (that is, 2) in the field.
+ */
+static uint8_t gf_xtime(uint8_t a) {
+    return (a << 1) ^ (a & 0x80 ? GF_POLYNOMIAL : 0);
+}
+
+/*
+ * Fills the exponent and logarithm tables.
+ */
+static void gf_init(void) {
+    uint8_t x = 1;
+
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x = gf_xtime(x) ^ x;  // times 3
+    }
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+/*
+ * Builds the nibble multiplication table for coefficient c.
+ */
+static void gf_table(uint8_t c, uint8_t *table) {
+    for (int i = 0; i < 16; i++) {
+        table[i] = gf_mul(c, i);
+        table[16 + i] = gf_mul(c, i << 4);
+    }
+}
+
+/*
+ * Multiplies len bytes of src by c and stores the result in dst, or
+ * adds it to dst if accumulate is true.  table is the nibble table for
+ * c.
+ */
+static void gf_region(uint8_t c, const uint8_t *table, char *dst,
+                      const char *src, size_t len, bool accumulate) {
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    size_t i = 0;
+    uint8_t product;
+
+#if defined(__GFNI__) && defined(__AVX2__)
+    __m256i coef = _mm256_set1_epi8(c);
+
+    (void)table;
+    for (; i + 32 <= len; i += 32) {
+        __m256i p = _mm256_gf2p8mul_epi8(
+            _mm256_loadu_si256((const __m256i *)(s + i)), coef);
+
+        if (accumulate) {
+            p = _mm256_xor_si256(p,
+                                 _mm256_loadu_si256((const __m256i *)(d + i)));
+        }
+        _mm256_storeu_si256((__m256i *)(d + i), p);
+    }
+#elif defined(__AVX2__)
+    __m256i lo = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)table));
+    __m256i hi = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)(table + 16)));
+    __m256i mask = _mm256_set1_epi8(0x0F);
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i p = _mm256_xor_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(in, mask)),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(
+                _mm256_srli_epi64(in, 4), mask)));
+
+        if (accumulate) {
+            p = _mm256_xor_si256(p,
+                                 _mm256_loadu_si256((const __m256i *)(d + i)));
+        }
+        _mm256_storeu_si256((__m256i *)(d + i), p);
+    }
+#elif defined(__SSSE3__)
+    __m128i lo = _mm_loadu_si128((const __m128i *)table);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(table + 16));
+    __m128i mask = _mm_set1_epi8(0x0F);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i p = _mm_xor_si128(
+            _mm_shuffle_epi8(lo, _mm_and_si128(in, mask)),
+            _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(in, 4), mask)));
+
+        if (accumulate) {
+            p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i *)(d + i)));
+        }
+        _mm_storeu_si128((__m128i *)(d + i), p);
+    }
+#endif
+    for (; i < len; i++) {
+        product = table[s[i] & 0x0F] ^ table[16 + (s[i] >> 4)];
+        d[i] = accumulate ? d[i] ^ product : product;
+    }
+    (void)c;
+}
+
+/* Create an erasure code with k data shards and m parity shards.
+ *
+ * This function returns NULL with errno set to EINVAL if k and m are
+ * not positive or k + m exceeds ERASURE_MAX_SHARDS, or to ENOMEM if
+ * memory is exhausted.
+ */
+ErasureCode *erasure_create(int k, int m) {
+    ErasureCode *ec;
+
+    if (k < 1 || m < 1 || k + m > ERASURE_MAX_SHARDS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    pthread_once(&gf_once, gf_init);
+
+    ec = calloc(1, sizeof(ErasureCode));
+    if (ec == NULL) {
+        return NULL;
+    }
+    ec->k = k;
+    ec->m = m;
+    ec->matrix = malloc(m * k);
+    ec->tables = malloc(m * k * GF_TABLE_SIZE);
+    if (ec->matrix == NULL || ec->tables == NULL) {
+        erasure_destroy(ec);
+        return NULL;
+    }
+    for (int j = 0; j < m; j++) {
+        for (int i = 0; i < k; i++) {
+            ec->matrix[j * k + i] = gf_inv((k + j) ^ i);
+            gf_table(ec->matrix[j * k + i],
+                     &ec->tables[(j * k + i) * GF_TABLE_SIZE]);
+        }
+    }
+
+    return ec;
+}
+
+/*
+ * Frees an erasure code.
+ */
+void erasure_destroy(ErasureCode *ec) {
+    if (ec == NULL) {
+        return;
+    }
+    free(ec->matrix);
+    free(ec->tables);
+    free(ec);
+}
+
+/*
+ * Returns the size of each shard of a len-byte block: len / k, rounded
+ * up.
+ */
+size_t erasure_shard_size(ErasureCode *ec, size_t len) {
+    return (len + ec->k - 1) / ec->k;
+}
+
+/* Compute parity shards.
+ *
+ * data:   k data shards
+ * parity: space for m parity shards
+ * size:   the size of every shard
+ */
+void erasure_encode(ErasureCode *ec, char *const *data, char *const *parity,
+                    size_t size) {
+    int k = ec->k;
+
+    for (int j = 0; j < ec->m; j++) {
+        for (int i = 0; i < k; i++) {
+            gf_region(ec->matrix[j * k + i],
+                      &ec->tables[(j * k + i) * GF_TABLE_SIZE], parity[j],
+                      data[i], size, i > 0);
+        }
+    }
+}
+
+/*
+ * Inverts the n x n matrix a into inverse by Gauss-Jordan elimination.
+ * a is destroyed.  Returns false if a is singular.
+ */
+static bool gf_invert(uint8_t *a, uint8_t *inverse, int n) {
+    uint8_t scale;
+    uint8_t factor;
+    uint8_t tmp;
+    int pivot;
+
+    memset(inverse, 0, n * n);
+    for (int i = 0; i < n; i++) {
+        inverse[i * n + i] = 1;
+    }
+    for (int col = 0; col < n; col++) {
+        pivot = col;
+        while (pivot < n && a[pivot * n + col] == 0) {
+            pivot++;
+        }
+        if (pivot == n) {
+            return false;
+        }
+        for (int j = 0; j < n && pivot != col; j++) {
+            tmp = a[col * n + j];
+            a[col * n + j] = a[pivot * n + j];
+            a[pivot * n + j] = tmp;
+            tmp = inverse[col * n + j];
+            inverse[col * n + j] = inverse[pivot * n + j];
+            inverse[pivot * n + j] = tmp;
+        }
+        scale = gf_inv(a[col * n + col]);
+        for (int j = 0; j < n; j++) {
+            a[col * n + j] = gf_mul(a[col * n + j], scale);
+            inverse[col * n + j] = gf_mul(inverse[col * n + j], scale);
+        }
+        for (int row = 0; row < n; row++) {
+            factor = a[row * n + col];
+            if (row == col || factor == 0) {
+                continue;
+            }
+            for (int j = 0; j < n; j++) {
+                a[row * n + j] ^= gf_mul(factor, a[col * n + j]);
+                inverse[row * n + j] ^= gf_mul(factor, inverse[col * n + j]);
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Rebuild missing shards.
+ *
+ * Missing data shards are solved for from the first k shards present,
+ * and missing parity shards are then recomputed from the data.
+ *
+ * This function returns 0, or -1 with errno set to EINVAL if fewer than
+ * k shards are present, or ENOMEM if memory is exhausted.
+ *
+ * shards:  k data then m parity shards; missing ones are overwritten
+ * present: whether each shard is intact
+ * size:    the size of every shard
+ */
+int erasure_reconstruct(ErasureCode *ec, char *const *shards,
+                        const bool *present, size_t size) {
+    int k = ec->k;
+    int n = k + ec->m;
+    int rows[ERASURE_MAX_SHARDS];
+    int nrows = 0;
+    bool data_missing = false;
+    uint8_t table[GF_TABLE_SIZE];
+    uint8_t *a;
+    uint8_t *inverse;
+    uint8_t coef;
+    bool first;
+
+    for (int i = 0; i < n && nrows < k; i++) {
+        if (present[i]) {
+            rows[nrows++] = i;
+        }
+    }
+    if (nrows < k) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i = 0; i < k; i++) {
+        data_missing |= !present[i];
+    }
+
+    if (data_missing) {
+        /* The rows of the generator matrix for the chosen shards. */
+        a = malloc(k * k);
+        inverse = malloc(k * k);
+        if (a == NULL || inverse == NULL) {
+            free(a);
+            free(inverse);
+            return -1;
+        }
+        for (int r = 0; r < k; r++) {
+            for (int c = 0; c < k; c++) {
+                a[r * k + c] = rows[r] < k ? rows[r] == c
+                                           : ec->matrix[(rows[r] - k) * k + c];
+            }
+        }
+        if (!gf_invert(a, inverse, k)) {
+            free(a);
+            free(inverse);
+            errno = EINVAL;  // cannot happen for a Cauchy code
+            return -1;
+        }
+        for (int i = 0; i < k; i++) {
+            if (present[i]) {
+                continue;
+            }
+            first = true;
+            for (int r = 0; r < k; r++) {
+                coef = inverse[i * k + r];
+                if (coef == 0) {
+                    continue;
+                }
+                gf_table(coef, table);
+                gf_region(coef, table, shards[i], shards[rows[r]], size,
+                          !first);
+                first = false;
+            }
+            if (first) {
+                memset(shards[i], 0, size);
+            }
+        }
+        free(a);
+        free(inverse);
+    }
+
+    for (int j = 0; j < ec->m; j++) {
+        if (present[k + j]) {
+            continue;
+        }
+        for (int i = 0; i < k; i++) {
+            gf_region(ec->matrix[j * k + i],
+                      &ec->tables[(j * k + i) * GF_TABLE_SIZE],
+                      shards[k + j], shards[i], size, i > 0);
+        }
+    }
+
+    return 0;
+}
+
+/* Erasure-code the contents of an IOBuffer.
+ *
+ * The block is padded with zeros to k * erasure_shard_size() bytes, and
+ * its k data shards are views of its contents.  Each parity shard is
+ * written directly into the free space of one of the parity buffers and
+ * appended to it.  The caller must record the original block length to
+ * strip the padding after reconstruction.  The views are valid until
+ * the buffers are next modified.
+ *
+ * This function returns 0, or -1 with errno set to ENOBUFS if a buffer
+ * is too full, or ENOMEM if storage cannot be allocated; on failure no
+ * buffer's contents are changed.
+ *
+ * ec:     the code
+ * block:  the buffer to encode
+ * parity: m buffers to append parity shards to, distinct from each
+ *         other and from block
+ * shards: set to views of the k data and m parity shards
+ */
+int erasure_encode_buffer(ErasureCode *ec, IOBuffer *block,
+                          IOBuffer *const *parity, ErasureShard *shards) {
+    size_t len = iobuffer_length(block);
+    size_t size = erasure_shard_size(ec, len);
+    size_t pad = size * ec->k - len;
+    char *data[ERASURE_MAX_SHARDS];
+    char *space;
+
+    /* Reserve everything before committing anything, so that a failure
+     * leaves every buffer's contents as they were. */
+    for (int j = 0; j < ec->m; j++) {
+        data[ec->k + j] = iobuffer_reserve(parity[j], size, NULL);
+        if (data[ec->k + j] == NULL) {
+            return -1;
+        }
+    }
+    if (pad > 0) {
+        space = iobuffer_reserve(block, pad, NULL);
+        if (space == NULL) {
+            return -1;
+        }
+        memset(space, 0, pad);
+        iobuffer_commit(block, pad);
+    }
+    for (int i = 0; i < ec->k; i++) {
+        data[i] = iobuffer_data(block) + i * size;
+    }
+
+    erasure_encode(ec, data, &data[ec->k], size);
+    for (int j = 0; j < ec->m; j++) {
+        iobuffer_commit(parity[j], size);
+    }
+    for (int i = 0; i < ec->k + ec->m; i++) {
+        shards[i].data = data[i];
+        shards[i].length = size;
+    }
+
+    return 0;
+}
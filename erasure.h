@@ -0,0 +1,46 @@
+/* agent <agent@local>
+ * Reed-Solomon erasure coding of IOBuffer blocks.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in erasure.c.
+ */
+
+#ifndef ERASURE_H_
+#define ERASURE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "example.h"
+
+/* Most data plus parity shards in one code */
+#define ERASURE_MAX_SHARDS 255
+
+/* One shard, as a view into IOBuffer contents */
+typedef struct {
+    char *data;
+    size_t length;
+} ErasureShard;
+
+/* A k data plus m parity shard code
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _ErasureCode ErasureCode;
+
+ErasureCode *erasure_create(int k, int m);
+
+void erasure_destroy(ErasureCode *ec);
+
+size_t erasure_shard_size(ErasureCode *ec, size_t len);
+
+void erasure_encode(ErasureCode *ec, char *const *data, char *const *parity,
+                    size_t size);
+
+int erasure_reconstruct(ErasureCode *ec, char *const *shards,
+                        const bool *present, size_t size);
+
+int erasure_encode_buffer(ErasureCode *ec, IOBuffer *block,
+                          IOBuffer *const *parity, ErasureShard *shards);
+
+#endif /* ERASURE_H_ */
@@ -52,13 +52,30 @@
  * dependency-provided includes, followed by local includes.  Unused
  * headers should be pruned.
  */
+#define _GNU_SOURCE  /* for vmsplice() and splice() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <linux/mempolicy.h>
+
 /* If we had a library include, it would be here. */
 // #include <libwhatever.h>
 
+#include "epoch.h"
 #include "example.h"
 
 /*
@@ -83,10 +100,44 @@
  */
 #define MAX_BUFSIZE 8192
 
+/* Size of the storage inside the IOBuffer itself, used until a buffer
+ * needs more.  Two cache lines hold a typical control message with its
+ * headers, and keep an idle control connection's buffer to under 200
+ * bytes instead of MAX_BUFSIZE.  This is an array size, so it is a
+ * #define.
+ */
+#define INLINE_BUFSIZE 128
+
+/* Number of NUMA nodes with their own storage pool.  This is the size
+ * of an array, and one unsigned long of mbind() node mask. */
+#define MAX_POOL_NODES 64
+
+/* Maximum number of idle storage blocks kept for reuse per node.
+ * Sixty-four blocks is half a megabyte, which covers the flush bursts
+ * of a busy splicer without holding on to peak-era memory forever. */
+static const int STORAGE_POOL_MAX = 64;
+
 /* Global mutable declared in myproject.h.  Indicates whether
  * initialization has been completed or not.  */
 bool initialized = false;
 
+/* Idle storage blocks on one NUMA node, linked through their first
+ * bytes.  Buffers are reclaimed on whichever thread runs
+ * epoch_reclaim(), so the list is protected by a lock. */
+typedef struct {
+    pthread_mutex_t lock;
+    char *free;
+    int count;
+} StoragePool;
+
+/* Per-node storage pools, initialized once by storage_init(). */
+static pthread_once_t storage_once = PTHREAD_ONCE_INIT;
+static StoragePool storage_pools[MAX_POOL_NODES];
+
+/* NUMA node whose pool this thread allocates from, or -1 if the thread
+ * has not been bound to one with iobuffer_pool_bind_node(). */
+static _Thread_local int storage_node = -1;
+
 /* Type definitions should appear after constants and global, unless a
  * type is required to define a constant or global, in which case it
  * should appear immediately before it is first required.
@@ -95,10 +146,58 @@ bool initialized = false;
  * unions, etc. should appear on the first line of the declaration.
  */
 
-/* I/O management buffer */
+/* Watermarks and subscribers of one IOBuffer.  Most buffers are never
+ * watched, so this is allocated on first use rather than carried in
+ * every IOBuffer. */
+typedef struct {
+    size_t low;              // IOBUFFER_LOW at or below this, if non-empty
+    size_t high;             // IOBUFFER_HIGH at or above this, if not full
+    bool above_high;         // HIGH reported, LOW not yet reported
+    unsigned events;         // IOBufferEvent bits passed to func
+    IOBufferWatchFunc func;  // or NULL
+    void *arg;
+    unsigned efd_events;     // IOBufferEvent bits signalled on efd
+    int efd;                 // eventfd, or -1
+} IOBufferWatch;
+
+/* I/O management buffer
+ *
+ * A new buffer stores data in inline_buffer.  Once it needs more room,
+ * it moves to a separate page-aligned block of MAX_BUFSIZE bytes from
+ * the storage pool, which can also be handed to the kernel by
+ * iobuffer_splice() and replaced without moving the IOBuffer itself.
+ */
 struct _IOBuffer {
-    char buffer[MAX_BUFSIZE];
-    int bufused;
+    char *buffer;       // inline_buffer or pool storage
+    int node;           // pool node of buffer, or -1
+    int bufsize;        // INLINE_BUFSIZE or MAX_BUFSIZE
+    int bufstart;       // offset of the first unconsumed byte
+    int bufused;        // offset just past the last buffered byte
+    IOBufferWatch *watch;  // NULL until watermarks or a watch are set
+    EpochEntry retire;  // used once iobuffer_destroy() is called
+    char inline_buffer[INLINE_BUFSIZE];
+};
+
+/* The fields ahead of inline_buffer should fit in one cache line. */
+_Static_assert(sizeof(IOBuffer) <= INLINE_BUFSIZE + 64,
+               "IOBuffer control fields outgrew a cache line");
+
+/* Storage handed to a pipe, waiting for the reader to consume it */
+typedef struct PendingStorage {
+    struct PendingStorage *next;
+    char *storage;
+    int node;
+    unsigned long long mark;  // pipe byte count at which it is released
+} PendingStorage;
+
+/* vmsplice() output path from IOBuffers to a file descriptor */
+struct _IOBufferSplicer {
+    int outfd;
+    int pipefd[2];                // intermediate pipe, or -1 if outfd is one
+    unsigned long long written;   // total bytes placed in the pipe
+    size_t backlog;               // bytes in the intermediate pipe
+    PendingStorage *pending;      // oldest first
+    PendingStorage *pending_tail;
 };
 
 /*
@@ -114,9 +213,105 @@ struct _IOBuffer {
  * application immediately follow the function name.
  */
 
+/*
+ * Initializes the storage pool locks.  Called through pthread_once().
+ */
+static void storage_init(void) {
+    for (int node = 0; node < MAX_POOL_NODES; node++) {
+        pthread_mutex_init(&storage_pools[node].lock, NULL);
+        storage_pools[node].free = NULL;
+        storage_pools[node].count = 0;
+    }
+}
+
+/*
+ * Returns the pool for a given node, where -1 (no binding) shares the
+ * pool of node 0.
+ */
+static StoragePool *storage_pool(int node) {
+    pthread_once(&storage_once, storage_init);
+
+    return &storage_pools[node < 0 ? 0 : node];
+}
+
+/*
+ * Returns a page-aligned storage block of MAX_BUFSIZE bytes, reusing an
+ * idle block from the given node's pool when one is available, or NULL
+ * if memory is exhausted.
+ *
+ * Blocks come from mmap() rather than malloc() so that a block gifted
+ * to the kernel can be unmapped without the allocator ever handing its
+ * pages out again.  New blocks for a bound node are given a preferred
+ * memory policy for that node; failure to set it (e.g., on kernels
+ * without NUMA support) is not an error.
+ */
+static char *storage_get(int node) {
+    StoragePool *pool = storage_pool(node);
+    unsigned long nodemask;
+    char *storage;
+
+    pthread_mutex_lock(&pool->lock);
+    storage = pool->free;
+    if (storage != NULL) {
+        memcpy(&pool->free, storage, sizeof(pool->free));
+        pool->count--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (storage != NULL) {
+        return storage;
+    }
+
+    storage = mmap(NULL, MAX_BUFSIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (storage == MAP_FAILED) {
+        return NULL;
+    }
+    if (node >= 0) {
+        nodemask = 1UL << node;
+        syscall(SYS_mbind, storage, MAX_BUFSIZE, MPOL_PREFERRED, &nodemask,
+                sizeof(nodemask) * CHAR_BIT + 1, 0);
+    }
+
+    return storage;
+}
+
+/*
+ * Returns a storage block obtained from storage_get() to the idle list
+ * of the node it was allocated for, or unmaps it if that list is
+ * already at STORAGE_POOL_MAX.
+ */
+static void storage_put(char *storage, int node) {
+    StoragePool *pool = storage_pool(node);
+
+    if (storage == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count < STORAGE_POOL_MAX) {
+        memcpy(storage, &pool->free, sizeof(pool->free));
+        pool->free = storage;
+        pool->count++;
+        storage = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (storage != NULL) {
+        munmap(storage, MAX_BUFSIZE);
+    }
+}
+
+/*
+ * Returns true if a given IOBuffer is using its inline storage.
+ */
+static bool iobuffer_inline(IOBuffer *buf) {
+    return buf->buffer == buf->inline_buffer;
+}
+
 /*
  * Allocates and returns an I/O buffer.  The buffer will be empty and
- * ready for use.
+ * ready for use.  It uses its small inline storage until it holds more
+ * than INLINE_BUFSIZE bytes, and then moves to pool storage.
  *
  * It is good style to include (void) in the argument list of a function
  * that actually takes no arguments, due to unfortunate pre-ANSI
@@ -132,15 +327,43 @@ IOBuffer *iobuffer_create(void) {
      * time. */
     IOBuffer *buf = malloc(sizeof(IOBuffer));
 
+    if (buf == NULL) {
+        return NULL;
+    }
+    buf->node = storage_node;
+    buf->buffer = buf->inline_buffer;
+    buf->bufsize = INLINE_BUFSIZE;
+    buf->bufstart = 0;
     buf->bufused = 0;
+    buf->watch = NULL;
 
     return buf;
 }
 
 /*
- * Frees an I/O buffer allocated by iobuffer_create().
+ * Returns the storage of a retired IOBuffer to the pool and frees it.
+ * Called by epoch_reclaim() once no reader can still see the buffer.
+ */
+static void iobuffer_reclaim(EpochEntry *entry) {
+    IOBuffer *buf = (IOBuffer *)((char *)entry - offsetof(IOBuffer, retire));
+
+    if (!iobuffer_inline(buf)) {
+        storage_put(buf->buffer, buf->node);
+    }
+    free(buf->watch);
+    free(buf);
+}
+
+/*
+ * Retires an I/O buffer allocated by iobuffer_create().
+ *
+ * The caller must already have removed the buffer from any structure
+ * through which other threads find it.  Threads registered with
+ * epoch_register() may continue to use the buffer until their next
+ * epoch_quiescent(); its memory returns to the pool after that.  With
+ * no registered threads, the buffer is freed immediately.
  *
- * The I/O buffer cannot be used after this call completes.
+ * The I/O buffer cannot be used by the caller after this call.
  */
 void iobuffer_destroy(IOBuffer *buf) {
     /* Conditionals and loops have one space between the keyword and the
@@ -149,32 +372,119 @@ void iobuffer_destroy(IOBuffer *buf) {
      *
      * Comparisons with NULL are explicit. */
     if (buf != NULL) {
-        free(buf);
+        epoch_retire(&buf->retire, iobuffer_reclaim);
     }
 }
 
+/*
+ * Reports the transitions between a buffer length of before and the
+ * current length to a watched buffer's subscribers.  See
+ * iobuffer_watch().
+ */
+static void iobuffer_notify(IOBuffer *buf, size_t before) {
+    IOBufferWatch *w = buf->watch;
+    size_t after = iobuffer_length(buf);
+    unsigned events = 0;
+    uint64_t one = 1;
+
+    if (before == 0 && after > 0) {
+        events |= IOBUFFER_EVENT_DATA;
+    } else if (before > 0 && after == 0) {
+        events |= IOBUFFER_EVENT_EMPTY;
+    }
+    if (before < w->high && after >= w->high) {
+        events |= IOBUFFER_EVENT_HIGH;
+        w->above_high = true;
+    }
+    if (before < MAX_BUFSIZE && after == MAX_BUFSIZE) {
+        events |= IOBUFFER_EVENT_FULL;
+    }
+    if (w->above_high && after <= w->low) {
+        events |= IOBUFFER_EVENT_LOW;
+        w->above_high = false;
+    }
+
+    if (w->func != NULL && (events & w->events) != 0) {
+        w->func(buf, events & w->events, w->arg);
+    }
+    if (w->efd >= 0 && (events & w->efd_events) != 0) {
+        if (write(w->efd, &one, sizeof(one)) < 0) {
+            /* The counter cannot overflow in practice; nothing to do. */
+        }
+    }
+}
+
+/*
+ * Called after every change to the length of a given IOBuffer, with
+ * the length before the change.  Unwatched buffers pay one test.
+ */
+static void iobuffer_changed(IOBuffer *buf, size_t before) {
+    if (buf->watch != NULL) {
+        iobuffer_notify(buf, before);
+    }
+}
+
+/*
+ * Makes a given IOBuffer ready to take up to bytes more data at its
+ * end, and at least need bytes.  Unconsumed data is moved to the front
+ * if there is not enough room after it, and an inline buffer that
+ * cannot take need bytes moves to pool storage.  Returns < 0 with errno
+ * set if storage cannot be allocated, or the number of bytes that can
+ * now be stored, which is at most bytes.
+ */
+static int iobuffer_prepare(IOBuffer *buf, size_t bytes, size_t need) {
+    size_t length = iobuffer_length(buf);
+    char *storage;
+
+    if ((size_t)(buf->bufsize - buf->bufused) < bytes
+        && buf->bufstart > 0) {
+        memmove(buf->buffer, buf->buffer + buf->bufstart, length);
+        buf->bufused = length;
+        buf->bufstart = 0;
+    }
+
+    if ((size_t)(buf->bufsize - buf->bufused) < need
+        && iobuffer_inline(buf)) {
+        storage = storage_get(buf->node);
+        if (storage == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(storage, buf->buffer, length);
+        buf->buffer = storage;
+        buf->bufsize = MAX_BUFSIZE;
+    }
+
+    if ((size_t)(buf->bufsize - buf->bufused) < bytes) {
+        return buf->bufsize - buf->bufused;
+    }
+    return bytes;
+}
+
 /* Read a given number of bytes into a buffer from an open file descriptor.
  *
  * This function returns < 0 on error, 0 if the buffer is full, or the
  * number of bytes read on a successful read.  The number of bytes read
  * may be less than requested if there is not enough space in the buffer
- * or EOF is reached.
+ * or EOF is reached.  Unconsumed data may be moved to the start of the
+ * buffer to make room, invalidating pointers from iobuffer_data().  A
+ * buffer still using inline storage reads only what fits there, and
+ * moves to pool storage once the inline storage is full.  This keeps
+ * idle connections small, at the cost of one extra short read() at the
+ * start of a bulk transfer, which fills the inline storage before the
+ * buffer moves to pool storage.
  *
  * buf:   the buffer to fill
  * fd:    the file descriptor from which to read
  * bytes: the number of bytes to read
  */
 int iobuffer_read(IOBuffer *buf, int fd, size_t bytes) {
-    size_t to_read; // may be < bytes if the buffer is full
-    int result;     // will hold read result
+    int to_read; // may be < bytes if the buffer is full
+    int result;  // will hold read result
 
-    if (MAX_BUFSIZE - buf->bufused < bytes) {
-        to_read = MAX_BUFSIZE - buf->bufused;
-        if (to_read == 0) { // The buffer is completely full already
-            return 0;
-        }
-    } else {
-        to_read = bytes;
+    to_read = iobuffer_prepare(buf, bytes, bytes > 0);
+    if (to_read <= 0) { // Out of memory, or completely full already
+        return to_read;
     }
 
     result = read(fd, buf->buffer + buf->bufused, to_read);
@@ -184,14 +494,104 @@ int iobuffer_read(IOBuffer *buf, int fd, size_t bytes) {
     }
 
     buf->bufused += result;
+    iobuffer_changed(buf, buf->bufused - buf->bufstart - result);
 
     return result;
 }
 
+/* Read a given number of bytes into a buffer from a given offset in an
+ * open file, without changing the file offset.
+ *
+ * This function behaves as iobuffer_read(), except that it uses
+ * pread(), and that a buffer using inline storage moves to pool storage
+ * if the request does not fit inline; positional reads are file I/O,
+ * and are not expected to be small.
+ *
+ * buf:    the buffer to fill
+ * fd:     the file descriptor from which to read
+ * bytes:  the number of bytes to read
+ * offset: the file offset at which to start reading
+ */
+int iobuffer_pread(IOBuffer *buf, int fd, size_t bytes, off_t offset) {
+    int to_read;
+    int result;
+
+    to_read = iobuffer_prepare(buf, bytes,
+                               bytes < MAX_BUFSIZE ? bytes : MAX_BUFSIZE);
+    if (to_read <= 0) {
+        return to_read;
+    }
+
+    result = pread(fd, buf->buffer + buf->bufused, to_read, offset);
+    if (result < 0) {
+        return result;
+    }
+    buf->bufused += result;
+    iobuffer_changed(buf, buf->bufused - buf->bufstart - result);
+
+    return result;
+}
+
+/* Read a given number of bytes into caller memory, bypassing the buffer.
+ *
+ * Any data already buffered is moved to dst first.  The rest is read
+ * with a single readv() straight into dst, so a large payload is copied
+ * only once.  The buffer's free space is the second element of the
+ * readv() vector, so bytes following the payload land in the buffer
+ * rather than costing another system call.
+ *
+ * This function returns < 0 on error, or the number of bytes stored in
+ * dst.  This may be less than requested if EOF is reached or the read
+ * was short; the caller calls again with the remainder.  An error after
+ * buffered data was moved is reported by the next call.
+ *
+ * buf:   the buffer, possibly holding the start of the payload
+ * fd:    the file descriptor from which to read
+ * dst:   where to store the payload
+ * bytes: the number of bytes to store in dst
+ */
+ssize_t iobuffer_read_into(IOBuffer *buf, int fd, void *dst,
+                           size_t bytes) {
+    size_t copied = iobuffer_length(buf);
+    struct iovec iov[2];
+    ssize_t result;
+
+    if (copied > bytes) {
+        copied = bytes;
+    }
+    if (copied > 0) {
+        memcpy(dst, iobuffer_data(buf), copied);
+        iobuffer_consume(buf, copied);
+    }
+    if (copied == bytes) {
+        return copied;
+    }
+
+    /* The buffer is now empty, so all of its storage is free space. */
+    iov[0].iov_base = (char *)dst + copied;
+    iov[0].iov_len = bytes - copied;
+    iov[1].iov_base = buf->buffer;
+    iov[1].iov_len = buf->bufsize;
+
+    result = readv(fd, iov, 2);
+    if (result < 0) {
+        return copied > 0 ? (ssize_t)copied : result;
+    }
+    if ((size_t)result > iov[0].iov_len) {
+        buf->bufused = (size_t)result - iov[0].iov_len;
+        result = iov[0].iov_len;
+        iobuffer_changed(buf, 0);
+    }
+
+    return copied + result;
+}
+
 /* Return the status of a given IOBuffer.
  *
  * This function returns an IOBufferStatus enum containing the logical
- * status of the IOBuffer passed in.
+ * status of the IOBuffer passed in.  IOBUFFER_LOW and IOBUFFER_HIGH are
+ * returned only for buffers given watermarks with
+ * iobuffer_set_watermarks(); EMPTY and FULL take precedence over them.
  */
 IOBufferStatus iobuffer_status(IOBuffer *buf) {
     /* Case statements have their labels flush with the case keyword,
@@ -205,12 +605,611 @@ IOBufferStatus iobuffer_status(IOBuffer *buf) {
      * over an enum or user-defined type, it need not handle invalid
      * values.  Otherwise, it should have a default statement.
      */
-    switch (buf->bufused) {
+    switch (buf->bufused - buf->bufstart) {
     case 0:
         return IOBUFFER_EMPTY;
     case MAX_BUFSIZE:
         return IOBUFFER_FULL;
     default:
-        return IOBUFFER_DATA;            
+        if (buf->watch == NULL) {
+            return IOBUFFER_DATA;
+        } else if (iobuffer_length(buf) >= buf->watch->high) {
+            return IOBUFFER_HIGH;
+        } else if (iobuffer_length(buf) <= buf->watch->low) {
+            return IOBUFFER_LOW;
+        }
+        return IOBUFFER_DATA;
+    }
+}
+
+/*
+ * Returns the watch state of a given IOBuffer, allocating it with no
+ * watermarks and no subscribers on first use.  Returns NULL with errno
+ * set if it cannot be allocated.
+ */
+static IOBufferWatch *iobuffer_watch_state(IOBuffer *buf) {
+    IOBufferWatch *w = buf->watch;
+
+    if (w != NULL) {
+        return w;
+    }
+    w = calloc(1, sizeof(IOBufferWatch));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->low = 0;
+    w->high = MAX_BUFSIZE;
+    w->efd = -1;
+    buf->watch = w;
+
+    return w;
+}
+
+/* Set the low and high watermarks of a given IOBuffer.
+ *
+ * A non-empty buffer holding at most low bytes has status IOBUFFER_LOW,
+ * and one holding at least high bytes but not full has IOBUFFER_HIGH.
+ * The watermarks also define the IOBUFFER_EVENT_HIGH and
+ * IOBUFFER_EVENT_LOW transitions reported by iobuffer_watch().  Without
+ * watermarks, low is 0 and high is MAX_BUFSIZE, so neither status
+ * occurs, HIGH is reported with FULL, and LOW with EMPTY after that.
+ *
+ * This function returns < 0 with errno set to EINVAL if low is not
+ * below high or high is more than a buffer holds, or ENOMEM, and 0 on
+ * success.
+ *
+ * buf:  the buffer to configure
+ * low:  the low watermark, in bytes
+ * high: the high watermark, in bytes
+ */
+int iobuffer_set_watermarks(IOBuffer *buf, size_t low, size_t high) {
+    IOBufferWatch *w;
+
+    if (low >= high || high > MAX_BUFSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    w = iobuffer_watch_state(buf);
+    if (w == NULL) {
+        return -1;
+    }
+    w->low = low;
+    w->high = high;
+    w->above_high = iobuffer_length(buf) >= high;
+
+    return 0;
+}
+
+/* Call a function on transitions of a given IOBuffer.
+ *
+ * Rather than polling iobuffer_status(), a consumer or flow controller
+ * can be told when the state it cares about changes.  After any call
+ * that changes the length of the buffer, func is called once with the
+ * IOBufferEvent bits in events that the change caused:
+ *
+ *   IOBUFFER_EVENT_DATA:  the buffer was empty and now has data
+ *   IOBUFFER_EVENT_EMPTY: the buffer had data and is now empty
+ *   IOBUFFER_EVENT_HIGH:  the length rose from below the high watermark
+ *                         to at or above it
+ *   IOBUFFER_EVENT_FULL:  the buffer became full
+ *   IOBUFFER_EVENT_LOW:   the length fell to at or below the low
+ *                         watermark, after an IOBUFFER_EVENT_HIGH
+ *
+ * LOW and HIGH alternate, so a producer paused at HIGH or FULL is
+ * resumed once at LOW rather than on every consume in between.
+ *
+ * func is called from inside the operation on the buffer, and must not
+ * modify the buffer.  Only one function is registered at a time; a
+ * later call replaces it, and a NULL func removes it.
+ *
+ * This function returns < 0 with errno set if the watch cannot be
+ * allocated, or 0 on success.
+ *
+ * buf:    the buffer to watch
+ * events: the IOBufferEvent bits of interest
+ * func:   the function to call, or NULL
+ * arg:    passed to func
+ */
+int iobuffer_watch(IOBuffer *buf, unsigned events, IOBufferWatchFunc func,
+                   void *arg) {
+    IOBufferWatch *w = iobuffer_watch_state(buf);
+
+    if (w == NULL) {
+        return -1;
+    }
+    w->events = events;
+    w->func = func;
+    w->arg = arg;
+
+    return 0;
+}
+
+/* Signal an eventfd on transitions of a given IOBuffer.
+ *
+ * This is iobuffer_watch() for consumers in an event loop: the eventfd
+ * is incremented by one for each change causing any of the given
+ * events, so a thread can wait for many buffers in poll() or epoll
+ * without polling each of them.  It may be combined with a function
+ * registered with iobuffer_watch().  An efd of -1 removes the eventfd.
+ *
+ * This function returns < 0 with errno set if the watch cannot be
+ * allocated, or 0 on success.
+ *
+ * buf:    the buffer to watch
+ * events: the IOBufferEvent bits of interest
+ * efd:    an eventfd, or -1
+ */
+int iobuffer_watch_eventfd(IOBuffer *buf, unsigned events, int efd) {
+    IOBufferWatch *w = iobuffer_watch_state(buf);
+
+    if (w == NULL) {
+        return -1;
+    }
+    w->efd_events = events;
+    w->efd = efd;
+
+    return 0;
+}
+
+/*
+ * Returns a pointer to the unconsumed data in a given IOBuffer.  There
+ * are iobuffer_length() bytes at that address.  The pointer is valid
+ * until the next call that modifies the buffer.
+ */
+char *iobuffer_data(IOBuffer *buf) {
+    return buf->buffer + buf->bufstart;
+}
+
+/*
+ * Returns the number of unconsumed bytes in a given IOBuffer.
+ */
+size_t iobuffer_length(IOBuffer *buf) {
+    return buf->bufused - buf->bufstart;
+}
+
+/*
+ * Discards bytes from the front of a given IOBuffer once the caller has
+ * processed them.  Consuming more than iobuffer_length() bytes empties
+ * the buffer.
+ *
+ * buf:   the buffer to consume from
+ * bytes: the number of bytes to discard
+ */
+void iobuffer_consume(IOBuffer *buf, size_t bytes) {
+    size_t before = iobuffer_length(buf);
+
+    if (bytes >= before) {
+        buf->bufstart = 0;
+        buf->bufused = 0;
+    } else {
+        buf->bufstart += bytes;
+    }
+    iobuffer_changed(buf, before);
+}
+
+/* Append bytes to the end of a given IOBuffer.
+ *
+ * Either all of the data is appended or none of it is.  Unconsumed data
+ * may be moved to make room, as with iobuffer_read().
+ *
+ * This function returns < 0 if there is not enough space or storage
+ * cannot be allocated, or 0 if the data was appended.
+ *
+ * buf:   the buffer to append to
+ * data:  the bytes to append
+ * bytes: the number of bytes to append
+ */
+int iobuffer_append(IOBuffer *buf, const void *data, size_t bytes) {
+    if (iobuffer_length(buf) + bytes > MAX_BUFSIZE) {
+        return -1;
+    }
+    if (iobuffer_prepare(buf, bytes, bytes) < (int)bytes) {
+        return -1;
+    }
+    memcpy(buf->buffer + buf->bufused, data, bytes);
+    buf->bufused += bytes;
+    iobuffer_changed(buf, iobuffer_length(buf) - bytes);
+
+    return 0;
+}
+
+/* Get contiguous free space at the end of a given IOBuffer.
+ *
+ * This allows data to be produced directly in the buffer, rather than
+ * produced elsewhere and then appended.  At least bytes bytes of space
+ * are made available, moving unconsumed data or moving from inline
+ * storage to full-sized storage if necessary; all of the free space may
+ * be used.  Nothing written is part of the buffer contents until
+ * iobuffer_commit() is called, and the space is invalidated by any
+ * other operation on the buffer.
+ *
+ * This function returns NULL with errno set to ENOBUFS if the buffer
+ * cannot hold bytes more bytes, or ENOMEM if storage cannot be
+ * allocated.
+ *
+ * buf:   the buffer to write into
+ * bytes: the minimum amount of space needed
+ * avail: set to the amount of space available, if not NULL
+ */
+char *iobuffer_reserve(IOBuffer *buf, size_t bytes, size_t *avail) {
+    if (iobuffer_length(buf) + bytes > MAX_BUFSIZE) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+    if (iobuffer_prepare(buf, bytes, bytes) < (int)bytes) {
+        return NULL;
     }
+    if (avail != NULL) {
+        *avail = buf->bufsize - buf->bufused;
+    }
+
+    return buf->buffer + buf->bufused;
+}
+
+/* Add data written into reserved space to the contents of a buffer.
+ *
+ * buf:   the buffer written into
+ * bytes: the number of bytes written at the start of the space returned
+ *        by iobuffer_reserve(); at most its available space
+ */
+void iobuffer_commit(IOBuffer *buf, size_t bytes) {
+    buf->bufused += bytes;
+    iobuffer_changed(buf, iobuffer_length(buf) - bytes);
+}
+
+/* Get the storage block of a given IOBuffer.
+ *
+ * A buffer using inline storage is moved to pool storage first, so
+ * that the block can be registered with the kernel for I/O directly
+ * into it.  Space returned by iobuffer_reserve() always lies within
+ * this block.  The block changes only when iobuffer_shrink() or
+ * iobuffer_splice() replace it.
+ *
+ * This function returns NULL with errno set if storage cannot be
+ * allocated.
+ *
+ * buf:  the buffer
+ * size: set to the size of the block, if not NULL
+ */
+char *iobuffer_storage(IOBuffer *buf, size_t *size) {
+    if (iobuffer_inline(buf)
+        && iobuffer_prepare(buf, INLINE_BUFSIZE + 1, INLINE_BUFSIZE + 1) < 0) {
+        return NULL;
+    }
+    if (size != NULL) {
+        *size = buf->bufsize;
+    }
+
+    return buf->buffer;
+}
+
+/*
+ * Returns the pool storage of a given IOBuffer to the pool if the
+ * buffer is empty, so that an idle buffer costs only its header and
+ * goes back to inline storage.  Returns true if storage was released.
+ */
+bool iobuffer_shrink(IOBuffer *buf) {
+    if (iobuffer_inline(buf) || iobuffer_length(buf) > 0) {
+        return false;
+    }
+    storage_put(buf->buffer, buf->node);
+    buf->buffer = buf->inline_buffer;
+    buf->bufsize = INLINE_BUFSIZE;
+    buf->bufstart = 0;
+    buf->bufused = 0;
+
+    return true;
+}
+
+/*
+ * Unmaps idle storage until no pool holds more than a given number of
+ * blocks, returning the memory to the system.  Returns the number of
+ * blocks released.
+ */
+int iobuffer_pool_trim(int keep) {
+    StoragePool *pool;
+    char *storage;
+    int count = 0;
+
+    for (int node = 0; node < MAX_POOL_NODES; node++) {
+        pool = storage_pool(node);
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count > keep) {
+            storage = pool->free;
+            memcpy(&pool->free, storage, sizeof(pool->free));
+            pool->count--;
+            munmap(storage, MAX_BUFSIZE);
+            count++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return count;
+}
+
+/*
+ * Binds the calling thread to a NUMA node's IOBuffer pool.  Buffers the
+ * thread creates afterward take their storage from, and return it to,
+ * that node's pool, and new storage is placed on that node.  A node of
+ * -1 removes the binding.
+ *
+ * This function returns < 0 with errno set to EINVAL if node is out of
+ * range, or 0 on success.
+ */
+int iobuffer_pool_bind_node(int node) {
+    if (node < -1 || node >= MAX_POOL_NODES) {
+        errno = EINVAL;
+        return -1;
+    }
+    storage_node = node;
+
+    return 0;
+}
+
+/*
+ * Creates a splicer that moves IOBuffer contents to outfd with
+ * vmsplice(), without copying them through write().
+ *
+ * If outfd is a pipe, data is spliced into it directly.  Otherwise it
+ * is placed in an intermediate pipe and spliced onward to outfd.  The
+ * splicer assumes that it is the only writer of whichever pipe it uses.
+ *
+ * Returns NULL on error, with errno set.
+ */
+IOBufferSplicer *iobuffer_splicer_create(int outfd) {
+    IOBufferSplicer *sp;
+    struct stat st;
+
+    if (fstat(outfd, &st) < 0) {
+        return NULL;
+    }
+    sp = malloc(sizeof(IOBufferSplicer));
+    if (sp == NULL) {
+        return NULL;
+    }
+    sp->outfd = outfd;
+    sp->pipefd[0] = -1;
+    sp->pipefd[1] = -1;
+    sp->written = 0;
+    sp->backlog = 0;
+    sp->pending = NULL;
+    sp->pending_tail = NULL;
+
+    if (!S_ISFIFO(st.st_mode) && pipe2(sp->pipefd, O_CLOEXEC) < 0) {
+        free(sp);
+        return NULL;
+    }
+
+    return sp;
+}
+
+/*
+ * Frees a splicer created by iobuffer_splicer_create().
+ *
+ * Storage that the kernel may still reference is unmapped rather than
+ * recycled; the kernel holds its own references to those pages.  The
+ * output descriptor is not closed.
+ */
+void iobuffer_splicer_destroy(IOBufferSplicer *sp) {
+    PendingStorage *p;
+
+    if (sp == NULL) {
+        return;
+    }
+    iobuffer_splicer_reclaim(sp);
+    while (sp->pending != NULL) {
+        p = sp->pending;
+        sp->pending = p->next;
+        munmap(p->storage, MAX_BUFSIZE);
+        free(p);
+    }
+    if (sp->pipefd[0] >= 0) {
+        close(sp->pipefd[0]);
+        close(sp->pipefd[1]);
+    }
+    free(sp);
+}
+
+/*
+ * Recycles storage that the kernel has released.
+ *
+ * Data placed in a pipe by vmsplice() still refers to our pages until
+ * the reader consumes it.  Comparing the bytes still queued in the pipe
+ * with the total written gives the consumed byte count, and any block
+ * whose data lies entirely before that point is free again.
+ *
+ * Returns the number of blocks recycled, or < 0 on error.
+ */
+int iobuffer_splicer_reclaim(IOBufferSplicer *sp) {
+    int pipein = sp->pipefd[1] >= 0 ? sp->pipefd[0] : sp->outfd;
+    unsigned long long consumed;
+    PendingStorage *p;
+    int queued;
+    int count = 0;
+
+    if (sp->pending == NULL) {
+        return 0;
+    }
+    if (ioctl(pipein, FIONREAD, &queued) < 0) {
+        return -1;
+    }
+    consumed = sp->written - queued;
+
+    while (sp->pending != NULL && sp->pending->mark <= consumed) {
+        p = sp->pending;
+        sp->pending = p->next;
+        storage_put(p->storage, p->node);
+        free(p);
+        count++;
+    }
+    if (sp->pending == NULL) {
+        sp->pending_tail = NULL;
+    }
+
+    return count;
+}
+
+/*
+ * Hands the data in a buffer's pool storage to the kernel with
+ * vmsplice() and gives the buffer fresh storage.  Returns < 0 on error,
+ * or the number of bytes placed in the pipe.  See iobuffer_splice().
+ */
+static int splice_storage(IOBufferSplicer *sp, IOBuffer *buf, int pipeout) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    bool gift = buf->bufstart == 0 && buf->bufused == MAX_BUFSIZE
+                && MAX_BUFSIZE % pagesize == 0;
+    PendingStorage *p = NULL;
+    struct iovec iov;
+    char *fresh;
+    size_t length;
+    int written = 0;
+    int result;
+
+    fresh = storage_get(buf->node);
+    if (fresh == NULL) {
+        return -1;
+    }
+    if (!gift) {
+        p = malloc(sizeof(PendingStorage));
+        if (p == NULL) {
+            storage_put(fresh, buf->node);
+            return -1;
+        }
+    }
+
+    while ((size_t)written < iobuffer_length(buf)) {
+        iov.iov_base = iobuffer_data(buf) + written;
+        iov.iov_len = iobuffer_length(buf) - written;
+        result = vmsplice(pipeout, &iov, 1, gift ? SPLICE_F_GIFT : 0);
+        if (result < 0) {
+            break;
+        }
+        written += result;
+    }
+    if (written == 0) {
+        storage_put(fresh, buf->node);
+        free(p);
+        return -1;
+    }
+
+    /* The old storage now belongs to the kernel, at least in part. */
+    memcpy(fresh, iobuffer_data(buf) + written,
+           iobuffer_length(buf) - written);
+    if (gift) {
+        munmap(buf->buffer, MAX_BUFSIZE);
+    } else {
+        p->next = NULL;
+        p->storage = buf->buffer;
+        p->node = buf->node;
+        p->mark = sp->written + written;
+        if (sp->pending_tail != NULL) {
+            sp->pending_tail->next = p;
+        } else {
+            sp->pending = p;
+        }
+        sp->pending_tail = p;
+    }
+    length = iobuffer_length(buf);
+    buf->bufused = length - written;
+    buf->bufstart = 0;
+    buf->buffer = fresh;
+    iobuffer_changed(buf, length);
+
+    return written;
+}
+
+/*
+ * Returns the number of bytes waiting in a splicer's intermediate pipe
+ * because its output could not take them, as when a nonblocking socket
+ * would block.  The next iobuffer_splice() sends them first.
+ */
+size_t iobuffer_splicer_backlog(IOBufferSplicer *sp) {
+    return sp->backlog;
+}
+
+/*
+ * Splices the backlog in the intermediate pipe onward to the output.
+ * Returns < 0 on error, including EAGAIN if the output would block, or
+ * 0 once the pipe is empty.
+ */
+static int splicer_drain(IOBufferSplicer *sp) {
+    ssize_t moved;
+
+    while (sp->backlog > 0) {
+        moved = splice(sp->pipefd[0], NULL, sp->outfd, NULL, sp->backlog,
+                       SPLICE_F_MOVE);
+        if (moved < 0) {
+            return -1;
+        }
+        if (moved == 0) {
+            errno = EPIPE;  // the pipe disagrees with our count
+            return -1;
+        }
+        sp->backlog -= moved;
+    }
+
+    return 0;
+}
+
+/* Write all buffered data from a given IOBuffer to the splicer's output.
+ *
+ * The IOBuffer's pool storage is handed to the kernel and replaced with
+ * a fresh block, so the IOBuffer is empty and writable on return.  A
+ * full buffer is page-aligned in both address and length, so it is
+ * gifted (SPLICE_F_GIFT) and unmapped; the kernel owns those pages from
+ * then on.  Anything shorter stays mapped until the pipe reader
+ * consumes it, after which iobuffer_splicer_reclaim() recycles it.  A
+ * buffer still using inline storage holds too little to be worth
+ * splicing, and its data is simply written to the pipe.
+ *
+ * When the output is not a pipe, the data goes through an intermediate
+ * pipe and is spliced onward before returning.  Whatever the output
+ * does not take stays in the intermediate pipe as a backlog (see
+ * iobuffer_splicer_backlog()), and is sent before anything else by the
+ * next call, which may pass an empty buffer to send only the backlog.
+ * While a backlog remains, no more data is taken from the buffer.
+ * Socket destinations may keep references to the pages after this, so
+ * only full (gifted) buffers should be spliced to sockets.
+ *
+ * This function returns < 0 on error, or the number of bytes taken
+ * from the buffer.  If the backlog cannot be sent, it returns < 0 with
+ * errno set (EAGAIN if the output would block) and the buffer is left
+ * untouched.  If an error occurs after some data was taken, the
+ * remainder is left in the buffer and the count taken is returned.
+ *
+ * sp:  the splicer to write through
+ * buf: the buffer to flush
+ */
+int iobuffer_splice(IOBufferSplicer *sp, IOBuffer *buf) {
+    int pipeout = sp->pipefd[1] >= 0 ? sp->pipefd[1] : sp->outfd;
+    int written;
+
+    if (sp->pipefd[0] >= 0 && splicer_drain(sp) < 0) {
+        return -1;
+    }
+    if (iobuffer_length(buf) == 0) {
+        return 0;
+    }
+    iobuffer_splicer_reclaim(sp);
+
+    if (iobuffer_inline(buf)) {
+        written = write(pipeout, iobuffer_data(buf), iobuffer_length(buf));
+        if (written > 0) {
+            iobuffer_consume(buf, written);
+        }
+    } else {
+        written = splice_storage(sp, buf, pipeout);
+    }
+    if (written <= 0) {
+        return -1;
+    }
+    sp->written += written;
+
+    /* Send what we can onward; the rest is the next call's backlog. */
+    if (sp->pipefd[0] >= 0) {
+        sp->backlog += written;
+        splicer_drain(sp);
+    }
+
+    return written;
 }
@@ -14,10 +14,14 @@
 #ifndef EXAMPLE_H_
 #define EXAMPLE_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
 /*
  * The order of sections is the same as C files.  In this example, there
- * are no public constants, and the only public type is a partial type
- * for a structure defined in example.c.
+ * are no public constants, and the public types are partial types for
+ * structures defined in example.c.
  */
 
 /* I/O management buffer
@@ -29,6 +33,12 @@
  */
 typedef struct _IOBuffer IOBuffer;
 
+/* Zero-copy output path from IOBuffers into a pipe
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _IOBufferSplicer IOBufferSplicer;
+
 /*
  * Enumerated values and other list-like types should be laid out with
  * one value to a line unless another format is logically desirable for
@@ -39,9 +49,24 @@ typedef struct _IOBuffer IOBuffer;
 typedef enum {
     IOBUFFER_EMPTY,        /* This IOBuffer has no data */
     IOBUFFER_DATA,         /* This IOBuffer has data, but is not full */
-    IOBUFFER_FULL          /* This IOBuffer is full */
+    IOBUFFER_FULL,         /* This IOBuffer is full */
+    IOBUFFER_LOW,          /* Has data, at or below the low watermark */
+    IOBUFFER_HIGH          /* At or above the high watermark, not full */
 } IOBufferStatus;
 
+/* Transitions reported to a function registered with iobuffer_watch().
+ * These are bits, and may be combined. */
+typedef enum {
+    IOBUFFER_EVENT_DATA  = 0x01,  /* Became non-empty */
+    IOBUFFER_EVENT_EMPTY = 0x02,  /* Became empty */
+    IOBUFFER_EVENT_HIGH  = 0x04,  /* Rose to the high watermark */
+    IOBUFFER_EVENT_FULL  = 0x08,  /* Became full */
+    IOBUFFER_EVENT_LOW   = 0x10,  /* Fell to the low watermark after HIGH */
+} IOBufferEvent;
+
+/* Called with the IOBufferEvent bits for each watched transition */
+typedef void (*IOBufferWatchFunc)(IOBuffer *buf, unsigned events, void *arg);
+
 /*
  * Note that the documentation for these function prototypes is present
  * in the file example.c.  It is not necessary (or desirable) to
@@ -57,8 +82,50 @@ void iobuffer_destroy(IOBuffer *buf);
 
 int iobuffer_read(IOBuffer *buf, int fd, size_t bytes);
 
+int iobuffer_pread(IOBuffer *buf, int fd, size_t bytes, off_t offset);
+
+ssize_t iobuffer_read_into(IOBuffer *buf, int fd, void *dst,
+                           size_t bytes);
+
 IOBufferStatus iobuffer_status(IOBuffer *buf);
 
+int iobuffer_set_watermarks(IOBuffer *buf, size_t low, size_t high);
+
+int iobuffer_watch(IOBuffer *buf, unsigned events, IOBufferWatchFunc func,
+                   void *arg);
+
+int iobuffer_watch_eventfd(IOBuffer *buf, unsigned events, int efd);
+
+char *iobuffer_data(IOBuffer *buf);
+
+size_t iobuffer_length(IOBuffer *buf);
+
+void iobuffer_consume(IOBuffer *buf, size_t bytes);
+
+int iobuffer_append(IOBuffer *buf, const void *data, size_t bytes);
+
+char *iobuffer_reserve(IOBuffer *buf, size_t bytes, size_t *avail);
+
+void iobuffer_commit(IOBuffer *buf, size_t bytes);
+
+char *iobuffer_storage(IOBuffer *buf, size_t *size);
+
+bool iobuffer_shrink(IOBuffer *buf);
+
+int iobuffer_pool_trim(int keep);
+
+int iobuffer_pool_bind_node(int node);
+
+IOBufferSplicer *iobuffer_splicer_create(int outfd);
+
+void iobuffer_splicer_destroy(IOBufferSplicer *sp);
+
+int iobuffer_splicer_reclaim(IOBufferSplicer *sp);
+
+size_t iobuffer_splicer_backlog(IOBufferSplicer *sp);
+
+int iobuffer_splice(IOBufferSplicer *sp, IOBuffer *buf);
+
 /* Preprocessor directives for conditional compilation should include
  * comments linking them together, as it becomes very difficult to
  * follow structure otherwise.  In this case, this directive matches
@@ -0,0 +1,716 @@
+/* agent <agent@local>
+ * Vectorized parsing of numeric and timestamp fields in IOBuffer data.
+ *
+ * Log records read into IOBuffers are mostly decimal numbers and
+ * ISO-8601 timestamps, and parsing them one character at a time with
+ * strtol() or strptime() dominates the cost of processing them.  The
+ * functions in this file parse fields in place, as FieldViews into the
+ * buffer contents, without NUL-terminating or copying them.
+ *
+ * Runs of up to 8 digits are validated and converted as one 64-bit
+ * word (SWAR), and runs of up to 16 digits in one SSE register, where
+ * pairs of digits, then pairs of those, and so on, are combined with
+ * multiply-add instructions.  The same register path converts two short
+ * fields at once in the batch functions.  Timestamps are checked
+ * against their fixed template and converted the same way.  Floating
+ * point values take the exact fast path used by fast_float and similar
+ * libraries whenever the decimal mantissa and exponent are small enough
+ * to be represented exactly, and fall back to strtod() otherwise.
+ *
+ * The SSE paths need SSSE3 and are used when compiling for it (e.g.,
+ * with -mssse3 or -march=native); otherwise equivalent scalar code is
+ * used.  No function reads outside the field it is given.
+ */
+#include <endian.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "fieldparse.h"
+
+/* Longest floating point field handed to strtod(); array size */
+#define FLOAT_TEXT_MAX 128
+
+/* Powers of ten representable in a uint64_t */
+static const uint64_t POW10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+/* Powers of ten exactly representable as doubles */
+static const double EXACT_POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Largest exponent in EXACT_POW10 */
+static const int EXACT_POW10_MAX = 22;
+
+/* Largest integer below which every integer is exactly a double */
+static const uint64_t EXACT_MANTISSA_MAX = 1ULL << 53;
+
+/* Layout of the fixed part of a timestamp; '0' marks a digit.  The
+ * separator between date and time may also be a space. */
+static const char TIMESTAMP_TEMPLATE[] = "0000-00-00T00:00:00";
+
+/* Length of the fixed part of a timestamp */
+static const size_t TIMESTAMP_FIXED = 19;
+
+/* Offset of the date and time separator in a timestamp */
+static const size_t TIMESTAMP_SEPARATOR = 10;
+
+/* Length of a "+HH:MM" time zone offset */
+static const size_t TIMESTAMP_OFFSET = 6;
+
+static const int64_t NANOS_PER_SECOND = 1000000000LL;
+
+/*
+ * Adds the field from start to end of data to fields, if there is room,
+ * and counts it.
+ */
+static void split_add(const char *data, size_t start, size_t end,
+                      FieldView *fields, size_t max, size_t *count) {
+    if (*count < max) {
+        fields[*count].data = data + start;
+        fields[*count].length = end - start;
+    }
+    (*count)++;
+}
+
+/* Split data into fields at every occurrence of sep.
+ *
+ * Separators are found 16 bytes at a time.  At most max fields are
+ * stored in fields, but all are counted, so that a return value larger
+ * than max means fields was too small.  Empty data is one empty field.
+ *
+ * This function returns the number of fields in data.
+ *
+ * data:   the bytes to split, e.g., one line from iobuffer_data()
+ * len:    the length of data
+ * sep:    the separator
+ * fields: storage for up to max fields
+ * max:    the size of fields
+ */
+size_t field_split(const char *data, size_t len, char sep,
+                   FieldView *fields, size_t max) {
+    size_t count = 0;
+    size_t start = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i seps = _mm_set1_epi8(sep);
+    unsigned mask;
+
+    for (; i + 16 <= len; i += 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(data + i)), seps));
+        while (mask != 0) {
+            split_add(data, start, i + __builtin_ctz(mask), fields, max,
+                      &count);
+            start = i + __builtin_ctz(mask) + 1;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (data[i] == sep) {
+            split_add(data, start, i, fields, max, &count);
+            start = i + 1;
+        }
+    }
+    split_add(data, start, len, fields, max, &count);
+
+    return count;
+}
+
+/*
+ * Returns the length of the run of digits at the start of p, which is
+ * at most n bytes long.
+ */
+static size_t digit_run(const char *p, size_t n) {
+    size_t i = 0;
+
+    while (i < n && p[i] >= '0' && p[i] <= '9') {
+        i++;
+    }
+
+    return i;
+}
+
+/*
+ * Converts 8 ASCII digits, first digit first, as a single word.
+ * Returns false if any of them is not a digit.
+ */
+static bool digits8(const char *p, uint64_t *value) {
+    uint64_t val;
+
+    memcpy(&val, p, sizeof(val));
+    val = le64toh(val);  // first digit in the low byte
+
+    /* Each byte must be 0x30-0x39: high nibble 3, and adding 6 must
+     * not carry out of the low nibble. */
+    if ((((val & 0xF0F0F0F0F0F0F0F0ULL)
+          | (((val + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+         != 0x3333333333333333ULL)) {
+        return false;
+    }
+
+    /* Combine adjacent digits, then pairs, then quads. */
+    val = ((val & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    val = ((val & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    *value = ((val & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+
+    return true;
+}
+
+/*
+ * Converts 16 ASCII digits as two 8-digit halves.  Returns false if any
+ * of them is not a digit.
+ */
+static bool digits8x2(const char *p, uint64_t *high, uint64_t *low) {
+#ifdef __SSSE3__
+    __m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)p),
+                             _mm_set1_epi8('0'));
+    __m128i over = _mm_subs_epu8(v, _mm_set1_epi8(9));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(over, _mm_setzero_si128()))
+        != 0xFFFF) {
+        return false;
+    }
+
+    /* 16 digits, to 8 two-digit, 4 four-digit, and 2 eight-digit
+     * values. */
+    v = _mm_maddubs_epi16(v, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1,
+                                           10, 1, 10, 1, 10, 1, 10, 1));
+    v = _mm_madd_epi16(v, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+    v = _mm_packs_epi32(v, v);
+    v = _mm_madd_epi16(v, _mm_setr_epi16(10000, 1, 10000, 1,
+                                         10000, 1, 10000, 1));
+    *high = (uint32_t)_mm_cvtsi128_si32(v);
+    *low = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 4));
+
+    return true;
+#else
+    return digits8(p, high) && digits8(p + 8, low);
+#endif
+}
+
+/*
+ * Converts a run of 1 to 20 ASCII digits.  Returns 0, EINVAL if the run
+ * is empty or contains a non-digit, or ERANGE if the value does not fit
+ * in 64 bits.
+ */
+static int parse_digits(const char *p, size_t n, uint64_t *value) {
+    char padded[16];
+    uint64_t high;
+    uint64_t low;
+
+    if (n == 0 || n > 20) {
+        return n > 0 && digit_run(p, n) == n ? ERANGE : EINVAL;
+    }
+
+    /* Short runs are right-aligned in a buffer of leading zeros, so
+     * that nothing past the field is read. */
+    if (n <= 8) {
+        memset(padded, '0', 8);
+        memcpy(padded + 8 - n, p, n);
+        return digits8(padded, value) ? 0 : EINVAL;
+    }
+    if (n <= 16) {
+        memset(padded, '0', 16);
+        memcpy(padded + 16 - n, p, n);
+        if (!digits8x2(padded, &high, &low)) {
+            return EINVAL;
+        }
+        *value = high * POW10[8] + low;
+        return 0;
+    }
+
+    /* The last 16 digits, and up to 4 leading ones. */
+    if (!digits8x2(p + n - 16, &high, &low)) {
+        return EINVAL;
+    }
+    *value = high * POW10[8] + low;
+    memset(padded, '0', 8);
+    memcpy(padded + 8 - (n - 16), p, n - 16);
+    if (!digits8(padded, &high)) {
+        return EINVAL;
+    }
+    if (__builtin_mul_overflow(high, POW10[16], &high)
+        || __builtin_add_overflow(*value, high, value)) {
+        return ERANGE;
+    }
+
+    return 0;
+}
+
+/*
+ * Sets errno from an internal result code and returns the public
+ * result.
+ */
+static int parse_result(int error) {
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse an unsigned decimal integer field.
+ *
+ * The field must consist of 1 to 20 digits and nothing else.
+ *
+ * This function returns 0 on success, or -1 with errno set to EINVAL
+ * for malformed input or ERANGE for a value that overflows.
+ */
+int field_uint(FieldView field, uint64_t *value) {
+    return parse_result(parse_digits(field.data, field.length, value));
+}
+
+/*
+ * Parses a signed integer field.  Returns 0, EINVAL, or ERANGE.
+ */
+static int parse_int(FieldView field, int64_t *value) {
+    bool negative = false;
+    uint64_t magnitude;
+    int error;
+
+    if (field.length > 0 && (field.data[0] == '-' || field.data[0] == '+')) {
+        negative = field.data[0] == '-';
+        field.data++;
+        field.length--;
+    }
+    error = parse_digits(field.data, field.length, &magnitude);
+    if (error != 0) {
+        return error;
+    }
+    if (magnitude > (uint64_t)INT64_MAX + negative) {
+        return ERANGE;
+    }
+    *value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+
+    return 0;
+}
+
+/* Parse a signed decimal integer field.
+ *
+ * The field is an optional sign followed by 1 to 20 digits.
+ *
+ * This function returns 0 on success, or -1 with errno set to EINVAL
+ * for malformed input or ERANGE for a value out of range.
+ */
+int field_int(FieldView field, int64_t *value) {
+    return parse_result(parse_int(field, value));
+}
+
+/*
+ * Parses a floating point field with strtod(), for the cases the fast
+ * path does not handle.  Returns 0, EINVAL, or ERANGE.
+ */
+static int parse_double_slow(FieldView field, double *value) {
+    char text[FLOAT_TEXT_MAX];
+    char *end;
+
+    if (field.length == 0 || field.length >= sizeof(text)
+        || field.data[0] == ' ' || (field.data[0] >= '\t'
+                                    && field.data[0] <= '\r')) {
+        return EINVAL;
+    }
+    memcpy(text, field.data, field.length);
+    text[field.length] = '\0';
+
+    errno = 0;
+    *value = strtod(text, &end);
+    if (end != text + field.length) {
+        return EINVAL;
+    }
+
+    return errno == ERANGE ? ERANGE : 0;
+}
+
+/*
+ * Parses a floating point field.  Returns 0, EINVAL, or ERANGE.
+ */
+static int parse_double(FieldView field, double *value) {
+    const char *p = field.data;
+    const char *end = field.data + field.length;
+    bool negative = false;
+    bool exp_negative = false;
+    const char *intpart;
+    const char *fracpart = NULL;
+    size_t intlen;
+    size_t fraclen = 0;
+    uint64_t mantissa = 0;
+    uint64_t fraction = 0;
+    uint64_t exp10 = 0;
+    size_t explen;
+    long exponent;
+    double result;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    while (p < end - 1 && *p == '0' && p[1] >= '0' && p[1] <= '9') {
+        p++;  // leading zeros do not count toward the 19 digits
+    }
+    intpart = p;
+    intlen = digit_run(p, end - p);
+    p += intlen;
+    if (p < end && *p == '.') {
+        fracpart = ++p;
+        fraclen = digit_run(p, end - p);
+        p += fraclen;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_negative = *p++ == '-';
+        }
+        explen = digit_run(p, end - p);
+        if (explen == 0 || explen > 4) {
+            return parse_double_slow(field, value);
+        }
+        parse_digits(p, explen, &exp10);
+        p += explen;
+    }
+
+    /* Anything unusual (inf, nan, hex, too many digits) goes to
+     * strtod(), which also rejects malformed fields. */
+    if (p != end || intlen + fraclen == 0 || intlen + fraclen > 19) {
+        return parse_double_slow(field, value);
+    }
+    if (intlen > 0) {
+        parse_digits(intpart, intlen, &mantissa);
+    }
+    if (fraclen > 0) {
+        parse_digits(fracpart, fraclen, &fraction);
+        mantissa = mantissa * POW10[fraclen] + fraction;
+    }
+    exponent = (exp_negative ? -(long)exp10 : (long)exp10) - (long)fraclen;
+
+    /* With an exact mantissa and an exact power of ten, one correctly
+     * rounded multiply or divide gives the correctly rounded result.
+     * Larger positive exponents can move digits into the mantissa
+     * while it stays exact. */
+    if (mantissa > EXACT_MANTISSA_MAX) {
+        return parse_double_slow(field, value);
+    }
+    if (exponent > EXACT_POW10_MAX
+        && exponent <= EXACT_POW10_MAX + 19
+        && mantissa <= EXACT_MANTISSA_MAX
+                       / POW10[exponent - EXACT_POW10_MAX]) {
+        mantissa *= POW10[exponent - EXACT_POW10_MAX];
+        exponent = EXACT_POW10_MAX;
+    }
+    if (exponent < -EXACT_POW10_MAX || exponent > EXACT_POW10_MAX) {
+        return parse_double_slow(field, value);
+    }
+    result = (double)mantissa;
+    if (exponent < 0) {
+        result /= EXACT_POW10[-exponent];
+    } else {
+        result *= EXACT_POW10[exponent];
+    }
+    *value = negative ? -result : result;
+
+    return 0;
+}
+
+/* Parse a floating point field.
+ *
+ * The field is a decimal number with optional sign, fraction, and
+ * exponent; anything else accepted by strtod() is also accepted, but
+ * parsed more slowly.  The result is correctly rounded.
+ *
+ * This function returns 0 on success, or -1 with errno set to EINVAL
+ * for malformed input or ERANGE for a value that overflows or
+ * underflows.
+ */
+int field_double(FieldView field, double *value) {
+    return parse_result(parse_double(field, value));
+}
+
+/*
+ * Checks the fixed part of a timestamp against TIMESTAMP_TEMPLATE and
+ * converts its six numbers: year, month, day, hour, minute, second.
+ * The field must be at least TIMESTAMP_FIXED bytes long.  Returns false
+ * if it does not match.
+ */
+static bool timestamp_fixed(const char *p, unsigned parts[6]) {
+    if (p[TIMESTAMP_SEPARATOR] != 'T' && p[TIMESTAMP_SEPARATOR] != ' ') {
+        return false;
+    }
+#ifdef __SSSE3__
+    /* Two overlapping loads cover all 19 bytes.  After subtracting the
+     * template, digits are 0-9 and separators are 0. */
+    __m128i d1 = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)p),
+        _mm_loadu_si128((const __m128i *)TIMESTAMP_TEMPLATE));
+    __m128i d2 = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(p + 3)),
+        _mm_loadu_si128((const __m128i *)(TIMESTAMP_TEMPLATE + 3)));
+    __m128i zero = _mm_setzero_si128();
+    unsigned ok1;
+    unsigned ok2;
+    uint16_t values[8];
+    __m128i v;
+
+    ok1 = _mm_movemask_epi8(_mm_cmpeq_epi8(zero, _mm_subs_epu8(d1,
+        _mm_setr_epi8(9, 9, 9, 9, 0, 9, 9, 0, 9, 9, 0, 9, 9, 0, 9, 9))));
+    ok2 = _mm_movemask_epi8(_mm_cmpeq_epi8(zero, _mm_subs_epu8(d2,
+        _mm_setr_epi8(9, 0, 9, 9, 0, 9, 9, 0, 9, 9, 0, 9, 9, 0, 9, 9))));
+    if ((ok1 | 1 << TIMESTAMP_SEPARATOR) != 0xFFFF
+        || (ok2 | 1 << (TIMESTAMP_SEPARATOR - 3)) != 0xFFFF) {
+        return false;
+    }
+
+    /* Gather the 14 digits into pairs and combine each pair. */
+    v = _mm_or_si128(
+        _mm_shuffle_epi8(d1, _mm_setr_epi8(0, 1, 2, 3, 5, 6, 8, 9, 11, 12,
+                                           14, 15, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(d2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                           -1, -1, -1, -1, 14, 15, -1, -1)));
+    v = _mm_maddubs_epi16(v, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1,
+                                           10, 1, 10, 1, 10, 1, 10, 1));
+    _mm_storeu_si128((__m128i *)values, v);
+    parts[0] = values[0] * 100 + values[1];
+    for (int i = 1; i < 6; i++) {
+        parts[i] = values[i + 1];
+    }
+#else
+    int part = 0;
+
+    memset(parts, 0, 6 * sizeof(unsigned));
+    for (size_t i = 0; i < TIMESTAMP_FIXED; i++) {
+        if (TIMESTAMP_TEMPLATE[i] != '0') {
+            if (i != TIMESTAMP_SEPARATOR && p[i] != TIMESTAMP_TEMPLATE[i]) {
+                return false;
+            }
+            part++;
+            continue;
+        }
+        if (p[i] < '0' || p[i] > '9') {
+            return false;
+        }
+        parts[part] = parts[part] * 10 + (p[i] - '0');
+    }
+#endif
+
+    return true;
+}
+
+/*
+ * Returns the number of days from 1970-01-01 to the given date in the
+ * proleptic Gregorian calendar.
+ */
+static int64_t days_from_civil(int year, unsigned month, unsigned day) {
+    int64_t era;
+    unsigned yoe;
+    unsigned doy;
+    unsigned doe;
+
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = (unsigned)(year - era * 400);
+    doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+/*
+ * Returns the number of days in a month.
+ */
+static unsigned days_in_month(unsigned year, unsigned month) {
+    static const unsigned char DAYS[] = {
+        31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+    };
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+
+    return DAYS[month - 1] + (month == 2 && leap);
+}
+
+/*
+ * Parses a timestamp field.  Returns 0 or EINVAL.
+ */
+static int parse_timestamp(FieldView field, int64_t *nanos) {
+    const char *p = field.data;
+    size_t len = field.length;
+    size_t i = TIMESTAMP_FIXED;
+    unsigned parts[6];
+    uint64_t fraction = 0;
+    size_t digits;
+    uint64_t hours;
+    uint64_t minutes;
+    int64_t offset = 0;
+    int64_t seconds;
+
+    if (len < TIMESTAMP_FIXED || !timestamp_fixed(p, parts)) {
+        return EINVAL;
+    }
+    if (parts[1] < 1 || parts[1] > 12 || parts[2] < 1
+        || parts[2] > days_in_month(parts[0], parts[1])
+        || parts[3] > 23 || parts[4] > 59 || parts[5] > 60) {
+        return EINVAL;
+    }
+
+    /* Fractional seconds; digits past nanoseconds are ignored. */
+    if (i < len && (p[i] == '.' || p[i] == ',')) {
+        i++;
+        digits = digit_run(p + i, len - i);
+        if (digits == 0) {
+            return EINVAL;
+        }
+        parse_digits(p + i, digits < 9 ? digits : 9, &fraction);
+        fraction *= POW10[digits < 9 ? 9 - digits : 0];
+        i += digits;
+    }
+
+    /* Zone: none or Z for UTC, or +HH:MM / -HH:MM. */
+    if (i < len && p[i] == 'Z') {
+        i++;
+    } else if (i < len && (p[i] == '+' || p[i] == '-')) {
+        if (len - i != TIMESTAMP_OFFSET || p[i + 3] != ':'
+            || digit_run(p + i + 1, 2) != 2 || digit_run(p + i + 4, 2) != 2) {
+            return EINVAL;
+        }
+        parse_digits(p + i + 1, 2, &hours);
+        parse_digits(p + i + 4, 2, &minutes);
+        if (hours > 23 || minutes > 59) {
+            return EINVAL;
+        }
+        offset = (int64_t)(hours * 60 + minutes) * 60;
+        if (p[i] == '-') {
+            offset = -offset;
+        }
+        i += TIMESTAMP_OFFSET;
+    }
+    if (i != len) {
+        return EINVAL;
+    }
+
+    seconds = days_from_civil(parts[0], parts[1], parts[2]) * 86400
+              + parts[3] * 3600 + parts[4] * 60 + parts[5] - offset;
+    *nanos = seconds * NANOS_PER_SECOND + (int64_t)fraction;
+
+    return 0;
+}
+
+/* Parse an ISO-8601 timestamp field.
+ *
+ * The field has the form YYYY-MM-DDTHH:MM:SS (a space may replace the
+ * T), optionally followed by a fraction of a second (after . or ,) and
+ * then by Z or a +HH:MM or -HH:MM offset from UTC.  Without a zone, UTC
+ * is assumed.
+ *
+ * This function returns 0 on success, or -1 with errno set to EINVAL
+ * for a malformed field or an invalid date or time.
+ *
+ * field: the timestamp
+ * nanos: set to nanoseconds since the Unix epoch
+ */
+int field_timestamp(FieldView field, int64_t *nanos) {
+    return parse_result(parse_timestamp(field, nanos));
+}
+
+/* Parse many unsigned integer fields.
+ *
+ * This is equivalent to calling field_uint() on each field in turn, but
+ * faster: adjacent fields of 8 or fewer digits, the common case for
+ * counters and sizes, are converted two at a time in one register.
+ *
+ * This function returns the number of fields parsed before the first
+ * that failed, with errno set as by field_uint(), or n if all were
+ * parsed.
+ *
+ * fields: the fields to parse
+ * n:      the number of fields
+ * values: set to the value of each field parsed
+ */
+size_t field_uint_batch(const FieldView *fields, size_t n,
+                        uint64_t *values) {
+    char padded[16];
+    size_t i = 0;
+    int error;
+
+    while (i < n) {
+        /* Both fields 1-8 bytes long (0 wraps around). */
+        if (i + 1 < n && fields[i].length - 1 < 8
+            && fields[i + 1].length - 1 < 8) {
+            memset(padded, '0', 16);
+            memcpy(padded + 8 - fields[i].length, fields[i].data,
+                   fields[i].length);
+            memcpy(padded + 16 - fields[i + 1].length, fields[i + 1].data,
+                   fields[i + 1].length);
+            if (digits8x2(padded, &values[i], &values[i + 1])) {
+                i += 2;
+                continue;
+            }
+        }
+        error = parse_digits(fields[i].data, fields[i].length, &values[i]);
+        if (error != 0) {
+            errno = error;
+            return i;
+        }
+        i++;
+    }
+
+    return n;
+}
+
+/* Parse many floating point fields.
+ *
+ * This is equivalent to calling field_double() on each field in turn,
+ * without the per-call overhead.
+ *
+ * This function returns the number of fields parsed before the first
+ * that failed, with errno set as by field_double(), or n if all were
+ * parsed.
+ */
+size_t field_double_batch(const FieldView *fields, size_t n,
+                          double *values) {
+    int error;
+
+    for (size_t i = 0; i < n; i++) {
+        error = parse_double(fields[i], &values[i]);
+        if (error != 0) {
+            errno = error;
+            return i;
+        }
+    }
+
+    return n;
+}
+
+/* Parse many timestamp fields.
+ *
+ * This is equivalent to calling field_timestamp() on each field in
+ * turn, without the per-call overhead.
+ *
+ * This function returns the number of fields parsed before the first
+ * that failed, with errno set to EINVAL, or n if all were parsed.
+ */
+size_t field_timestamp_batch(const FieldView *fields, size_t n,
+                             int64_t *nanos) {
+    int error;
+
+    for (size_t i = 0; i < n; i++) {
+        error = parse_timestamp(fields[i], &nanos[i]);
+        if (error != 0) {
+            errno = error;
+            return i;
+        }
+    }
+
+    return n;
+}
@@ -0,0 +1,41 @@
+/* agent <agent@local>
+ * Vectorized parsing of numeric and timestamp fields in IOBuffer data.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in fieldparse.c.
+ */
+
+#ifndef FIELDPARSE_H_
+#define FIELDPARSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A field within IOBuffer contents (or any other memory).  The bytes
+ * are not NUL-terminated. */
+typedef struct {
+    const char *data;
+    size_t length;
+} FieldView;
+
+size_t field_split(const char *data, size_t len, char sep,
+                   FieldView *fields, size_t max);
+
+int field_uint(FieldView field, uint64_t *value);
+
+int field_int(FieldView field, int64_t *value);
+
+int field_double(FieldView field, double *value);
+
+int field_timestamp(FieldView field, int64_t *nanos);
+
+size_t field_uint_batch(const FieldView *fields, size_t n,
+                        uint64_t *values);
+
+size_t field_double_batch(const FieldView *fields, size_t n,
+                          double *values);
+
+size_t field_timestamp_batch(const FieldView *fields, size_t n,
+                             int64_t *nanos);
+
+#endif /* FIELDPARSE_H_ */
@@ -0,0 +1,440 @@
+/* agent <agent@local>
+ * Shared cache of popular file contents.
+ *
+ * Serving a static file by reading it into a fresh IOBuffer costs the
+ * reads and the copies on every request, although a few popular files
+ * account for most of them.  This cache holds the contents of files,
+ * keyed by device, inode, size, and modification time, in memory shared
+ * by every thread of the process.  Requests get a reference-counted
+ * CachedFile whose contents can be written or spliced out directly, so
+ * a hot file is read from disk once and never copied again.
+ *
+ * Contents are always read into private memory rather than mapped.  A
+ * shared mapping would change under its readers if the file were
+ * rewritten in place, and raise SIGBUS if it were truncated.  A file
+ * that is modified usually gets a new size or modification time, and so
+ * a new key; its old contents are never hit again, and age out.  A
+ * rewrite to the same size within one timestamp tick cannot be told
+ * apart from the old version, so files that must never be served stale
+ * should be replaced by renaming a new file over them.
+ *
+ * The cache holds at most its byte budget of contents, evicting with the
+ * CLOCK algorithm: entries sit on a ring, a hit sets an entry's
+ * referenced bit, and the hand sweeps the ring clearing bits until it
+ * finds an entry without one to evict.  Entries still referenced by a
+ * request are skipped; they are freed when released.  Files larger than
+ * the whole budget are refused rather than read into memory once per
+ * request, and the caller streams them instead.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filecache.h"
+
+/* Initial number of hash buckets; the table doubles when it has more
+ * entries than buckets. */
+static const size_t INITIAL_BUCKETS = 64;
+
+/* Contents of one file version */
+struct _CachedFile {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char *data;
+    size_t length;
+    bool cached;        // in the table and on the ring
+    bool referenced;    // hit since the hand last passed
+    int refs;           // outstanding filecache_get() references
+    CachedFile *hnext;  // hash chain
+    CachedFile *prev;   // CLOCK ring
+    CachedFile *next;
+};
+
+/* Process-wide cache of file contents */
+struct _FileCache {
+    pthread_mutex_t lock;
+    CachedFile **buckets;
+    size_t nbuckets;
+    size_t count;
+    CachedFile *hand;   // next entry the CLOCK hand examines
+    size_t bytes;       // contents held by cached entries
+    size_t budget;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/*
+ * Returns the hash bucket for a key.
+ */
+static size_t key_bucket(FileCache *fc, dev_t dev, ino_t ino,
+                         size_t length, const struct timespec *mtime) {
+    uint64_t h = (uint64_t)ino * 0x9E3779B97F4A7C15ULL;
+
+    h ^= (uint64_t)dev + (h << 6) + (h >> 2);
+    h ^= (uint64_t)length + (h << 6) + (h >> 2);
+    h ^= (uint64_t)mtime->tv_sec * 0xC2B2AE3D27D4EB4FULL + mtime->tv_nsec;
+
+    return (h ^ (h >> 29)) & (fc->nbuckets - 1);
+}
+
+/* Create a file cache.
+ *
+ * This function returns NULL if memory is exhausted.
+ *
+ * budget: the most bytes of file contents to keep, and the largest
+ *         file served
+ */
+FileCache *filecache_create(size_t budget) {
+    FileCache *fc = calloc(1, sizeof(FileCache));
+
+    if (fc == NULL) {
+        return NULL;
+    }
+    fc->nbuckets = INITIAL_BUCKETS;
+    fc->buckets = calloc(fc->nbuckets, sizeof(CachedFile *));
+    if (fc->buckets == NULL) {
+        free(fc);
+        return NULL;
+    }
+    pthread_mutex_init(&fc->lock, NULL);
+    fc->budget = budget;
+
+    return fc;
+}
+
+/*
+ * Frees the contents of an entry and the entry.
+ */
+static void cachedfile_free(CachedFile *cf) {
+    free(cf->data);
+    free(cf);
+}
+
+/*
+ * Removes an entry from the table and the ring, and frees it if it is
+ * not referenced.  Called with the lock held.
+ */
+static void cache_remove(FileCache *fc, CachedFile *cf) {
+    CachedFile **link = &fc->buckets[key_bucket(fc, cf->dev, cf->ino,
+                                                cf->length, &cf->mtime)];
+
+    while (*link != cf) {
+        link = &(*link)->hnext;
+    }
+    *link = cf->hnext;
+
+    if (cf->next == cf) {
+        fc->hand = NULL;
+    } else {
+        cf->prev->next = cf->next;
+        cf->next->prev = cf->prev;
+        if (fc->hand == cf) {
+            fc->hand = cf->next;
+        }
+    }
+    fc->count--;
+    fc->bytes -= cf->length;
+    cf->cached = false;
+    if (cf->refs == 0) {
+        cachedfile_free(cf);
+    }
+}
+
+/* Destroy a file cache.
+ *
+ * Every CachedFile must have been released.
+ */
+void filecache_destroy(FileCache *fc) {
+    if (fc == NULL) {
+        return;
+    }
+    while (fc->hand != NULL) {
+        cache_remove(fc, fc->hand);
+    }
+    pthread_mutex_destroy(&fc->lock);
+    free(fc->buckets);
+    free(fc);
+}
+
+/*
+ * Returns the cached entry for a key, or NULL.  Called with the lock
+ * held.
+ */
+static CachedFile *cache_lookup(FileCache *fc, const struct stat *st) {
+    CachedFile *cf = fc->buckets[key_bucket(fc, st->st_dev, st->st_ino,
+                                            st->st_size, &st->st_mtim)];
+
+    while (cf != NULL) {
+        if (cf->dev == st->st_dev && cf->ino == st->st_ino
+            && cf->length == (size_t)st->st_size
+            && cf->mtime.tv_sec == st->st_mtim.tv_sec
+            && cf->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            return cf;
+        }
+        cf = cf->hnext;
+    }
+
+    return NULL;
+}
+
+/*
+ * Doubles the number of hash buckets.  Called with the lock held; on
+ * allocation failure the table simply stays as it is.
+ */
+static void cache_grow(FileCache *fc) {
+    CachedFile **old = fc->buckets;
+    size_t oldsize = fc->nbuckets;
+    CachedFile *cf;
+    size_t bucket;
+
+    fc->buckets = calloc(2 * oldsize, sizeof(CachedFile *));
+    if (fc->buckets == NULL) {
+        fc->buckets = old;
+        return;
+    }
+    fc->nbuckets = 2 * oldsize;
+    for (size_t i = 0; i < oldsize; i++) {
+        while ((cf = old[i]) != NULL) {
+            old[i] = cf->hnext;
+            bucket = key_bucket(fc, cf->dev, cf->ino, cf->length,
+                                &cf->mtime);
+            cf->hnext = fc->buckets[bucket];
+            fc->buckets[bucket] = cf;
+        }
+    }
+    free(old);
+}
+
+/*
+ * Evicts unreferenced entries with the CLOCK algorithm until extra more
+ * bytes fit in the budget or nothing more can be evicted.  Called with
+ * the lock held.
+ */
+static void cache_evict(FileCache *fc, size_t extra) {
+    size_t steps = 2 * fc->count;  // every bit cleared, then every entry
+    CachedFile *cf;
+
+    while (fc->hand != NULL && fc->bytes + extra > fc->budget
+           && steps-- > 0) {
+        cf = fc->hand;
+        fc->hand = cf->next;
+        if (cf->referenced) {
+            cf->referenced = false;
+        } else if (cf->refs == 0) {
+            cache_remove(fc, cf);
+            steps = 2 * fc->count;
+        }
+    }
+}
+
+/*
+ * Adds an entry to the table, and to the ring just behind the hand.
+ * Called with the lock held.
+ */
+static void cache_insert(FileCache *fc, CachedFile *cf) {
+    size_t bucket;
+
+    if (fc->count >= fc->nbuckets) {
+        cache_grow(fc);
+    }
+    bucket = key_bucket(fc, cf->dev, cf->ino, cf->length, &cf->mtime);
+    cf->hnext = fc->buckets[bucket];
+    fc->buckets[bucket] = cf;
+
+    if (fc->hand == NULL) {
+        cf->prev = cf;
+        cf->next = cf;
+        fc->hand = cf;
+    } else {
+        cf->next = fc->hand;
+        cf->prev = fc->hand->prev;
+        cf->prev->next = cf;
+        fc->hand->prev = cf;
+    }
+    cf->cached = true;
+    fc->count++;
+    fc->bytes += cf->length;
+}
+
+/*
+ * Reads the contents of a file into a new, unreferenced entry.  Returns
+ * NULL on error, with errno set to EAGAIN if the file changed while it
+ * was being read.
+ */
+static CachedFile *cachedfile_load(int fd, const struct stat *st) {
+    CachedFile *cf = calloc(1, sizeof(CachedFile));
+    struct stat after;
+    ssize_t nread;
+    size_t done = 0;
+
+    if (cf == NULL) {
+        return NULL;
+    }
+    cf->dev = st->st_dev;
+    cf->ino = st->st_ino;
+    cf->mtime = st->st_mtim;
+    cf->length = st->st_size;
+    if (cf->length == 0) {
+        return cf;
+    }
+
+    cf->data = malloc(cf->length);
+    if (cf->data == NULL) {
+        free(cf);
+        return NULL;
+    }
+    while (done < cf->length) {
+        nread = pread(fd, cf->data + done, cf->length - done, done);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            /* Failed or truncated while reading; serve nothing stale. */
+            if (nread == 0) {
+                errno = EAGAIN;
+            }
+            cachedfile_free(cf);
+            return NULL;
+        }
+        done += nread;
+    }
+
+    /* A write during the read may have left a mix of old and new bytes
+     * under the old key. */
+    if (fstat(fd, &after) < 0) {
+        cachedfile_free(cf);
+        return NULL;
+    }
+    if (after.st_size != st->st_size
+        || after.st_mtim.tv_sec != st->st_mtim.tv_sec
+        || after.st_mtim.tv_nsec != st->st_mtim.tv_nsec) {
+        cachedfile_free(cf);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    return cf;
+}
+
+/* Get the contents of an open file from the cache.
+ *
+ * The file is identified by fstat(); if its current version is cached,
+ * the cached contents are shared, and otherwise they are read and
+ * cached, evicting others as needed.  The contents are a private copy and
+ * remain valid until filecache_release(), even if they are evicted or
+ * the file changes meanwhile.
+ *
+ * This function returns NULL with errno set if fd cannot be examined or
+ * read, is not a regular file (EINVAL), is larger than the cache's
+ * budget (EFBIG), changed while being read (EAGAIN), or memory is
+ * exhausted.  A file refused with EFBIG should be streamed with
+ * iobuffer_read() instead.
+ *
+ * fc: the cache
+ * fd: an open regular file
+ */
+CachedFile *filecache_get(FileCache *fc, int fd) {
+    struct stat st;
+    CachedFile *cf;
+    CachedFile *existing;
+
+    if (fstat(fd, &st) < 0) {
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((uintmax_t)st.st_size > fc->budget) {
+        errno = EFBIG;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&fc->lock);
+    cf = cache_lookup(fc, &st);
+    if (cf != NULL) {
+        cf->referenced = true;
+        cf->refs++;
+        fc->hits++;
+        pthread_mutex_unlock(&fc->lock);
+        return cf;
+    }
+    fc->misses++;
+    pthread_mutex_unlock(&fc->lock);
+
+    /* Load without the lock; another thread may load it too. */
+    cf = cachedfile_load(fd, &st);
+    if (cf == NULL) {
+        return NULL;
+    }
+    cf->refs = 1;
+
+    pthread_mutex_lock(&fc->lock);
+    existing = cache_lookup(fc, &st);
+    if (existing != NULL) {
+        existing->referenced = true;
+        existing->refs++;
+        pthread_mutex_unlock(&fc->lock);
+        cachedfile_free(cf);
+        return existing;
+    }
+    cache_evict(fc, cf->length);
+    cache_insert(fc, cf);
+    pthread_mutex_unlock(&fc->lock);
+
+    return cf;
+}
+
+/*
+ * Releases a reference obtained from filecache_get().
+ */
+void filecache_release(FileCache *fc, CachedFile *cf) {
+    bool unused;
+
+    pthread_mutex_lock(&fc->lock);
+    cf->refs--;
+    unused = cf->refs == 0 && !cf->cached;
+    if (cf->refs == 0 && cf->cached && fc->bytes > fc->budget) {
+        cache_evict(fc, 0);  // entries kept over budget by references
+    }
+    pthread_mutex_unlock(&fc->lock);
+
+    if (unused) {
+        cachedfile_free(cf);
+    }
+}
+
+/*
+ * Returns the contents of a cached file, which must not be modified.
+ * This is NULL for an empty file.
+ */
+const char *cachedfile_data(CachedFile *cf) {
+    return cf->data;
+}
+
+/*
+ * Returns the length of a cached file.
+ */
+size_t cachedfile_length(CachedFile *cf) {
+    return cf->length;
+}
+
+/* Report cache statistics.
+ *
+ * hits:   set to the number of requests served from the cache
+ * misses: set to the number of requests that read the file
+ * bytes:  set to the bytes of contents currently cached
+ */
+void filecache_stats(FileCache *fc, unsigned long *hits,
+                     unsigned long *misses, size_t *bytes) {
+    pthread_mutex_lock(&fc->lock);
+    *hits = fc->hits;
+    *misses = fc->misses;
+    *bytes = fc->bytes;
+    pthread_mutex_unlock(&fc->lock);
+}
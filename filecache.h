@@ -0,0 +1,40 @@
+/* agent <agent@local>
+ * Shared cache of popular file contents.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in filecache.c.
+ */
+
+#ifndef FILECACHE_H_
+#define FILECACHE_H_
+
+#include <stddef.h>
+
+/* Process-wide cache of file contents
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _FileCache FileCache;
+
+/* A reference to the cached contents of one file
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _CachedFile CachedFile;
+
+FileCache *filecache_create(size_t budget);
+
+void filecache_destroy(FileCache *fc);
+
+CachedFile *filecache_get(FileCache *fc, int fd);
+
+void filecache_release(FileCache *fc, CachedFile *cf);
+
+const char *cachedfile_data(CachedFile *cf);
+
+size_t cachedfile_length(CachedFile *cf);
+
+void filecache_stats(FileCache *fc, unsigned long *hits,
+                     unsigned long *misses, size_t *bytes);
+
+#endif /* FILECACHE_H_ */
@@ -0,0 +1,443 @@
+/* agent <agent@local>
+ * Formatted output written directly into IOBuffers.
+ *
+ * Building output with snprintf() into a temporary string and then
+ * appending it copies every byte twice and parses the format string on
+ * every call.  A Formatter instead holds a window of the free space at
+ * the end of an IOBuffer, obtained with iobuffer_reserve(), and each
+ * format_*() function writes its output straight into it; the window
+ * is committed to the buffer contents when it is replaced or when
+ * formatter_finish() is called.  When the buffer fills, the Formatter's
+ * flush function is called to drain it, e.g., to a socket, and writing
+ * continues in the freed space.
+ *
+ * Integers are written two digits at a time from a table, into exactly
+ * as much space as their length, computed without a loop.  Floating
+ * point values with a fixed number of decimals are scaled and written
+ * as integers, with snprintf() (into the buffer) only for the cases
+ * where that might not match its rounding.  JSON strings are scanned
+ * and copied 16 bytes per step with SSE2, stopping only at bytes that
+ * need escaping.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "format.h"
+
+/* Two-digit decimal strings for 00 through 99 */
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+/* Powers of ten representable in a uint64_t */
+static const uint64_t POW10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+/* Most decimals written by the format_double() fast path */
+static const int DOUBLE_FAST_PRECISION = 9;
+
+/* Scaled values at or above this are not exact integers as doubles */
+static const double EXACT_INTEGER_LIMIT = 0x1p53;
+
+/* Longest escape of one byte in a JSON string: \u00XX */
+static const size_t JSON_ESCAPE_MAX = 6;
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+/* Initialize a Formatter.
+ *
+ * buf:   the buffer to append output to
+ * flush: called to drain buf when it is full, or NULL to fail instead
+ * arg:   passed to flush
+ */
+void formatter_init(Formatter *f, IOBuffer *buf, FormatFlushFunc flush,
+                    void *arg) {
+    f->buf = buf;
+    f->mark = NULL;
+    f->pos = NULL;
+    f->end = NULL;
+    f->flush = flush;
+    f->arg = arg;
+    f->error = 0;
+}
+
+/*
+ * Adds output written in the current window to the buffer contents and
+ * forgets the window.
+ */
+static void formatter_commit(Formatter *f) {
+    if (f->pos != f->mark) {
+        iobuffer_commit(f->buf, f->pos - f->mark);
+    }
+    f->mark = NULL;
+    f->pos = NULL;
+    f->end = NULL;
+}
+
+/* Finish writing to a Formatter.
+ *
+ * All output written so far becomes part of the buffer contents.  The
+ * buffer may be used directly again after this call, and the Formatter
+ * may continue to be used after it.
+ *
+ * This function returns < 0 with errno set if any output has failed,
+ * in which case some output may be missing, or 0.
+ */
+int formatter_finish(Formatter *f) {
+    formatter_commit(f);
+    if (f->error != 0) {
+        errno = f->error;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Obtain a new window of at least bytes bytes.
+ *
+ * This is the slow path of format_space(), called when the current
+ * window is too small.  If the buffer itself is too full, the flush
+ * function is called until it is not.  A failure is recorded in f, and
+ * all later output to f fails.
+ *
+ * This function returns the start of the new window, or NULL.
+ */
+char *formatter_reserve(Formatter *f, size_t bytes) {
+    size_t length;
+    size_t avail;
+    char *space;
+
+    if (f->error != 0) {
+        return NULL;
+    }
+    formatter_commit(f);
+    space = iobuffer_reserve(f->buf, bytes, &avail);
+    while (space == NULL && errno == ENOBUFS && f->flush != NULL) {
+        length = iobuffer_length(f->buf);
+        if (length == 0) {
+            break;  // the request is larger than any buffer
+        }
+        if (f->flush(f->arg, f->buf) < 0) {
+            break;
+        }
+        if (iobuffer_length(f->buf) == length) {
+            errno = EAGAIN;
+            break;
+        }
+        space = iobuffer_reserve(f->buf, bytes, &avail);
+    }
+    if (space == NULL) {
+        f->error = errno;
+        return NULL;
+    }
+    f->mark = space;
+    f->pos = space;
+    f->end = space + avail;
+
+    return space;
+}
+
+/*
+ * Appends bytes that do not fit in the current window, filling and
+ * replacing windows as needed.  Returns < 0 on error.
+ */
+int format_bytes_slow(Formatter *f, const void *data, size_t len) {
+    const char *src = data;
+    size_t chunk;
+
+    while (len > 0) {
+        if (f->pos == f->end && formatter_reserve(f, 1) == NULL) {
+            return -1;
+        }
+        chunk = (size_t)(f->end - f->pos) < len ? (size_t)(f->end - f->pos)
+                                                : len;
+        memcpy(f->pos, src, chunk);
+        f->pos += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/* Flush function writing to a file descriptor.
+ *
+ * This function returns < 0 if write() fails, or 0.
+ *
+ * arg: points to the int file descriptor to write to
+ * buf: the buffer to drain
+ */
+int format_flush_fd(void *arg, IOBuffer *buf) {
+    ssize_t written;
+
+    do {
+        written = write(*(int *)arg, iobuffer_data(buf),
+                        iobuffer_length(buf));
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) {
+        return -1;
+    }
+    iobuffer_consume(buf, written);
+
+    return 0;
+}
+
+/*
+ * Returns the number of decimal digits in value, without a loop: the
+ * bit length gives an estimate that is at most one too small.
+ */
+static int uint_digits(uint64_t value) {
+    int estimate = ((64 - __builtin_clzll(value | 1)) * 1233) >> 12;
+
+    return estimate + ((value | 1) >= POW10[estimate]);
+}
+
+/*
+ * Writes the digits of value, which has exactly n digits, to p.
+ */
+static void write_digits(char *p, uint64_t value, int n) {
+    char *q = p + n;
+
+    while (value >= 100) {
+        q -= 2;
+        memcpy(q, &DIGIT_PAIRS[(value % 100) * 2], 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        memcpy(q - 2, &DIGIT_PAIRS[value * 2], 2);
+    } else {
+        q[-1] = '0' + value;
+    }
+}
+
+/* Append an unsigned integer in decimal.
+ *
+ * This function returns < 0 on error, or 0.
+ */
+int format_uint(Formatter *f, uint64_t value) {
+    int n = uint_digits(value);
+    char *p = format_space(f, n);
+
+    if (p == NULL) {
+        return -1;
+    }
+    write_digits(p, value, n);
+    f->pos += n;
+
+    return 0;
+}
+
+/* Append a signed integer in decimal.
+ *
+ * This function returns < 0 on error, or 0.
+ */
+int format_int(Formatter *f, int64_t value) {
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    int n = uint_digits(magnitude);
+    int sign = value < 0;
+    char *p = format_space(f, n + sign);
+
+    if (p == NULL) {
+        return -1;
+    }
+    p[0] = '-';
+    write_digits(p + sign, magnitude, n);
+    f->pos += n + sign;
+
+    return 0;
+}
+
+/*
+ * Appends value with snprintf("%.*f"), directly into the window.
+ * Returns < 0 on error.
+ */
+static int format_double_slow(Formatter *f, double value, int precision) {
+    size_t room = f->end - f->pos;
+    int n = snprintf(f->pos, room, "%.*f", precision, value);
+
+    if (n >= 0 && (size_t)n >= room) {
+        /* Too long for the window; get enough, including the NUL. */
+        if (format_space(f, n + 1) == NULL) {
+            return -1;
+        }
+        n = snprintf(f->pos, n + 1, "%.*f", precision, value);
+    }
+    if (n < 0) {
+        f->error = EINVAL;
+        return -1;
+    }
+    f->pos += n;
+
+    return 0;
+}
+
+/* Append a floating point value with a fixed number of decimals.
+ *
+ * The output is the same as that of printf("%.*f", precision, value).
+ * For up to 9 decimals and values that scale to less than 2^53, the
+ * value is rounded to an integer count of units in the last place and
+ * written as integers; a scaled value so close to a rounding boundary
+ * that the scaling error could matter goes to snprintf(), as do all
+ * others.
+ *
+ * This function returns < 0 on error, or 0.
+ */
+int format_double(Formatter *f, double value, int precision) {
+    double scaled;
+    double whole;
+    double fraction;
+    uint64_t units;
+    uint64_t integer;
+    int sign = signbit(value) != 0;
+    int n;
+    char *p;
+
+    if (precision < 0 || precision > DOUBLE_FAST_PRECISION) {
+        return format_double_slow(f, value, precision < 0 ? 6 : precision);
+    }
+    scaled = fabs(value) * (double)POW10[precision];
+    if (!(scaled < EXACT_INTEGER_LIMIT)) {
+        return format_double_slow(f, value, precision);  // also NaN
+    }
+    whole = floor(scaled);
+    fraction = scaled - whole;
+    if (fabs(fraction - 0.5) <= scaled * 0x1p-51) {
+        return format_double_slow(f, value, precision);
+    }
+    units = (uint64_t)whole + (fraction > 0.5);
+    integer = units / POW10[precision];
+    n = uint_digits(integer);
+
+    p = format_space(f, sign + n + (precision > 0) + precision);
+    if (p == NULL) {
+        return -1;
+    }
+    p[0] = '-';
+    write_digits(p + sign, integer, n);
+    p += sign + n;
+    if (precision > 0) {
+        *p++ = '.';
+        units %= POW10[precision];
+        /* Leading zeros of the fraction come from the padding. */
+        memset(p, '0', precision);
+        if (units > 0) {
+            n = uint_digits(units);
+            write_digits(p + precision - n, units, n);
+        }
+        p += precision;
+    }
+    f->pos = p;
+
+    return 0;
+}
+
+/*
+ * Returns true if byte c must be escaped in a JSON string.
+ */
+static bool json_special(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+/*
+ * Writes the escape for byte c to p.  Returns the length of the escape.
+ */
+static size_t json_escape(char *p, unsigned char c) {
+    p[0] = '\\';
+    switch (c) {
+    case '"':
+    case '\\':
+        p[1] = c;
+        return 2;
+    case '\b':
+        p[1] = 'b';
+        return 2;
+    case '\f':
+        p[1] = 'f';
+        return 2;
+    case '\n':
+        p[1] = 'n';
+        return 2;
+    case '\r':
+        p[1] = 'r';
+        return 2;
+    case '\t':
+        p[1] = 't';
+        return 2;
+    default:
+        memcpy(p + 1, "u00", 3);
+        p[4] = HEX_DIGITS[c >> 4];
+        p[5] = HEX_DIGITS[c & 0xF];
+        return JSON_ESCAPE_MAX;
+    }
+}
+
+/* Append a string as a quoted JSON string.
+ *
+ * Quotes, backslashes, and control characters are escaped; all other
+ * bytes, including UTF-8 sequences, are copied unchanged.  Each step
+ * copies 16 bytes into the output and checks them in one comparison,
+ * and only advances to the first that needs escaping.
+ *
+ * This function returns < 0 on error, or 0.
+ *
+ * f:   the Formatter to append to
+ * s:   the string, which need not be NUL-terminated
+ * len: the length of s
+ */
+int format_json_string(Formatter *f, const char *s, size_t len) {
+    size_t i = 0;
+    char *p;
+
+    if (format_bytes(f, "\"", 1) < 0) {
+        return -1;
+    }
+    while (i < len) {
+#ifdef __SSE2__
+        if (len - i >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+            __m128i low = _mm_set1_epi8(0x1F);
+            __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                _mm_cmpeq_epi8(_mm_max_epu8(v, low), low));
+            unsigned mask = _mm_movemask_epi8(special);
+            size_t clean = mask == 0 ? 16 : __builtin_ctz(mask);
+
+            if ((p = format_space(f, 16)) == NULL) {
+                return -1;
+            }
+            _mm_storeu_si128((__m128i *)p, v);
+            f->pos += clean;
+            i += clean;
+            if (clean == 16) {
+                continue;
+            }
+        }
+#endif
+        if (json_special(s[i])) {
+            if ((p = format_space(f, JSON_ESCAPE_MAX)) == NULL) {
+                return -1;
+            }
+            f->pos += json_escape(p, s[i]);
+        } else if (format_bytes(f, s + i, 1) < 0) {
+            return -1;
+        }
+        i++;
+    }
+
+    return format_bytes(f, "\"", 1);
+}
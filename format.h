@@ -0,0 +1,141 @@
+/* agent <agent@local>
+ * Formatted output written directly into IOBuffers.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in format.c, and the FORMAT() macro, whose format is
+ * resolved entirely at compile time:
+ *
+ *     FORMAT(f, FMT_LIT("HTTP/1.1 "), FMT_UINT(status),
+ *            FMT_LIT("\r\nContent-Length: "), FMT_UINT(length),
+ *            FMT_LIT("\r\n\r\n"));
+ *
+ * Each item becomes a direct call to the matching format_*() function,
+ * and the length of every literal is a constant, so nothing is parsed
+ * or measured at run time.
+ */
+
+#ifndef FORMAT_H_
+#define FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "example.h"
+
+/* Makes room in a full buffer, e.g., by writing some of it out.  It
+ * must consume at least some data, and returns < 0 on error. */
+typedef int (*FormatFlushFunc)(void *arg, IOBuffer *buf);
+
+/* Output cursor into the free space of an IOBuffer
+ *
+ * This structure is public only so that the fast paths below can be
+ * inlined; its fields should be used only through these functions.
+ */
+typedef struct {
+    IOBuffer *buf;
+    char *mark;             // start of uncommitted output
+    char *pos;              // next byte to write
+    char *end;              // end of the reserved space
+    FormatFlushFunc flush;  // NULL to fail when the buffer is full
+    void *arg;
+    int error;              // errno of the first failure, or 0
+} Formatter;
+
+void formatter_init(Formatter *f, IOBuffer *buf, FormatFlushFunc flush,
+                    void *arg);
+
+int formatter_finish(Formatter *f);
+
+char *formatter_reserve(Formatter *f, size_t bytes);
+
+int format_bytes_slow(Formatter *f, const void *data, size_t len);
+
+int format_flush_fd(void *arg, IOBuffer *buf);
+
+int format_uint(Formatter *f, uint64_t value);
+
+int format_int(Formatter *f, int64_t value);
+
+int format_double(Formatter *f, double value, int precision);
+
+int format_json_string(Formatter *f, const char *s, size_t len);
+
+/*
+ * Returns a pointer to at least bytes bytes of space for output, or NULL
+ * if it cannot be made.  The caller advances f->pos past what it writes.
+ */
+static inline char *format_space(Formatter *f, size_t bytes) {
+    if ((size_t)(f->end - f->pos) >= bytes) {
+        return f->pos;
+    }
+
+    return formatter_reserve(f, bytes);
+}
+
+/*
+ * Appends len bytes.  Returns < 0 on error.
+ */
+static inline int format_bytes(Formatter *f, const void *data, size_t len) {
+    if ((size_t)(f->end - f->pos) < len) {
+        return format_bytes_slow(f, data, len);
+    }
+    memcpy(f->pos, data, len);
+    f->pos += len;
+
+    return 0;
+}
+
+/*
+ * Returns < 0 if any output to f has failed, or 0.
+ */
+static inline int formatter_status(Formatter *f) {
+    return f->error == 0 ? 0 : -1;
+}
+
+/* FORMAT() items */
+#define FMT_LIT(s)            (format_bytes, (s), sizeof(s) - 1)
+#define FMT_STR(s, len)       (format_bytes, (s), (len))
+#define FMT_CSTR(s)           (format_bytes, (s), strlen(s))
+#define FMT_UINT(x)           (format_uint, (x))
+#define FMT_INT(x)            (format_int, (x))
+#define FMT_DOUBLE(x, prec)   (format_double, (x), (prec))
+#define FMT_JSON(s, len)      (format_json_string, (s), (len))
+
+/* Append up to 16 items to the Formatter f, which is evaluated once per
+ * item.  Evaluates to < 0 if output has failed, or 0. */
+#define FORMAT(f, ...)                                                  \
+    (FORMAT_CAT(FORMAT_EACH_, FORMAT_NARGS(__VA_ARGS__))(f, __VA_ARGS__), \
+     formatter_status(f))
+
+/* Implementation of FORMAT(); an item (fn, args...) becomes fn(f,
+ * args...). */
+#define FORMAT_CAT(a, b) FORMAT_CAT_(a, b)
+#define FORMAT_CAT_(a, b) a##b
+#define FORMAT_NARGS(...)                                               \
+    FORMAT_NARGS_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, \
+                  5, 4, 3, 2, 1)
+#define FORMAT_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, \
+                      _13, _14, _15, _16, n, ...) n
+#define FORMAT_UNPACK(...) __VA_ARGS__
+#define FORMAT_INVOKE(...) FORMAT_INVOKE_(__VA_ARGS__)
+#define FORMAT_INVOKE_(f, fn, ...) fn(f, __VA_ARGS__)
+#define FORMAT_ONE(f, item) (void)FORMAT_INVOKE(f, FORMAT_UNPACK item)
+#define FORMAT_EACH_1(f, x) FORMAT_ONE(f, x)
+#define FORMAT_EACH_2(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_1(f, __VA_ARGS__)
+#define FORMAT_EACH_3(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_2(f, __VA_ARGS__)
+#define FORMAT_EACH_4(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_3(f, __VA_ARGS__)
+#define FORMAT_EACH_5(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_4(f, __VA_ARGS__)
+#define FORMAT_EACH_6(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_5(f, __VA_ARGS__)
+#define FORMAT_EACH_7(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_6(f, __VA_ARGS__)
+#define FORMAT_EACH_8(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_7(f, __VA_ARGS__)
+#define FORMAT_EACH_9(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_8(f, __VA_ARGS__)
+#define FORMAT_EACH_10(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_9(f, __VA_ARGS__)
+#define FORMAT_EACH_11(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_10(f, __VA_ARGS__)
+#define FORMAT_EACH_12(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_11(f, __VA_ARGS__)
+#define FORMAT_EACH_13(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_12(f, __VA_ARGS__)
+#define FORMAT_EACH_14(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_13(f, __VA_ARGS__)
+#define FORMAT_EACH_15(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_14(f, __VA_ARGS__)
+#define FORMAT_EACH_16(f, x, ...) FORMAT_ONE(f, x), FORMAT_EACH_15(f, __VA_ARGS__)
+
+#endif /* FORMAT_H_ */
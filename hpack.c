@@ -0,0 +1,733 @@
+/* agent <agent@local>
+ * HPACK header block decompression for HTTP/2.
+ *
+ * An HpackDecoder decodes the header blocks of one connection (RFC
+ * 7541), calling a function with each header field.  Field names and
+ * values are handed out as views wherever possible: literals point into
+ * the header block, and indexed fields into the static or dynamic
+ * table.  Only Huffman-coded strings are decoded into the decoder's own
+ * memory.
+ *
+ * Huffman decoding is table driven.  The next HUFFMAN_FAST_BITS bits of
+ * input index a table giving up to two whole symbols they begin with,
+ * so the common short codes decode two at a time with one lookup.  The
+ * eight-kilobyte table stays in the L1 cache.  Codes longer than the
+ * lookup are rare bytes, and are decoded from the canonical form of the
+ * code: HPACK's code is canonical, so a code of length n is just an
+ * offset from the first code of that length.  Both tables are built
+ * from the code lengths at first use.
+ *
+ * The dynamic table keeps the names and values of its entries in one
+ * block of memory twice its maximum size, one entry after another, and
+ * wraps to the start when an entry does not fit at the end.  Entries
+ * are evicted by table size before one is added, which always leaves
+ * room for it in the block, and so every entry is contiguous and can
+ * be handed out as a view.  The descriptors of the entries are a ring
+ * of twelve-byte records, so looking up an index touches one record.
+ *
+ * A header block may be split across HEADERS and CONTINUATION frames,
+ * and a field may be split between them.  The unparsed end of one
+ * fragment is kept and joined with the next; only then are the bytes
+ * of a block copied.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+/* Number of Huffman symbols: the 256 byte values and EOS.  This is an
+ * array size. */
+#define HUFFMAN_SYMBOLS 257
+
+/* Bits of input looked up at once.  2^11 four-byte entries fill eight
+ * kilobytes, and eleven bits hold two codes of up to five or six bits,
+ * which covers the common lowercase letters and digits. */
+#define HUFFMAN_FAST_BITS 11
+
+/* Longest Huffman code, the EOS symbol; array size */
+#define HUFFMAN_MAX_BITS 30
+
+/* Entries in the static table (RFC 7541, Appendix A); array size */
+#define STATIC_ENTRIES 61
+
+/* The EOS symbol, which must not appear in a string */
+static const int HUFFMAN_EOS = 256;
+
+/* Size a dynamic table entry counts for beyond its name and value
+ * (RFC 7541, section 4.1) */
+static const size_t ENTRY_OVERHEAD = 32;
+
+/* Largest integer accepted in a header block.  Far beyond any real
+ * index or string length, and it keeps the arithmetic in 32 bits. */
+static const uint32_t INTEGER_MAX = 1U << 28;
+
+/* Static table entry */
+typedef struct {
+    const char *name;
+    size_t namelen;
+    const char *value;
+    size_t valuelen;
+} StaticEntry;
+
+/* A StaticEntry for a name and value given as string literals */
+#define STATIC(name, value) \
+    { name, sizeof(name) - 1, value, sizeof(value) - 1 }
+
+/* Length of the Huffman code of each symbol (RFC 7541, Appendix B) */
+static const uint8_t HUFFMAN_LENGTHS[HUFFMAN_SYMBOLS] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/* The static table; index 1 is the first entry */
+static const StaticEntry STATIC_TABLE[STATIC_ENTRIES] = {
+    STATIC(":authority", ""),
+    STATIC(":method", "GET"),
+    STATIC(":method", "POST"),
+    STATIC(":path", "/"),
+    STATIC(":path", "/index.html"),
+    STATIC(":scheme", "http"),
+    STATIC(":scheme", "https"),
+    STATIC(":status", "200"),
+    STATIC(":status", "204"),
+    STATIC(":status", "206"),
+    STATIC(":status", "304"),
+    STATIC(":status", "400"),
+    STATIC(":status", "404"),
+    STATIC(":status", "500"),
+    STATIC("accept-charset", ""),
+    STATIC("accept-encoding", "gzip, deflate"),
+    STATIC("accept-language", ""),
+    STATIC("accept-ranges", ""),
+    STATIC("accept", ""),
+    STATIC("access-control-allow-origin", ""),
+    STATIC("age", ""),
+    STATIC("allow", ""),
+    STATIC("authorization", ""),
+    STATIC("cache-control", ""),
+    STATIC("content-disposition", ""),
+    STATIC("content-encoding", ""),
+    STATIC("content-language", ""),
+    STATIC("content-length", ""),
+    STATIC("content-location", ""),
+    STATIC("content-range", ""),
+    STATIC("content-type", ""),
+    STATIC("cookie", ""),
+    STATIC("date", ""),
+    STATIC("etag", ""),
+    STATIC("expect", ""),
+    STATIC("expires", ""),
+    STATIC("from", ""),
+    STATIC("host", ""),
+    STATIC("if-match", ""),
+    STATIC("if-modified-since", ""),
+    STATIC("if-none-match", ""),
+    STATIC("if-range", ""),
+    STATIC("if-unmodified-since", ""),
+    STATIC("last-modified", ""),
+    STATIC("link", ""),
+    STATIC("location", ""),
+    STATIC("max-forwards", ""),
+    STATIC("proxy-authenticate", ""),
+    STATIC("proxy-authorization", ""),
+    STATIC("range", ""),
+    STATIC("referer", ""),
+    STATIC("refresh", ""),
+    STATIC("retry-after", ""),
+    STATIC("server", ""),
+    STATIC("set-cookie", ""),
+    STATIC("strict-transport-security", ""),
+    STATIC("transfer-encoding", ""),
+    STATIC("user-agent", ""),
+    STATIC("vary", ""),
+    STATIC("via", ""),
+    STATIC("www-authenticate", ""),
+};
+
+/* One dynamic table entry, whose name and value are contiguous at
+ * offset in the decoder's storage */
+typedef struct {
+    uint32_t offset;
+    uint32_t namelen;
+    uint32_t valuelen;
+} TableEntry;
+
+/* Decompression state of one connection */
+struct _HpackDecoder {
+    char *storage;          // entry names and values; 2 * max_capacity
+    size_t storage_size;
+    size_t tail;            // storage offset just past the newest entry
+    TableEntry *entries;    // ring, oldest at first
+    uint32_t entries_mask;
+    uint32_t first;
+    uint32_t count;
+    size_t size;            // table size as defined by RFC 7541
+    size_t capacity;        // current maximum size, set by the encoder
+    size_t max_capacity;    // limit on capacity, from our SETTINGS
+    char *scratch;          // decoded Huffman strings of one field
+    size_t scratch_size;
+    char *carry;            // unparsed end of the previous fragment
+    size_t carry_len;
+    size_t carry_size;
+};
+
+/* Huffman decoding tables, built by huffman_init().  A fast entry holds
+ * the length of its first code in bits 0-3, that of its second in bits
+ * 4-7, the symbols in bits 8-15 and 16-23, and their count in bits
+ * 24-25. */
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+static uint32_t huffman_fast[1 << HUFFMAN_FAST_BITS];
+static uint32_t huffman_first[HUFFMAN_MAX_BITS + 1];   // first code
+static uint16_t huffman_offset[HUFFMAN_MAX_BITS + 1];  // into sorted
+static uint16_t huffman_count[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_sorted[HUFFMAN_SYMBOLS];       // by code
+
+/*
+ * Decodes the symbol whose code starts the nbits low bits of acc,
+ * trying codes of at least min bits.  Returns the symbol and sets *len
+ * to its length, or returns -1 if no whole code is present.
+ */
+static int huffman_canonical(uint64_t acc, int nbits, int min, int *len) {
+    uint32_t code;
+
+    for (int l = min; l <= nbits && l <= HUFFMAN_MAX_BITS; l++) {
+        code = (acc >> (nbits - l)) & ((1U << l) - 1);
+        if (code - huffman_first[l] < huffman_count[l]) {
+            *len = l;
+            return huffman_sorted[huffman_offset[l] + code
+                                  - huffman_first[l]];
+        }
+    }
+    return -1;
+}
+
+/*
+ * Builds the canonical code tables from the code lengths, and the fast
+ * lookup table from them.
+ */
+static void huffman_init(void) {
+    uint32_t code = 0;
+    int index = 0;
+    int sym1;
+    int sym2;
+    int len1;
+    int len2;
+
+    for (int s = 0; s < HUFFMAN_SYMBOLS; s++) {
+        huffman_count[HUFFMAN_LENGTHS[s]]++;
+    }
+    for (int l = 1; l <= HUFFMAN_MAX_BITS; l++) {
+        huffman_first[l] = code;
+        huffman_offset[l] = index;
+        for (int s = 0; s < HUFFMAN_SYMBOLS; s++) {
+            if (HUFFMAN_LENGTHS[s] == l) {
+                huffman_sorted[index++] = s;
+            }
+        }
+        code = (code + huffman_count[l]) << 1;
+    }
+
+    for (uint32_t v = 0; v < 1U << HUFFMAN_FAST_BITS; v++) {
+        sym1 = huffman_canonical(v, HUFFMAN_FAST_BITS, 1, &len1);
+        if (sym1 < 0) {
+            continue;
+        }
+        huffman_fast[v] = len1 | sym1 << 8 | 1U << 24;
+        sym2 = huffman_canonical(v, HUFFMAN_FAST_BITS - len1, 1, &len2);
+        if (sym2 >= 0) {
+            huffman_fast[v] |= len2 << 4 | sym2 << 16 | 2U << 24;
+        }
+    }
+}
+
+/*
+ * Returns the most bytes that hpack_huffman_decode() can produce from
+ * len bytes of input.  The shortest code is five bits.
+ */
+size_t hpack_huffman_decoded_max(size_t len) {
+    return len * 8 / 5;
+}
+
+/* Decode a Huffman-coded string.
+ *
+ * This function returns < 0 with errno set to EPROTO if the input is
+ * not a valid string (it contains EOS, or its padding is not up to
+ * seven one bits), or the number of bytes decoded.
+ *
+ * src: the coded string
+ * len: the number of bytes at src
+ * dst: where to store the string; hpack_huffman_decoded_max(len) bytes
+ */
+int hpack_huffman_decode(const char *src, size_t len, char *dst) {
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *end = in + len;
+    const uint32_t mask = (1U << HUFFMAN_FAST_BITS) - 1;
+    uint64_t acc = 0;
+    int nbits = 0;   // valid bits at the bottom of acc
+    char *out = dst;
+    uint32_t e;
+    int sym;
+    int l;
+
+    pthread_once(&huffman_once, huffman_init);
+    for (;;) {
+        while (nbits <= 56 && in < end) {
+            acc = acc << 8 | *in++;
+            nbits += 8;
+        }
+        if (nbits >= HUFFMAN_FAST_BITS) {
+            e = huffman_fast[(acc >> (nbits - HUFFMAN_FAST_BITS)) & mask];
+            if (e != 0) {
+                *out++ = e >> 8;
+                nbits -= e & 0xF;
+                if (e >> 24 == 2) {
+                    *out++ = e >> 16;
+                    nbits -= e >> 4 & 0xF;
+                }
+                continue;
+            }
+            /* With input left, nbits > 56 here, and the code is
+             * complete, so a long code must be found. */
+            sym = huffman_canonical(acc, nbits, HUFFMAN_FAST_BITS + 1, &l);
+            if (sym < 0 || sym == HUFFMAN_EOS) {
+                break;
+            }
+            *out++ = sym;
+            nbits -= l;
+            continue;
+        }
+
+        /* The input is used up; look up the last bits padded with
+         * ones, and take a symbol only if it lies in real bits. */
+        if (nbits == 0) {
+            return out - dst;
+        }
+        e = huffman_fast[(acc << (HUFFMAN_FAST_BITS - nbits)
+                          | ((1U << (HUFFMAN_FAST_BITS - nbits)) - 1))
+                         & mask];
+        if (e != 0 && (int)(e & 0xF) <= nbits) {
+            *out++ = e >> 8;
+            nbits -= e & 0xF;
+            continue;
+        }
+        if (nbits < 8 && (acc & ((1U << nbits) - 1)) == (1U << nbits) - 1) {
+            return out - dst;
+        }
+        break;
+    }
+
+    errno = EPROTO;
+    return -1;
+}
+
+/* Create a decoder for one connection.
+ *
+ * This function returns NULL if memory is exhausted.
+ *
+ * max_table_size: the SETTINGS_HEADER_TABLE_SIZE sent to the peer;
+ *                 4096 unless it was changed
+ */
+HpackDecoder *hpack_decoder_create(size_t max_table_size) {
+    HpackDecoder *d = calloc(1, sizeof(HpackDecoder));
+    uint32_t nentries = 1;
+
+    if (d == NULL) {
+        return NULL;
+    }
+    while (nentries < max_table_size / ENTRY_OVERHEAD) {
+        nentries *= 2;
+    }
+    d->max_capacity = max_table_size;
+    d->capacity = max_table_size;
+    d->storage_size = 2 * max_table_size;
+    d->storage = malloc(d->storage_size + 1);
+    d->entries = malloc(nentries * sizeof(TableEntry));
+    d->entries_mask = nentries - 1;
+    if (d->storage == NULL || d->entries == NULL) {
+        hpack_decoder_destroy(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+/*
+ * Frees a decoder.
+ */
+void hpack_decoder_destroy(HpackDecoder *d) {
+    if (d != NULL) {
+        free(d->storage);
+        free(d->entries);
+        free(d->scratch);
+        free(d->carry);
+        free(d);
+    }
+}
+
+/*
+ * Evicts the oldest dynamic table entries until extra more bytes of
+ * table size fit within its capacity, or the table is empty.
+ */
+static void table_evict(HpackDecoder *d, size_t extra) {
+    TableEntry *e;
+
+    while (d->count > 0 && d->size + extra > d->capacity) {
+        e = &d->entries[d->first];
+        d->size -= e->namelen + e->valuelen + ENTRY_OVERHEAD;
+        d->first = (d->first + 1) & d->entries_mask;
+        d->count--;
+    }
+    if (d->count == 0) {
+        d->tail = 0;
+    }
+}
+
+/*
+ * Adds a field to the dynamic table, and points the field at the
+ * table's copy.  The name may itself be in the table.
+ */
+static void table_insert(HpackDecoder *d, HpackField *f) {
+    size_t len = f->namelen + f->valuelen;
+    size_t offset;
+    TableEntry *e;
+
+    table_evict(d, len + ENTRY_OVERHEAD);
+    if (len + ENTRY_OVERHEAD > d->capacity) {
+        return;  // too large; the table is left empty
+    }
+    /* Live entries take at most max_capacity - len bytes of a block
+     * twice that size, so there is room after the newest entry, or at
+     * the start of the block when that is too near its end. */
+    offset = d->tail + len <= d->storage_size ? d->tail : 0;
+    memmove(d->storage + offset, f->name, f->namelen);
+    memcpy(d->storage + offset + f->namelen, f->value, f->valuelen);
+
+    e = &d->entries[(d->first + d->count) & d->entries_mask];
+    e->offset = offset;
+    e->namelen = f->namelen;
+    e->valuelen = f->valuelen;
+    d->count++;
+    d->size += len + ENTRY_OVERHEAD;
+    d->tail = offset + len;
+
+    f->name = d->storage + offset;
+    f->value = f->name + f->namelen;
+}
+
+/*
+ * Sets the name, and the value if with_value, of a field from the
+ * static or dynamic table.  Returns < 0 if the index is not in use.
+ */
+static int table_get(HpackDecoder *d, uint32_t index, HpackField *f,
+                     bool with_value) {
+    const StaticEntry *s;
+    TableEntry *e;
+
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= STATIC_ENTRIES) {
+        s = &STATIC_TABLE[index - 1];
+        f->name = s->name;
+        f->namelen = s->namelen;
+        if (with_value) {
+            f->value = s->value;
+            f->valuelen = s->valuelen;
+        }
+        return 0;
+    }
+    index -= STATIC_ENTRIES + 1;  // 0 is the newest entry
+    if (index >= d->count) {
+        return -1;
+    }
+    e = &d->entries[(d->first + d->count - 1 - index) & d->entries_mask];
+    f->name = d->storage + e->offset;
+    f->namelen = e->namelen;
+    if (with_value) {
+        f->value = f->name + e->namelen;
+        f->valuelen = e->valuelen;
+    }
+    return 0;
+}
+
+/*
+ * Decodes an integer with a prefix of the given bits at *p, advancing
+ * *p.  Returns 1 on success, 0 if the input ends first, or < 0 if the
+ * integer is too large.
+ */
+static int decode_int(const unsigned char **p, const unsigned char *end,
+                      int prefix, uint32_t *value) {
+    const unsigned char *q = *p;
+    uint32_t mask = (1U << prefix) - 1;
+    uint32_t v;
+    int shift = 0;
+
+    if (q >= end) {
+        return 0;
+    }
+    v = *q++ & mask;
+    if (v == mask) {
+        do {
+            if (q >= end) {
+                return 0;
+            }
+            if (shift > 21) {
+                return -1;
+            }
+            v += (uint32_t)(*q & 0x7F) << shift;
+            shift += 7;
+            if (v >= INTEGER_MAX) {
+                return -1;
+            }
+        } while (*q++ & 0x80);
+    }
+    *value = v;
+    *p = q;
+
+    return 1;
+}
+
+/*
+ * Decodes a string literal at *p, advancing *p.  A Huffman-coded string
+ * is decoded into the scratch memory at *used, which is advanced.
+ * Returns 1 on success, 0 if the input ends first, or < 0 on error.
+ */
+static int decode_string(HpackDecoder *d, const unsigned char **p,
+                         const unsigned char *end, const char **str,
+                         size_t *len, size_t *used) {
+    const unsigned char *q = *p;
+    uint32_t n;
+    int result;
+
+    if (q >= end) {
+        return 0;
+    }
+    result = decode_int(&q, end, 7, &n);
+    if (result <= 0) {
+        return result;
+    }
+    if ((size_t)(end - q) < n) {
+        return 0;
+    }
+    if ((**p & 0x80) != 0) {
+        result = hpack_huffman_decode((const char *)q, n, d->scratch + *used);
+        if (result < 0) {
+            return -1;
+        }
+        *str = d->scratch + *used;
+        *len = result;
+        *used += result;
+    } else {
+        *str = (const char *)q;
+        *len = n;
+    }
+    *p = q + n;
+
+    return 1;
+}
+
+/*
+ * Decodes one field representation or table size update at *p,
+ * advancing *p, and passes a field to func.  Returns 1 on success, 0
+ * if the input ends first, or < 0 on error.
+ */
+static int decode_field(HpackDecoder *d, const unsigned char **p,
+                        const unsigned char *end, HpackFieldFunc func,
+                        void *arg) {
+    const unsigned char *q = *p;
+    HpackField f;
+    bool indexing = false;
+    size_t used = 0;
+    uint32_t index;
+    int prefix;
+    int result;
+
+    memset(&f, 0, sizeof(f));
+    if ((*q & 0x80) != 0) {
+        /* Indexed field */
+        result = decode_int(&q, end, 7, &index);
+        if (result <= 0) {
+            return result;
+        }
+        if (table_get(d, index, &f, true) < 0) {
+            return -1;
+        }
+        func(arg, &f);
+        *p = q;
+        return 1;
+    }
+    if ((*q & 0xE0) == 0x20) {
+        /* Dynamic table size update */
+        result = decode_int(&q, end, 5, &index);
+        if (result <= 0) {
+            return result;
+        }
+        if (index > d->max_capacity) {
+            return -1;
+        }
+        d->capacity = index;
+        table_evict(d, 0);
+        *p = q;
+        return 1;
+    }
+
+    /* Literal with incremental indexing, without indexing, or never
+     * indexed, with an indexed or literal name */
+    if ((*q & 0xC0) == 0x40) {
+        indexing = true;
+        prefix = 6;
+    } else {
+        f.sensitive = (*q & 0x10) != 0;
+        prefix = 4;
+    }
+    result = decode_int(&q, end, prefix, &index);
+    if (result <= 0) {
+        return result;
+    }
+    if (index != 0) {
+        if (table_get(d, index, &f, false) < 0) {
+            return -1;
+        }
+    } else {
+        result = decode_string(d, &q, end, &f.name, &f.namelen, &used);
+        if (result <= 0) {
+            return result;
+        }
+    }
+    result = decode_string(d, &q, end, &f.value, &f.valuelen, &used);
+    if (result <= 0) {
+        return result;
+    }
+    if (indexing) {
+        table_insert(d, &f);
+    }
+    func(arg, &f);
+    *p = q;
+
+    return 1;
+}
+
+/*
+ * Decodes the fields in [*p, end), advancing *p past the last whole
+ * one.  Returns < 0 on error.
+ */
+static int decode_fields(HpackDecoder *d, const unsigned char **p,
+                         const unsigned char *end, HpackFieldFunc func,
+                         void *arg) {
+    size_t need = hpack_huffman_decoded_max(end - *p) + 1;
+    char *grown;
+    int result = 1;
+
+    /* Room for every string the input could decode to, so that no
+     * string moves once decoded. */
+    if (need > d->scratch_size) {
+        grown = realloc(d->scratch, need);
+        if (grown == NULL) {
+            return -1;
+        }
+        d->scratch = grown;
+        d->scratch_size = need;
+    }
+    while (*p < end && result > 0) {
+        result = decode_field(d, p, end, func, arg);
+    }
+    if (result < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Keeps len bytes at data as the unparsed end of the current block,
+ * after any already kept.  Returns < 0 if memory is exhausted.
+ */
+static int carry_append(HpackDecoder *d, const char *data, size_t len) {
+    char *grown;
+
+    if (d->carry_len + len > d->carry_size) {
+        grown = realloc(d->carry, d->carry_len + len);
+        if (grown == NULL) {
+            return -1;
+        }
+        d->carry = grown;
+        d->carry_size = d->carry_len + len;
+    }
+    memcpy(d->carry + d->carry_len, data, len);
+    d->carry_len += len;
+
+    return 0;
+}
+
+/* Decode a fragment of a header block.
+ *
+ * The fragments of a block are the payloads of a HEADERS frame and the
+ * CONTINUATION frames following it, with padding and priority removed,
+ * passed in order; end is true for the last (END_HEADERS).  func is
+ * called with each field as it is decoded.  A field split between two
+ * fragments is delivered with the second.
+ *
+ * Any error is a COMPRESSION_ERROR, after which the connection must be
+ * closed; the decoder's state is no longer in step with the peer's.
+ *
+ * This function returns < 0 with errno set on error (EPROTO for an
+ * invalid block, or ENOMEM), or 0 on success.
+ *
+ * d:     the connection's decoder
+ * block: the fragment
+ * len:   the number of bytes at block
+ * end:   block ends the header block
+ * func:  called with each field
+ * arg:   passed to func
+ */
+int hpack_decode(HpackDecoder *d, const char *block, size_t len, bool end,
+                 HpackFieldFunc func, void *arg) {
+    const unsigned char *p = (const unsigned char *)block;
+    const unsigned char *stop = p + len;
+    int result;
+
+    if (d->carry_len > 0) {
+        if (carry_append(d, block, len) < 0) {
+            return -1;
+        }
+        p = (const unsigned char *)d->carry;
+        stop = p + d->carry_len;
+    }
+    result = decode_fields(d, &p, stop, func, arg);
+    if (result == 0 && end && p < stop) {
+        errno = EPROTO;
+        result = -1;
+    }
+    if (result < 0) {
+        d->carry_len = 0;
+        return -1;
+    }
+
+    if (d->carry_len > 0) {
+        d->carry_len = stop - p;
+        memmove(d->carry, p, d->carry_len);
+    } else if (p < stop && carry_append(d, (const char *)p, stop - p) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
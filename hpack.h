@@ -0,0 +1,44 @@
+/* agent <agent@local>
+ * HPACK header block decompression for HTTP/2.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in hpack.c.
+ */
+
+#ifndef HPACK_H_
+#define HPACK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* One decoded header field.  The strings are not NUL-terminated, and
+ * are valid only during the HpackFieldFunc call that receives them. */
+typedef struct {
+    const char *name;
+    size_t namelen;
+    const char *value;
+    size_t valuelen;
+    bool sensitive;    /* Never indexed; must not be re-encoded indexed */
+} HpackField;
+
+/* Called with each header field, in order */
+typedef void (*HpackFieldFunc)(void *arg, const HpackField *field);
+
+/* Decompression state of one HTTP/2 connection
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _HpackDecoder HpackDecoder;
+
+HpackDecoder *hpack_decoder_create(size_t max_table_size);
+
+void hpack_decoder_destroy(HpackDecoder *d);
+
+int hpack_decode(HpackDecoder *d, const char *block, size_t len, bool end,
+                 HpackFieldFunc func, void *arg);
+
+size_t hpack_huffman_decoded_max(size_t len);
+
+int hpack_huffman_decode(const char *src, size_t len, char *dst);
+
+#endif /* HPACK_H_ */
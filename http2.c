@@ -0,0 +1,363 @@
+/* agent <agent@local>
+ * Incremental HTTP/2 framing of IOBuffer contents.
+ *
+ * An H2Splitter takes the bytes read from one connection into an
+ * IOBuffer, as many or as few as each read brings, and returns its
+ * frames.  Frames are returned as views into the IOBuffer, not copies:
+ * the bytes of a frame are consumed from the buffer at the next call,
+ * so a view stays valid until then.
+ *
+ * DATA payloads are streamed.  Whatever part of a DATA payload is in
+ * the buffer is returned as soon as it arrives, one piece per call, so
+ * a large payload never has to fit in the buffer, and its pieces can
+ * be passed on as they come.  Padding is stripped and skipped.
+ *
+ * Other frames are returned whole once all of the frame is in the
+ * buffer.  An IOBuffer's storage block is smaller than the default
+ * maximum frame size, so a frame too large for it, which any peer may
+ * send, is assembled in the splitter's own memory; this is the only
+ * copy.  HEADERS and PUSH_PROMISE payloads have their padding, HEADERS
+ * its priority, and PUSH_PROMISE its promised stream identifier, which
+ * is returned separately, stripped.  The payloads of HEADERS,
+ * PUSH_PROMISE, and CONTINUATION frames are then the header block
+ * fragments to pass to hpack_decode(), with end set by
+ * H2_FLAG_END_HEADERS.
+ *
+ * Only framing is checked here.  The rules of streams and of each frame
+ * type are left to the caller.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "example.h"
+#include "http2.h"
+
+static const size_t FRAME_HEADER_SIZE = 9;
+
+/* The client connection preface, sent before any frame (RFC 7540
+ * section 3.5).  This is an array size, so it is a #define. */
+#define PREFACE_SIZE 24
+static const char PREFACE[PREFACE_SIZE] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/* Smallest and largest SETTINGS_MAX_FRAME_SIZE (RFC 7540 6.5.2) */
+static const uint32_t MIN_FRAME_SIZE = 1U << 14;
+static const uint32_t MAX_FRAME_SIZE = (1U << 24) - 1;
+
+/* Framing state of one connection's input */
+struct _H2Splitter {
+    uint32_t max_frame_size;
+    bool preface;        // the client preface is still expected
+    size_t pending;      // bytes of the last view, consumed next call
+    H2Frame frame;       // header of the frame in progress
+    bool in_frame;       // its header has been consumed from the buffer
+    uint32_t data_left;  // DATA payload bytes not yet returned
+    uint32_t pad_left;   // DATA padding bytes not yet skipped
+    bool returned;       // a piece of the DATA payload was returned
+    char *scratch;       // assembly of frames too large for a buffer
+    size_t scratch_len;
+    size_t scratch_size;
+};
+
+/* Create a splitter for the input of one connection.
+ *
+ * This function returns NULL with errno set if max_frame_size is not
+ * a valid SETTINGS_MAX_FRAME_SIZE (EINVAL) or memory is exhausted.
+ *
+ * max_frame_size: the SETTINGS_MAX_FRAME_SIZE sent to the peer; 16384
+ *                 unless it was changed
+ * preface:        the input begins with the client connection preface;
+ *                 true for a server
+ */
+H2Splitter *h2_splitter_create(uint32_t max_frame_size, bool preface) {
+    H2Splitter *sp;
+
+    if (max_frame_size < MIN_FRAME_SIZE || max_frame_size > MAX_FRAME_SIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+    sp = calloc(1, sizeof(H2Splitter));
+    if (sp == NULL) {
+        return NULL;
+    }
+    sp->max_frame_size = max_frame_size;
+    sp->preface = preface;
+
+    return sp;
+}
+
+/*
+ * Frees a splitter.  The views it returned are no longer valid.
+ */
+void h2_splitter_destroy(H2Splitter *sp) {
+    if (sp != NULL) {
+        free(sp->scratch);
+        free(sp);
+    }
+}
+
+/*
+ * Decodes the frame header at p into sp->frame.
+ */
+static void parse_header(H2Splitter *sp, const unsigned char *p) {
+    memset(&sp->frame, 0, sizeof(sp->frame));
+    sp->frame.length = (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+    sp->frame.type = p[3];
+    sp->frame.flags = p[4];
+    sp->frame.stream = ((uint32_t)p[5] << 24 | p[6] << 16 | p[7] << 8 | p[8])
+                       & 0x7FFFFFFF;
+}
+
+/*
+ * Sets the data of a whole non-DATA frame to its payload at payload,
+ * less any padding, priority, or promised stream, which is stored in
+ * frame->promised.  Returns < 0 if the payload is too short for them.
+ */
+static int frame_payload(H2Frame *frame, const char *payload) {
+    size_t size = frame->length;
+    size_t pad = 0;
+
+    frame->data = payload;
+    if ((frame->flags & H2_FLAG_PADDED) != 0
+        && (frame->type == H2_HEADERS || frame->type == H2_PUSH_PROMISE)) {
+        if (size < 1 || (unsigned char)payload[0] >= size) {
+            return -1;
+        }
+        pad = (unsigned char)payload[0];
+        frame->data++;
+        size -= 1 + pad;
+    }
+    if ((frame->flags & H2_FLAG_PRIORITY) != 0
+        && frame->type == H2_HEADERS) {
+        if (size < 5) {
+            return -1;
+        }
+        frame->data += 5;
+        size -= 5;
+    }
+    if (frame->type == H2_PUSH_PROMISE) {
+        if (size < 4) {
+            return -1;
+        }
+        frame->promised = ((uint32_t)(unsigned char)frame->data[0] << 24
+                           | (unsigned char)frame->data[1] << 16
+                           | (unsigned char)frame->data[2] << 8
+                           | (unsigned char)frame->data[3]) & 0x7FFFFFFF;
+        frame->data += 4;
+        size -= 4;
+    }
+    frame->size = size;
+    frame->last = true;
+
+    return 0;
+}
+
+/*
+ * Returns the next piece of the DATA frame in progress, skipping its
+ * padding once the payload is returned.  Returns 1 with a piece, or 0
+ * if the buffer holds no more of the frame.
+ */
+static int next_data(H2Splitter *sp, IOBuffer *buf, H2Frame *frame) {
+    size_t length = iobuffer_length(buf);
+    size_t bytes;
+
+    if (sp->data_left > 0 || !sp->returned) {
+        bytes = length < sp->data_left ? length : sp->data_left;
+        if (bytes == 0 && sp->data_left > 0) {
+            return 0;
+        }
+        *frame = sp->frame;
+        frame->data = iobuffer_data(buf);
+        frame->size = bytes;
+        sp->data_left -= bytes;
+        frame->last = sp->data_left == 0;
+        sp->pending = bytes;
+        sp->returned = true;
+        sp->in_frame = sp->data_left > 0 || sp->pad_left > 0;
+        return 1;
+    }
+
+    bytes = length < sp->pad_left ? length : sp->pad_left;
+    iobuffer_consume(buf, bytes);
+    sp->pad_left -= bytes;
+    sp->in_frame = sp->pad_left > 0;
+
+    return 0;
+}
+
+/*
+ * Begins the frame whose header is at the front of the buffer.  A DATA
+ * frame has its header consumed and its first piece returned, and a
+ * frame too large for the buffer has its header consumed and is
+ * assembled by later calls; any other frame is returned now if all of
+ * it is in the buffer.  Returns 1 with a frame, 0 if more input
+ * is needed, or < 0 on error.
+ */
+static int next_frame(H2Splitter *sp, IOBuffer *buf, H2Frame *frame) {
+    const unsigned char *p;
+    size_t length = iobuffer_length(buf);
+    size_t storage;
+    size_t total;
+
+    if (length < FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    /* This may move the data out of inline storage, so it comes before
+     * any pointer into the data is taken. */
+    if (iobuffer_storage(buf, &storage) == NULL) {
+        return -1;
+    }
+    p = (const unsigned char *)iobuffer_data(buf);
+    parse_header(sp, p);
+    if (sp->frame.length > sp->max_frame_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    total = FRAME_HEADER_SIZE + sp->frame.length;
+
+    if (sp->frame.type == H2_DATA) {
+        sp->data_left = sp->frame.length;
+        sp->pad_left = 0;
+        if ((sp->frame.flags & H2_FLAG_PADDED) != 0) {
+            if (sp->frame.length == 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (length < FRAME_HEADER_SIZE + 1) {
+                return 0;
+            }
+            sp->pad_left = p[FRAME_HEADER_SIZE];
+            if (sp->pad_left >= sp->frame.length) {
+                errno = EPROTO;
+                return -1;
+            }
+            sp->data_left -= 1 + sp->pad_left;
+            iobuffer_consume(buf, 1);
+        }
+        iobuffer_consume(buf, FRAME_HEADER_SIZE);
+        sp->in_frame = true;
+        sp->returned = false;
+        return next_data(sp, buf, frame);
+    }
+
+    if (total > storage) {
+        if (sp->frame.length > sp->scratch_size) {
+            free(sp->scratch);
+            sp->scratch = malloc(sp->frame.length);
+            if (sp->scratch == NULL) {
+                sp->scratch_size = 0;
+                return -1;
+            }
+            sp->scratch_size = sp->frame.length;
+        }
+        sp->scratch_len = 0;
+        iobuffer_consume(buf, FRAME_HEADER_SIZE);
+        sp->in_frame = true;
+        return 0;
+    }
+    if (length < total) {
+        return 0;
+    }
+
+    *frame = sp->frame;
+    if (frame_payload(frame, (const char *)p + FRAME_HEADER_SIZE) < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    sp->pending = total;
+
+    return 1;
+}
+
+/*
+ * Copies the buffer's part of the frame being assembled into scratch
+ * memory.  Returns 1 with the frame once it is whole, 0 if more input
+ * is needed, or < 0 on error.
+ */
+static int next_assembled(H2Splitter *sp, IOBuffer *buf, H2Frame *frame) {
+    size_t length = iobuffer_length(buf);
+    size_t bytes = sp->frame.length - sp->scratch_len;
+
+    if (bytes > length) {
+        bytes = length;
+    }
+    memcpy(sp->scratch + sp->scratch_len, iobuffer_data(buf), bytes);
+    sp->scratch_len += bytes;
+    iobuffer_consume(buf, bytes);
+    if (sp->scratch_len < sp->frame.length) {
+        return 0;
+    }
+
+    sp->in_frame = false;
+    *frame = sp->frame;
+    if (frame_payload(frame, sp->scratch) < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Get the next frame, or piece of a DATA frame, from a buffer.
+ *
+ * Bytes are consumed from the buffer as frames are split from it, but
+ * the bytes of the view returned are consumed only at the next call,
+ * which must pass the same buffer.  Read more input into the buffer
+ * whenever this function returns 0; the buffer never needs to hold
+ * more than one frame, or one byte of a DATA payload.
+ *
+ * A DATA frame is returned in one or more pieces, all with the fields
+ * of its header; the last has last set.  A DATA frame with no payload
+ * is returned as one empty piece.  Every other frame is returned
+ * whole, with last set.
+ *
+ * Any error is a connection error, after which the connection must be
+ * closed.
+ *
+ * This function returns < 0 with errno set on error (EMSGSIZE for a
+ * frame larger than the maximum frame size, EPROTO for invalid
+ * padding, a payload too short for its fields, or a bad preface, or
+ * ENOMEM), 0 if more input is needed, or 1 with a frame.
+ *
+ * sp:    the connection's splitter
+ * buf:   the connection's input
+ * frame: set to the frame
+ */
+int h2_splitter_next(H2Splitter *sp, IOBuffer *buf, H2Frame *frame) {
+    size_t length;
+    int result;
+
+    iobuffer_consume(buf, sp->pending);
+    sp->pending = 0;
+
+    if (sp->preface) {
+        length = iobuffer_length(buf);
+        if (memcmp(iobuffer_data(buf), PREFACE,
+                   length < PREFACE_SIZE ? length : PREFACE_SIZE) != 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (length < PREFACE_SIZE) {
+            return 0;
+        }
+        iobuffer_consume(buf, PREFACE_SIZE);
+        sp->preface = false;
+    }
+
+    /* Go on while input is used without a frame being returned, as
+     * when a large frame is begun or DATA padding is skipped. */
+    do {
+        length = iobuffer_length(buf);
+        if (!sp->in_frame) {
+            result = next_frame(sp, buf, frame);
+        } else if (sp->frame.type == H2_DATA) {
+            result = next_data(sp, buf, frame);
+        } else {
+            result = next_assembled(sp, buf, frame);
+        }
+    } while (result == 0 && iobuffer_length(buf) < length);
+
+    return result;
+}
@@ -0,0 +1,67 @@
+/* agent <agent@local>
+ * Incremental HTTP/2 framing of IOBuffer contents.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in http2.c.
+ */
+
+#ifndef HTTP2_H_
+#define HTTP2_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "example.h"
+
+/* HTTP/2 frame types (RFC 7540 section 6) */
+typedef enum {
+    H2_DATA          = 0x0,
+    H2_HEADERS       = 0x1,
+    H2_PRIORITY      = 0x2,
+    H2_RST_STREAM    = 0x3,
+    H2_SETTINGS      = 0x4,
+    H2_PUSH_PROMISE  = 0x5,
+    H2_PING          = 0x6,
+    H2_GOAWAY        = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION  = 0x9,
+} H2FrameType;
+
+/* HTTP/2 frame flags.  These are bits, and their meaning depends on the
+ * frame type. */
+typedef enum {
+    H2_FLAG_END_STREAM  = 0x01,  /* DATA, HEADERS */
+    H2_FLAG_ACK         = 0x01,  /* SETTINGS, PING */
+    H2_FLAG_END_HEADERS = 0x04,  /* HEADERS, PUSH_PROMISE, CONTINUATION */
+    H2_FLAG_PADDED      = 0x08,  /* DATA, HEADERS, PUSH_PROMISE */
+    H2_FLAG_PRIORITY    = 0x20,  /* HEADERS */
+} H2FrameFlag;
+
+/* A frame, or for DATA a piece of one, returned by h2_splitter_next().
+ * data is a view into the IOBuffer or the splitter, valid until the
+ * next call for the same splitter. */
+typedef struct {
+    uint32_t length;     /* Payload length from the frame header */
+    uint8_t type;        /* H2FrameType, or an unknown type */
+    uint8_t flags;       /* H2FrameFlag bits */
+    uint32_t stream;     /* Stream identifier */
+    uint32_t promised;   /* Promised stream, for PUSH_PROMISE */
+    const char *data;    /* Payload, without padding or priority */
+    size_t size;         /* Bytes at data */
+    bool last;           /* data ends the payload */
+} H2Frame;
+
+/* Frame splitter for the input of one connection
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _H2Splitter H2Splitter;
+
+H2Splitter *h2_splitter_create(uint32_t max_frame_size, bool preface);
+
+void h2_splitter_destroy(H2Splitter *sp);
+
+int h2_splitter_next(H2Splitter *sp, IOBuffer *buf, H2Frame *frame);
+
+#endif /* HTTP2_H_ */
@@ -0,0 +1,207 @@
+# agent <agent@local>
+
+"""asyncio transport that reads framed messages through a C IOBuffer.
+
+The transport watches a socket with the event loop's add_reader(),
+fills an iobuffer.IOBuffer with the GIL released, and splits the data
+into 32-bit big-endian length-prefixed frames in C.  Each wakeup hands
+every complete frame to the protocol in one messages_received() call as
+a list of memoryviews into the buffer, so no bytes objects are created
+and the Python-level callback cost is paid once per batch rather than
+once per message.
+
+The memoryviews are valid only for the duration of the callback; a
+protocol that needs a message afterward must copy it, e.g. with
+bytes().  Frames larger than the IOBuffer cannot be received.
+"""
+
+import asyncio
+
+import iobuffer
+
+# Upper bound on buffer fills per event loop wakeup, so that one busy
+# connection cannot starve the others sharing the loop.
+MAX_FILLS_PER_WAKEUP = 16
+
+
+class BatchProtocol(asyncio.BaseProtocol):
+    """Protocol interface for IOBufferTransport.
+
+    Subclasses override messages_received() and, optionally,
+    eof_received().
+    """
+
+    def messages_received(self, messages):
+        """Called with a list of memoryviews, one per complete frame."""
+
+    def eof_received(self):
+        """Called when the peer closes its side of the connection."""
+
+
+class IOBufferTransport(asyncio.ReadTransport):
+    """Read transport delivering batches of framed messages.
+
+    Use create_framed_connection() rather than constructing this
+    directly.
+    """
+
+    def __init__(self, loop, sock, protocol, max_batch=None):
+        super().__init__()
+        self._loop = loop
+        self._sock = sock
+        self._fd = sock.fileno()
+        self._protocol = protocol
+        self._max_batch = max_batch
+        self._buffer = iobuffer.IOBuffer()
+        self._reading = False
+        self._closing = False
+        self._extra = {
+            'socket': sock,
+            'peername': _safe_call(sock.getpeername),
+            'sockname': _safe_call(sock.getsockname),
+        }
+
+    def get_extra_info(self, name, default=None):
+        return self._extra.get(name, default)
+
+    def is_closing(self):
+        return self._closing
+
+    def is_reading(self):
+        return self._reading
+
+    def pause_reading(self):
+        if self._reading and not self._closing:
+            self._loop.remove_reader(self._fd)
+            self._reading = False
+
+    def resume_reading(self):
+        if not self._reading and not self._closing:
+            self._loop.add_reader(self._fd, self._read_ready)
+            self._reading = True
+            # Frames left in the buffer when reading was paused would
+            # otherwise wait for more data to arrive.
+            if len(self._buffer) > 0:
+                self._loop.call_soon(self._deliver)
+
+    def set_protocol(self, protocol):
+        self._protocol = protocol
+
+    def get_protocol(self):
+        return self._protocol
+
+    def close(self):
+        if not self._closing:
+            self.pause_reading()
+            self._closing = True
+            self._loop.call_soon(self._call_connection_lost, None)
+
+    def abort(self):
+        self.close()
+
+    def _start(self):
+        self._loop.call_soon(self._protocol.connection_made, self)
+        self._loop.call_soon(self.resume_reading)
+
+    def _read_ready(self):
+        for _ in range(MAX_FILLS_PER_WAKEUP):
+            if not self._reading:
+                return
+            try:
+                count = self._buffer.fill(self._fd)
+            except BlockingIOError:
+                return
+            except (OSError, BufferError) as exc:
+                self._fatal_error(exc)
+                return
+            if not self._deliver():
+                return
+            if count == 0 and self._buffer.status() != iobuffer.FULL:
+                self._eof()
+                return
+
+    def _deliver(self):
+        """Pass complete frames in the buffer to the protocol.
+
+        Stops early if the protocol pauses reading.  Returns True if
+        reading may go on, and False if it was paused or a fatal error
+        closed the transport, including any exception raised by the
+        protocol.
+        """
+        while self._reading:
+            error = None
+            try:
+                if self._max_batch is None:
+                    messages, used = self._buffer.frames()
+                else:
+                    messages, used = self._buffer.frames(self._max_batch)
+            except (ValueError, BufferError) as exc:
+                self._fatal_error(exc)
+                return False
+            if not messages:
+                return True
+            try:
+                self._protocol.messages_received(messages)
+            except Exception as exc:
+                error = exc
+            # A BufferError here means the protocol kept a view of a
+            # message past the callback, so the data cannot be consumed.
+            for message in messages:
+                try:
+                    message.release()
+                except BufferError as exc:
+                    error = error or exc
+            try:
+                self._buffer.consume(used)
+            except BufferError as exc:
+                error = error or exc
+            if error is not None:
+                self._fatal_error(error)
+                return False
+        return False
+
+    def _eof(self):
+        self.pause_reading()
+        try:
+            keep_open = self._protocol.eof_received()
+        except Exception as exc:
+            self._fatal_error(exc)
+            return
+        if not keep_open:
+            self.close()
+
+    def _fatal_error(self, exc):
+        if not self._closing:
+            self.pause_reading()
+            self._closing = True
+            self._loop.call_soon(self._call_connection_lost, exc)
+
+    def _call_connection_lost(self, exc):
+        try:
+            self._protocol.connection_lost(exc)
+        finally:
+            self._sock.close()
+            self._sock = None
+            self._protocol = None
+
+
+async def create_framed_connection(protocol_factory, sock, max_batch=None):
+    """Wrap a connected socket in an IOBufferTransport.
+
+    Returns a (transport, protocol) pair, as loop.create_connection()
+    does.  max_batch limits the number of messages per callback.
+    """
+    loop = asyncio.get_running_loop()
+    sock.setblocking(False)
+    protocol = protocol_factory()
+    transport = IOBufferTransport(loop, sock, protocol, max_batch)
+    transport._start()
+    return transport, protocol
+
+
+def _safe_call(function):
+    """Return function(), or None if it raises OSError."""
+    try:
+        return function()
+    except OSError:
+        return None
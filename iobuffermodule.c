@@ -0,0 +1,422 @@
+/* agent <agent@local>
+ * CPython extension exposing IOBuffer to Python.
+ *
+ * The iobuffer module provides an IOBuffer type wrapping the functions
+ * in example.c.  Reads release the GIL, so Python threads reading
+ * different buffers proceed in parallel, and the unconsumed data is
+ * exported through the buffer protocol, so memoryview(buf) or
+ * numpy.frombuffer(buf) see it without a copy.
+ *
+ * As with bytearray, a buffer cannot be read into or consumed from
+ * while views of it exist, because either may move the data.
+ *
+ * Build as a shared object named iobuffer with example.c and epoch.c,
+ * e.g. with the include path from python3-config --includes.
+ */
+
+/* Python.h must be included before any system header. */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "example.h"
+
+/* Size of the big-endian length prefix on each frame returned by
+ * IOBuffer.frames(). */
+static const Py_ssize_t FRAME_HEADER_SIZE = 4;
+
+/* Python wrapper object for an IOBuffer */
+typedef struct {
+    PyObject_HEAD
+    IOBuffer *buf;
+    Py_ssize_t exports;  // live buffer protocol views
+    bool busy;           // a read is running with the GIL released
+} PyIOBuffer;
+
+/*
+ * Raises BufferError and returns false if a read of a given buffer is
+ * running with the GIL released, as the read may move the data.  Must
+ * be called with the GIL held.
+ */
+static bool pyiobuffer_idle(PyIOBuffer *self) {
+    if (self->busy) {
+        PyErr_SetString(PyExc_BufferError,
+                        "IOBuffer is being read by another thread");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Raises BufferError and returns false if the data in a given buffer
+ * cannot currently be moved or discarded.  Must be called with the GIL
+ * held.
+ */
+static bool pyiobuffer_mutable(PyIOBuffer *self) {
+    if (!pyiobuffer_idle(self)) {
+        return false;
+    }
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError,
+                        "Existing exports of data: IOBuffer cannot be "
+                        "modified");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Allocates a Python IOBuffer object and the IOBuffer behind it.  This
+ * is done here rather than in __init__ so that an object created by
+ * IOBuffer.__new__() alone is still usable.
+ */
+static PyObject *pyiobuffer_new(PyTypeObject *type, PyObject *args,
+                                PyObject *kwds) {
+    PyIOBuffer *self = (PyIOBuffer *)type->tp_alloc(type, 0);
+
+    if (self == NULL) {
+        return NULL;
+    }
+    self->buf = iobuffer_create();
+    if (self->buf == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    return (PyObject *)self;
+}
+
+/*
+ * Checks the arguments to IOBuffer(); there are none.
+ */
+static int pyiobuffer_init(PyIOBuffer *self, PyObject *args,
+                           PyObject *kwds) {
+    static char *kwlist[] = { NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Destroys the IOBuffer behind a Python IOBuffer object.
+ */
+static void pyiobuffer_dealloc(PyIOBuffer *self) {
+    iobuffer_destroy(self->buf);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/*
+ * IOBuffer.read(fd, nbytes) -> int
+ *
+ * Performs one iobuffer_read() with the GIL released.  Returns the
+ * number of bytes read, which is 0 at EOF or if the buffer is full.
+ */
+static PyObject *pyiobuffer_read(PyIOBuffer *self, PyObject *args) {
+    Py_ssize_t nbytes;
+    int result;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "in:read", &fd, &nbytes)) {
+        return NULL;
+    }
+    if (nbytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "nbytes must be non-negative");
+        return NULL;
+    }
+    if (!pyiobuffer_mutable(self)) {
+        return NULL;
+    }
+
+    self->busy = true;
+    Py_BEGIN_ALLOW_THREADS
+    result = iobuffer_read(self->buf, fd, nbytes);
+    Py_END_ALLOW_THREADS
+    self->busy = false;
+
+    if (result < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    return PyLong_FromLong(result);
+}
+
+/*
+ * IOBuffer.fill(fd) -> int
+ *
+ * Reads from fd with the GIL released until the buffer is full, EOF is
+ * reached, or the descriptor would block.  Returns the total number of
+ * bytes read, which is 0 only at EOF or if the buffer was already full.
+ * Errors, including BlockingIOError, are raised only if nothing was
+ * read.
+ */
+static PyObject *pyiobuffer_fill(PyIOBuffer *self, PyObject *args) {
+    long total = 0;
+    int saved_errno = 0;
+    int result;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "i:fill", &fd)) {
+        return NULL;
+    }
+    if (!pyiobuffer_mutable(self)) {
+        return NULL;
+    }
+
+    self->busy = true;
+    Py_BEGIN_ALLOW_THREADS
+    while (iobuffer_status(self->buf) != IOBUFFER_FULL) {
+        result = iobuffer_read(self->buf, fd, SIZE_MAX);
+        if (result < 0) {
+            saved_errno = errno;
+            break;
+        }
+        if (result == 0) {
+            break;
+        }
+        total += result;
+    }
+    Py_END_ALLOW_THREADS
+    self->busy = false;
+
+    if (total == 0 && saved_errno != 0) {
+        errno = saved_errno;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    return PyLong_FromLong(total);
+}
+
+/*
+ * IOBuffer.consume(nbytes)
+ *
+ * Discards nbytes from the front of the buffer.
+ */
+static PyObject *pyiobuffer_consume(PyIOBuffer *self, PyObject *args) {
+    Py_ssize_t nbytes;
+
+    if (!PyArg_ParseTuple(args, "n:consume", &nbytes)) {
+        return NULL;
+    }
+    if (nbytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "nbytes must be non-negative");
+        return NULL;
+    }
+    if (!pyiobuffer_mutable(self)) {
+        return NULL;
+    }
+    iobuffer_consume(self->buf, nbytes);
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * IOBuffer.status() -> int
+ *
+ * Returns one of the module constants EMPTY, LOW, DATA, HIGH, or FULL.
+ */
+static PyObject *pyiobuffer_status(PyIOBuffer *self,
+                                   PyObject *Py_UNUSED(ignored)) {
+    if (!pyiobuffer_idle(self)) {
+        return NULL;
+    }
+
+    return PyLong_FromLong(iobuffer_status(self->buf));
+}
+
+/*
+ * IOBuffer.frames(max_frames) -> (list, int)
+ *
+ * Splits the unconsumed data into complete frames, each a 32-bit
+ * big-endian length followed by that many bytes.  Returns a list of
+ * memoryviews of up to max_frames frame bodies, without their headers,
+ * and the number of bytes they span.  Nothing is consumed; the caller
+ * releases the views and then consumes that many bytes.
+ *
+ * Raises ValueError if any frames were asked for, the buffer is full
+ * and its first frame is still incomplete, as that frame can never fit.
+ */
+static PyObject *pyiobuffer_frames(PyIOBuffer *self, PyObject *args) {
+    Py_ssize_t max_frames = PY_SSIZE_T_MAX;
+    const unsigned char *data;
+    PyObject *base = NULL;  // view of all data, sliced per frame
+    PyObject *frames;
+    PyObject *frame;
+    Py_ssize_t offset = 0;
+    Py_ssize_t length;
+    Py_ssize_t framelen;
+
+    if (!PyArg_ParseTuple(args, "|n:frames", &max_frames)
+        || !pyiobuffer_idle(self)) {
+        return NULL;
+    }
+    frames = PyList_New(0);
+    if (frames == NULL) {
+        return NULL;
+    }
+    data = (const unsigned char *)iobuffer_data(self->buf);
+    length = iobuffer_length(self->buf);
+
+    while (PyList_GET_SIZE(frames) < max_frames
+           && length - offset >= FRAME_HEADER_SIZE) {
+        framelen = (Py_ssize_t)data[offset] << 24 | data[offset + 1] << 16
+                   | data[offset + 2] << 8 | data[offset + 3];
+        if (length - offset - FRAME_HEADER_SIZE < framelen) {
+            break;
+        }
+        if (base == NULL) {
+            base = PyMemoryView_FromObject((PyObject *)self);
+            if (base == NULL) {
+                goto error;
+            }
+        }
+        offset += FRAME_HEADER_SIZE;
+        frame = PySequence_GetSlice(base, offset, offset + framelen);
+        if (frame == NULL || PyList_Append(frames, frame) < 0) {
+            Py_XDECREF(frame);
+            goto error;
+        }
+        Py_DECREF(frame);
+        offset += framelen;
+    }
+
+    if (offset == 0 && max_frames > 0
+        && iobuffer_status(self->buf) == IOBUFFER_FULL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "frame is larger than the IOBuffer");
+        goto error;
+    }
+    Py_XDECREF(base);
+
+    return Py_BuildValue("(Nn)", frames, offset);
+
+error:
+    Py_XDECREF(base);
+    Py_DECREF(frames);
+    return NULL;
+}
+
+/*
+ * len(IOBuffer) is the number of unconsumed bytes.
+ */
+static Py_ssize_t pyiobuffer_len(PyIOBuffer *self) {
+    if (!pyiobuffer_idle(self)) {
+        return -1;
+    }
+
+    return iobuffer_length(self->buf);
+}
+
+/*
+ * Exports the unconsumed data as a writable, one-dimensional byte
+ * buffer.  No data is copied.
+ */
+static int pyiobuffer_getbuffer(PyIOBuffer *self, Py_buffer *view,
+                                int flags) {
+    if (!pyiobuffer_idle(self)) {
+        view->obj = NULL;
+        return -1;
+    }
+    if (PyBuffer_FillInfo(view, (PyObject *)self, iobuffer_data(self->buf),
+                          iobuffer_length(self->buf), 0, flags) < 0) {
+        return -1;
+    }
+    self->exports++;
+
+    return 0;
+}
+
+/*
+ * Releases a view obtained from pyiobuffer_getbuffer().
+ */
+static void pyiobuffer_releasebuffer(PyIOBuffer *self, Py_buffer *view) {
+    self->exports--;
+}
+
+static PyMethodDef pyiobuffer_methods[] = {
+    { "read", (PyCFunction)pyiobuffer_read, METH_VARARGS,
+      "read(fd, nbytes) -> int\n\n"
+      "Read up to nbytes from fd into the buffer, releasing the GIL." },
+    { "fill", (PyCFunction)pyiobuffer_fill, METH_VARARGS,
+      "fill(fd) -> int\n\n"
+      "Read from fd until the buffer is full, EOF, or it would block." },
+    { "consume", (PyCFunction)pyiobuffer_consume, METH_VARARGS,
+      "consume(nbytes)\n\n"
+      "Discard nbytes from the front of the buffer." },
+    { "frames", (PyCFunction)pyiobuffer_frames, METH_VARARGS,
+      "frames([max_frames]) -> (list, int)\n\n"
+      "Return views of complete length-prefixed frames and their span." },
+    { "status", (PyCFunction)pyiobuffer_status, METH_NOARGS,
+      "status() -> int\n\n"
+      "Return EMPTY, LOW, DATA, HIGH, or FULL." },
+    { NULL, NULL, 0, NULL },
+};
+
+static PySequenceMethods pyiobuffer_as_sequence = {
+    .sq_length = (lenfunc)pyiobuffer_len,
+};
+
+static PyBufferProcs pyiobuffer_as_buffer = {
+    .bf_getbuffer = (getbufferproc)pyiobuffer_getbuffer,
+    .bf_releasebuffer = (releasebufferproc)pyiobuffer_releasebuffer,
+};
+
+static PyTypeObject PyIOBufferType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "iobuffer.IOBuffer",
+    .tp_doc = "I/O buffer whose unconsumed data supports the buffer "
+              "protocol.",
+    .tp_basicsize = sizeof(PyIOBuffer),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = pyiobuffer_new,
+    .tp_init = (initproc)pyiobuffer_init,
+    .tp_dealloc = (destructor)pyiobuffer_dealloc,
+    .tp_methods = pyiobuffer_methods,
+    .tp_as_sequence = &pyiobuffer_as_sequence,
+    .tp_as_buffer = &pyiobuffer_as_buffer,
+};
+
+static struct PyModuleDef iobuffer_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "iobuffer",
+    .m_doc = "Zero-copy I/O buffers backed by the C IOBuffer.",
+    .m_size = -1,
+};
+
+/*
+ * Module initialization; registers the IOBuffer type and the status
+ * constants.
+ */
+PyMODINIT_FUNC PyInit_iobuffer(void) {
+    PyObject *module;
+
+    if (PyType_Ready(&PyIOBufferType) < 0) {
+        return NULL;
+    }
+    module = PyModule_Create(&iobuffer_module);
+    if (module == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(&PyIOBufferType);
+    if (PyModule_AddObject(module, "IOBuffer",
+                           (PyObject *)&PyIOBufferType) < 0
+        || PyModule_AddIntConstant(module, "EMPTY", IOBUFFER_EMPTY) < 0
+        || PyModule_AddIntConstant(module, "DATA", IOBUFFER_DATA) < 0
+        || PyModule_AddIntConstant(module, "FULL", IOBUFFER_FULL) < 0
+        || PyModule_AddIntConstant(module, "LOW", IOBUFFER_LOW) < 0
+        || PyModule_AddIntConstant(module, "HIGH", IOBUFFER_HIGH) < 0) {
+        Py_DECREF(&PyIOBufferType);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    return module;
+}
@@ -0,0 +1,328 @@
+/* agent <agent@local>
+ * Thread-pool offload of blocking file reads into IOBuffers.
+ *
+ * Regular files are always "readable" to epoll, so an iobuffer_read()
+ * on a slow disk stalls the event loop for the full device latency.
+ * An IOPool instead runs iobuffer_pread() on a few worker threads.  The
+ * loop submits a read and carries on; when reads finish, the pool's
+ * eventfd becomes readable, and the loop collects them with
+ * iopool_complete().  The loop thread never blocks on the disk, so its
+ * latency does not depend on the disk's.
+ *
+ * Reads are limited per device (st_dev), so that one slow device cannot
+ * occupy every worker while reads from faster devices wait.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "iopool.h"
+
+/* A read waiting for or running on a worker */
+typedef struct IOJob {
+    struct IOJob *next;
+    IOCompletion done;
+    int fd;
+    size_t bytes;
+    off_t offset;
+    dev_t dev;
+} IOJob;
+
+/* Reads in flight on one device */
+typedef struct {
+    dev_t dev;
+    int inflight;
+} DeviceLoad;
+
+/* Pool of read threads */
+struct _IOPool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;      // signaled when a job may be runnable
+    IOJob *queue;             // submitted jobs, oldest first
+    IOJob *queue_tail;
+    IOJob *finished;          // completed jobs, oldest first
+    IOJob *finished_tail;
+    DeviceLoad *devices;
+    int ndevices;
+    int device_limit;
+    bool stopping;
+    int efd;
+    int nthreads;
+    pthread_t *threads;
+};
+
+/*
+ * Returns the load entry for a device, adding one if necessary, or NULL
+ * if memory is exhausted.  Called with the pool locked.
+ */
+static DeviceLoad *device_load(IOPool *pool, dev_t dev) {
+    DeviceLoad *devices;
+
+    for (int i = 0; i < pool->ndevices; i++) {
+        if (pool->devices[i].dev == dev) {
+            return &pool->devices[i];
+        }
+    }
+    devices = realloc(pool->devices,
+                      (pool->ndevices + 1) * sizeof(DeviceLoad));
+    if (devices == NULL) {
+        return NULL;
+    }
+    pool->devices = devices;
+    devices[pool->ndevices].dev = dev;
+    devices[pool->ndevices].inflight = 0;
+
+    return &devices[pool->ndevices++];
+}
+
+/*
+ * Removes and returns the oldest queued job whose device is below its
+ * limit, or NULL if there is none.  Called with the pool locked.
+ */
+static IOJob *next_job(IOPool *pool) {
+    IOJob **link;
+    IOJob *prev = NULL;
+    IOJob *job;
+
+    for (link = &pool->queue; *link != NULL; link = &(*link)->next) {
+        job = *link;
+        if (device_load(pool, job->dev)->inflight < pool->device_limit) {
+            *link = job->next;
+            if (pool->queue_tail == job) {
+                pool->queue_tail = prev;
+            }
+            return job;
+        }
+        prev = job;
+    }
+
+    return NULL;
+}
+
+/*
+ * Worker thread: runs jobs until the pool is destroyed.
+ */
+static void *iopool_thread(void *arg) {
+    IOPool *pool = arg;
+    uint64_t one = 1;
+    IOJob *job;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && (job = next_job(pool)) == NULL) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        device_load(pool, job->dev)->inflight++;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->done.result = iobuffer_pread(job->done.buf, job->fd,
+                                          job->bytes, job->offset);
+        job->done.error = job->done.result < 0 ? errno : 0;
+
+        pthread_mutex_lock(&pool->lock);
+        device_load(pool, job->dev)->inflight--;
+        job->next = NULL;
+        if (pool->finished_tail != NULL) {
+            pool->finished_tail->next = job;
+        } else {
+            pool->finished = job;
+        }
+        pool->finished_tail = job;
+        /* A job for this device may have been waiting on the limit. */
+        pthread_cond_signal(&pool->work);
+        if (write(pool->efd, &one, sizeof(one)) < 0) {
+            /* The counter cannot overflow in practice; nothing to do. */
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/* Create a pool of read threads.
+ *
+ * This function returns NULL on error.
+ *
+ * nthreads:     the number of worker threads
+ * device_limit: the most reads in flight on any one device
+ */
+IOPool *iopool_create(int nthreads, int device_limit) {
+    IOPool *pool = calloc(1, sizeof(IOPool));
+
+    if (pool == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pool->device_limit = device_limit > 0 ? device_limit : 1;
+    pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if (pool->efd < 0 || pool->threads == NULL) {
+        iopool_destroy(pool);
+        return NULL;
+    }
+    for (; pool->nthreads < nthreads; pool->nthreads++) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL,
+                           iopool_thread, pool) != 0) {
+            iopool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+/*
+ * Stops the worker threads, waiting for reads in progress, and frees a
+ * pool.  Queued and uncollected reads are discarded; their buffers
+ * remain the caller's.
+ */
+void iopool_destroy(IOPool *pool) {
+    IOJob *job;
+
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    while (pool->queue != NULL) {
+        job = pool->queue;
+        pool->queue = job->next;
+        free(job);
+    }
+    while (pool->finished != NULL) {
+        job = pool->finished;
+        pool->finished = job->next;
+        free(job);
+    }
+    if (pool->efd >= 0) {
+        close(pool->efd);
+    }
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->devices);
+    free(pool->threads);
+    free(pool);
+}
+
+/*
+ * Returns the eventfd that becomes readable when reads have completed.
+ * The event loop registers it for reading and calls iopool_complete()
+ * when it is ready.
+ */
+int iopool_eventfd(IOPool *pool) {
+    return pool->efd;
+}
+
+/* Submit a read to the pool.
+ *
+ * The buffer belongs to the pool until the read is returned by
+ * iopool_complete(); the caller must not touch it in the meantime.
+ *
+ * This function returns < 0 on error, or 0 if the read was queued.
+ *
+ * pool:   the pool
+ * buf:    the buffer to read into
+ * fd:     the file to read
+ * bytes:  the number of bytes to read
+ * offset: the file offset at which to read
+ * tag:    caller data returned with the completion
+ */
+int iopool_submit(IOPool *pool, IOBuffer *buf, int fd, size_t bytes,
+                  off_t offset, void *tag) {
+    struct stat st;
+    IOJob *job;
+
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    job = malloc(sizeof(IOJob));
+    if (job == NULL) {
+        return -1;
+    }
+    job->next = NULL;
+    job->done.buf = buf;
+    job->done.tag = tag;
+    job->done.result = 0;
+    job->done.error = 0;
+    job->fd = fd;
+    job->bytes = bytes;
+    job->offset = offset;
+    job->dev = st.st_dev;
+
+    pthread_mutex_lock(&pool->lock);
+    if (device_load(pool, job->dev) == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        free(job);
+        return -1;
+    }
+    if (pool->queue_tail != NULL) {
+        pool->queue_tail->next = job;
+    } else {
+        pool->queue = job;
+    }
+    pool->queue_tail = job;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/* Collect completed reads.
+ *
+ * Completions are returned in the order the reads finished, which need
+ * not be the order they were submitted; a read on a fast device is not
+ * held up behind one on a slow device.  Use each completion's tag to
+ * match it to its request.
+ *
+ * This function returns < 0 with errno set if the eventfd cannot be
+ * read, or the number of completions stored, at most max.  If more
+ * remain, the eventfd is left readable.
+ *
+ * pool:        the pool
+ * completions: array receiving the completions
+ * max:         size of completions
+ */
+int iopool_complete(IOPool *pool, IOCompletion *completions, int max) {
+    uint64_t count;
+    IOJob *job;
+    int n = 0;
+
+    if (read(pool->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (n < max && pool->finished != NULL) {
+        job = pool->finished;
+        pool->finished = job->next;
+        completions[n++] = job->done;
+        free(job);
+    }
+    if (pool->finished == NULL) {
+        pool->finished_tail = NULL;
+    }
+    if (pool->finished != NULL) {
+        count = 1;
+        if (write(pool->efd, &count, sizeof(count)) < 0) {
+            /* As in iopool_thread(). */
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return n;
+}
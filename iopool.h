@@ -0,0 +1,41 @@
+/* agent <agent@local>
+ * Thread-pool offload of blocking file reads into IOBuffers.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in iopool.c.
+ */
+
+#ifndef IOPOOL_H_
+#define IOPOOL_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "example.h"
+
+/* A finished read, returned by iopool_complete() */
+typedef struct {
+    IOBuffer *buf;   /* The buffer read into */
+    void *tag;       /* The caller's tag from iopool_submit() */
+    int result;      /* As from iobuffer_pread() */
+    int error;       /* errno if result < 0, otherwise 0 */
+} IOCompletion;
+
+/* Pool of threads performing file reads for an event loop
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _IOPool IOPool;
+
+IOPool *iopool_create(int nthreads, int device_limit);
+
+void iopool_destroy(IOPool *pool);
+
+int iopool_eventfd(IOPool *pool);
+
+int iopool_submit(IOPool *pool, IOBuffer *buf, int fd, size_t bytes,
+                  off_t offset, void *tag);
+
+int iopool_complete(IOPool *pool, IOCompletion *completions, int max);
+
+#endif /* IOPOOL_H_ */
@@ -0,0 +1,626 @@
+/* agent <agent@local>
+ * io_uring reads into IOBuffers without system calls.
+ *
+ * Each iobuffer_read() is a read() system call, and the kernel looks up
+ * the descriptor and pins the destination memory every time.  An
+ * IORing instead queues reads on an io_uring whose submission queue is
+ * polled by a kernel thread (SQPOLL).  The files and IOBuffer storage
+ * blocks it reads into are registered with the ring once, in slots,
+ * so each read names a fixed file and a fixed buffer and the kernel
+ * does no per-read lookup or pinning.  While the kernel thread is
+ * awake, submitting a read is a store to the submission ring and
+ * collecting it is a load from the completion ring; our threads make
+ * no system calls at all.  The kernel thread sleeps after
+ * IORING_SQ_IDLE_MS without work, and the next submission wakes it.
+ *
+ * Creating an SQPOLL ring may need privilege on older kernels; the
+ * ring then falls back to submitting with io_uring_enter().
+ *
+ * The ring is used through the raw system calls and <linux/io_uring.h>,
+ * with the memory ordering that the kernel documents for the shared
+ * rings.  An IORing belongs to one thread.
+ */
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "ioring.h"
+
+/* Milliseconds the kernel polling thread spins without work before it
+ * sleeps.  Long enough to cover the gaps of a busy event loop, short
+ * enough that an idle process does not hold a CPU. */
+static const unsigned int IORING_SQ_IDLE_MS = 100;
+
+/* user_data of the cancel request queued by ioring_destroy(); reads use
+ * their slot number. */
+static const uint64_t IORING_CANCEL_TAG = UINT64_MAX;
+
+/* One registered file and buffer.  Slot i is file i and buffer i. */
+typedef struct {
+    IOBuffer *buf;      // or NULL if the slot is free
+    char *storage;      // storage block registered as buffer i
+    void *tag;          // tag of the read in flight
+    bool busy;          // a read is in flight
+} RingSlot;
+
+/* io_uring instance */
+struct _IORing {
+    int fd;
+    bool sqpoll;
+    unsigned int entries;     // submission queue entries
+    unsigned int inflight;    // reads queued and not yet collected
+    unsigned int pending;     // entries queued and not yet submitted
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;             // the same as sq_map with a single mmap
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_flags;
+    unsigned int sq_mask;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    int nslots;
+    RingSlot *slots;
+};
+
+/*
+ * System call wrappers; the C library does not provide them.
+ */
+static int ring_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, unsigned int submit, unsigned int min,
+                      unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, min, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned int opcode, const void *arg,
+                         unsigned int nargs) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/*
+ * Maps the rings of a ring set up with parameters p.  Returns < 0 with
+ * errno set on failure.
+ */
+static int ring_map(IORing *ring, struct io_uring_params *p) {
+    char *sq;
+    char *cq;
+
+    ring->sq_map_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring->cq_map_size = p->cq_off.cqes
+                        + p->cq_entries * sizeof(struct io_uring_cqe);
+    if ((p->features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = 0;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        return -1;
+    }
+    if (ring->cq_map_size == 0) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            return -1;
+        }
+    }
+    ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    sq = ring->sq_map;
+    cq = ring->cq_map;
+    ring->entries = p->sq_entries;
+    ring->sq_head = (unsigned int *)(sq + p->sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+    ring->sq_flags = (unsigned int *)(sq + p->sq_off.flags);
+    ring->sq_mask = *(unsigned int *)(sq + p->sq_off.ring_mask);
+    ring->cq_head = (unsigned int *)(cq + p->cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p->cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+    /* Submission entry i always goes in array slot i. */
+    for (unsigned int i = 0; i < p->sq_entries; i++) {
+        ((unsigned int *)(sq + p->sq_off.array))[i] = i;
+    }
+
+    return 0;
+}
+
+/*
+ * Registers empty file and buffer tables of ring->nslots entries.
+ * Returns < 0 with errno set on failure.
+ */
+static int ring_register_tables(IORing *ring) {
+    struct io_uring_rsrc_register reg;
+    int *fds;
+    int result;
+
+    fds = malloc(ring->nslots * sizeof(int));
+    if (fds == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < ring->nslots; i++) {
+        fds[i] = -1;
+    }
+    result = ring_register(ring->fd, IORING_REGISTER_FILES, fds,
+                           ring->nslots);
+    free(fds);
+    if (result < 0) {
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = ring->nslots;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+    return ring_register(ring->fd, IORING_REGISTER_BUFFERS2, &reg,
+                         sizeof(reg));
+}
+
+/*
+ * Registers storage as buffer slot, or clears the slot if storage is
+ * NULL.  Returns < 0 with errno set on failure.
+ */
+static int ring_register_buffer(IORing *ring, int slot, char *storage,
+                                size_t size) {
+    struct io_uring_rsrc_update2 update;
+    struct iovec iov;
+
+    iov.iov_base = storage;
+    iov.iov_len = storage != NULL ? size : 0;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.data = (uintptr_t)&iov;
+    update.nr = 1;
+
+    if (ring_register(ring->fd, IORING_REGISTER_BUFFERS_UPDATE, &update,
+                      sizeof(update)) < 0) {
+        return -1;
+    }
+    ring->slots[slot].storage = storage;
+
+    return 0;
+}
+
+/*
+ * Registers fd as file slot; -1 clears it.  Returns < 0 with errno set
+ * on failure.
+ */
+static int ring_register_file(IORing *ring, int slot, int fd) {
+    struct io_uring_files_update update;
+
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (uintptr_t)&fd;
+
+    return ring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update,
+                         1) < 0 ? -1 : 0;
+}
+
+/*
+ * Hands queued entries to the kernel, and waits for min completions if
+ * min is not 0.  A polling kernel thread is woken if it sleeps;
+ * otherwise every entry not yet submitted is submitted with
+ * io_uring_enter().  Returns < 0 with errno set on failure, when the
+ * entries not submitted stay queued.
+ */
+static int ring_submit(IORing *ring, unsigned int min) {
+    unsigned int flags = min > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int n;
+
+    if (ring->sqpoll) {
+        /* The tail store must be visible before the flag is read, or
+         * the kernel thread could go to sleep without seeing it. */
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((atomic_load_explicit((_Atomic unsigned int *)ring->sq_flags,
+                                  memory_order_relaxed)
+             & IORING_SQ_NEED_WAKEUP) != 0) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+    } else if (ring->pending > 0) {
+        n = ring_enter(ring->fd, ring->pending, min, flags);
+        if (n < 0) {
+            return -1;
+        }
+        ring->pending -= n;
+        return 0;
+    }
+    if (flags == 0) {
+        return 0;
+    }
+
+    return ring_enter(ring->fd, 0, min, flags) < 0 ? -1 : 0;
+}
+
+/*
+ * Cancels every read in flight and collects their completions, so that
+ * the kernel is done with the registered buffers.  The completions are
+ * discarded without touching the buffers.
+ */
+static void ring_cancel(IORing *ring) {
+    _Atomic unsigned int *sq_head = (_Atomic unsigned int *)ring->sq_head;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned int tail;
+    unsigned int head;
+
+    /* Submit what is queued first, to make room for the request. */
+    if (ring_submit(ring, 0) < 0) {
+        return;
+    }
+    tail = *ring->sq_tail;
+    if (ring->sqpoll && tail - atomic_load(sq_head) == ring->entries) {
+        ring_enter(ring->fd, 0, 0, IORING_ENTER_SQ_WAIT);
+    }
+    if (tail - atomic_load(sq_head) < ring->entries) {
+        sqe = &ring->sqes[tail & ring->sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = IORING_CANCEL_TAG;
+        atomic_store_explicit((_Atomic unsigned int *)ring->sq_tail,
+                              tail + 1, memory_order_release);
+        if (!ring->sqpoll) {
+            ring->pending++;
+        }
+    }
+
+    while (ring->inflight > 0) {
+        if (ring_submit(ring, 1) < 0 && errno != EINTR) {
+            return;
+        }
+        head = *ring->cq_head;
+        tail = atomic_load_explicit((_Atomic unsigned int *)ring->cq_tail,
+                                    memory_order_acquire);
+        while (head != tail) {
+            cqe = &ring->cqes[head & ring->cq_mask];
+            if (cqe->user_data != IORING_CANCEL_TAG) {
+                ring->slots[cqe->user_data].busy = false;
+                ring->inflight--;
+            }
+            head++;
+        }
+        atomic_store_explicit((_Atomic unsigned int *)ring->cq_head, head,
+                              memory_order_release);
+    }
+}
+
+/* Create an io_uring for reads into IOBuffers.
+ *
+ * A kernel polling thread is requested for the submission queue.  If
+ * the kernel refuses it, the ring submits with a system call instead;
+ * ioring_sqpoll() tells which.
+ *
+ * This function returns NULL with errno set on error.  Registered
+ * buffer slots need Linux 5.19 or later.
+ *
+ * entries: the most reads in flight at once
+ * slots:   the most files attached at once
+ */
+IORing *ioring_create(unsigned int entries, int slots) {
+    struct io_uring_params p;
+    IORing *ring;
+    int saved;
+
+    if (entries == 0 || slots <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ring = calloc(1, sizeof(IORing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->nslots = slots;
+    ring->slots = calloc(slots, sizeof(RingSlot));
+    if (ring->slots == NULL) {
+        free(ring);
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = IORING_SQ_IDLE_MS;
+    ring->fd = ring_setup(entries, &p);
+    ring->sqpoll = ring->fd >= 0;
+    if (ring->fd < 0 && (errno == EPERM || errno == EINVAL)) {
+        memset(&p, 0, sizeof(p));
+        ring->fd = ring_setup(entries, &p);
+    }
+    if (ring->fd < 0 || ring_map(ring, &p) < 0
+        || ring_register_tables(ring) < 0) {
+        saved = errno;
+        ioring_destroy(ring);
+        errno = saved;
+        return NULL;
+    }
+
+    return ring;
+}
+
+/*
+ * Frees a ring.  Reads still in flight are cancelled, and their
+ * completions collected, before the ring is closed; their buffers
+ * remain the caller's, but their contents are undefined.  Destroying a
+ * ring with reads in flight therefore blocks until the kernel has let
+ * go of them.
+ */
+void ioring_destroy(IORing *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->inflight > 0) {
+        ring_cancel(ring);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->slots);
+    free(ring);
+}
+
+/*
+ * Returns true if a kernel thread polls the ring, so that submitting a
+ * read is normally free of system calls.
+ */
+bool ioring_sqpoll(IORing *ring) {
+    return ring->sqpoll;
+}
+
+/* Attach a buffer and the file it reads from to a ring.
+ *
+ * The file and the buffer's storage block are registered in a free
+ * slot, whose number is passed to ioring_read().  The buffer moves to
+ * pool storage if it is using inline storage.  Registration is a
+ * system call, and is meant to be done once per connection or file.
+ *
+ * This function returns < 0 with errno set on error (EBUSY if every
+ * slot is in use), or the slot number.
+ *
+ * ring: the ring
+ * buf:  the buffer to read into
+ * fd:   the file to read from
+ */
+int ioring_attach(IORing *ring, IOBuffer *buf, int fd) {
+    char *storage;
+    size_t size;
+    int slot;
+
+    for (slot = 0; slot < ring->nslots; slot++) {
+        if (ring->slots[slot].buf == NULL) {
+            break;
+        }
+    }
+    if (slot == ring->nslots) {
+        errno = EBUSY;
+        return -1;
+    }
+    storage = iobuffer_storage(buf, &size);
+    if (storage == NULL || ring_register_file(ring, slot, fd) < 0) {
+        return -1;
+    }
+    if (ring_register_buffer(ring, slot, storage, size) < 0) {
+        ring_register_file(ring, slot, -1);
+        return -1;
+    }
+    ring->slots[slot].buf = buf;
+    ring->slots[slot].busy = false;
+
+    return slot;
+}
+
+/* Detach a slot's buffer and file from a ring.
+ *
+ * The file is not closed.  This function returns < 0 with errno set to
+ * EBUSY if a read is in flight, or 0 on success.
+ *
+ * ring: the ring
+ * slot: a slot returned by ioring_attach()
+ */
+int ioring_detach(IORing *ring, int slot) {
+    RingSlot *s = &ring->slots[slot];
+
+    if (s->busy) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (ring_register_file(ring, slot, -1) < 0
+        || ring_register_buffer(ring, slot, NULL, 0) < 0) {
+        return -1;
+    }
+    s->buf = NULL;
+
+    return 0;
+}
+
+/* Queue a read into the buffer of a slot.
+ *
+ * Data is read into the free space at the end of the buffer, as with
+ * iobuffer_pread(), and added to the buffer by ioring_complete().  One
+ * read may be in flight per slot; the buffer belongs to the ring until
+ * that read is returned by ioring_complete(), and the caller must not
+ * touch it in the meantime.
+ *
+ * If the buffer's storage was replaced since it was registered (see
+ * iobuffer_storage()), the new block is registered first, which costs
+ * a system call.  Otherwise, with a polling kernel thread, no system
+ * call is made unless the thread has gone to sleep.
+ *
+ * This function returns < 0 with errno set on error (EBUSY if the slot
+ * or the ring is busy), 0 if the buffer is full, or the number of bytes
+ * requested.
+ *
+ * ring:   the ring
+ * slot:   a slot returned by ioring_attach()
+ * bytes:  the number of bytes to read
+ * offset: the file offset at which to read, or -1 to read at the
+ *         file position (for pipes and sockets)
+ * tag:    caller data returned with the completion
+ */
+int ioring_read(IORing *ring, int slot, size_t bytes, off_t offset,
+                void *tag) {
+    RingSlot *s = &ring->slots[slot];
+    struct io_uring_sqe *sqe;
+    unsigned int tail;
+    char *storage;
+    size_t size;
+    size_t avail;
+    char *dst;
+
+    if (s->busy || ring->inflight == ring->entries) {
+        errno = EBUSY;
+        return -1;
+    }
+    storage = iobuffer_storage(s->buf, &size);
+    if (storage == NULL) {
+        return -1;
+    }
+    if (storage != s->storage
+        && ring_register_buffer(ring, slot, storage, size) < 0) {
+        return -1;
+    }
+    if (bytes > size - iobuffer_length(s->buf)) {
+        bytes = size - iobuffer_length(s->buf);
+    }
+    if (bytes == 0) {
+        return 0;
+    }
+    dst = iobuffer_reserve(s->buf, bytes, &avail);
+    if (dst == NULL) {
+        return -1;
+    }
+
+    /* Only this thread writes the tail, so a plain load suffices. */
+    tail = *ring->sq_tail;
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = slot;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)dst;
+    sqe->len = bytes;
+    sqe->buf_index = slot;
+    sqe->user_data = slot;
+    atomic_store_explicit((_Atomic unsigned int *)ring->sq_tail, tail + 1,
+                          memory_order_release);
+    if (!ring->sqpoll) {
+        ring->pending++;
+    }
+
+    /* Without a polling thread, this submits every entry a failed
+     * submission left queued along with this one.  If the kernel is
+     * only short of resources, the entries stay queued for the next
+     * submission; otherwise this one is taken back.  A polling thread
+     * takes the entry by itself, so a failed wakeup loses nothing. */
+    if (ring_submit(ring, 0) < 0 && !ring->sqpoll && errno != EAGAIN
+        && errno != EBUSY && errno != EINTR) {
+        atomic_store_explicit((_Atomic unsigned int *)ring->sq_tail, tail,
+                              memory_order_release);
+        ring->pending--;
+        return -1;
+    }
+
+    s->busy = true;
+    s->tag = tag;
+    ring->inflight++;
+
+    return bytes;
+}
+
+/* Collect completed reads.
+ *
+ * Each completed read is added to its buffer, which then belongs to the
+ * caller again.  This function only reads the completion ring, and
+ * never makes a system call.
+ *
+ * This function returns the number of completions stored, at most max.
+ * The result and error of each are as for iopool_complete().
+ *
+ * ring:        the ring
+ * completions: array receiving the completions
+ * max:         size of completions
+ */
+int ioring_complete(IORing *ring, IOCompletion *completions, int max) {
+    unsigned int head = *ring->cq_head;
+    unsigned int tail;
+    struct io_uring_cqe *cqe;
+    RingSlot *s;
+    int n = 0;
+
+    tail = atomic_load_explicit((_Atomic unsigned int *)ring->cq_tail,
+                                memory_order_acquire);
+    while (n < max && head != tail) {
+        cqe = &ring->cqes[head & ring->cq_mask];
+        s = &ring->slots[cqe->user_data];
+        if (cqe->res > 0) {
+            iobuffer_commit(s->buf, cqe->res);
+        }
+        completions[n].buf = s->buf;
+        completions[n].tag = s->tag;
+        completions[n].result = cqe->res < 0 ? -1 : cqe->res;
+        completions[n].error = cqe->res < 0 ? -cqe->res : 0;
+        s->busy = false;
+        ring->inflight--;
+        head++;
+        n++;
+    }
+    atomic_store_explicit((_Atomic unsigned int *)ring->cq_head, head,
+                          memory_order_release);
+
+    return n;
+}
+
+/*
+ * Submits any reads still queued and blocks until at least min reads
+ * have completed and can be collected with ioring_complete().  This is
+ * the one system call an idle thread makes.  Returns < 0 with errno set
+ * on error.
+ */
+int ioring_wait(IORing *ring, unsigned int min) {
+    if (min > ring->inflight) {
+        min = ring->inflight;
+    }
+
+    return ring_submit(ring, min);
+}
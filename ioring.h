@@ -0,0 +1,41 @@
+/* agent <agent@local>
+ * io_uring reads into IOBuffers without system calls.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in ioring.c.
+ */
+
+#ifndef IORING_H_
+#define IORING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "example.h"
+#include "iopool.h"
+
+/* io_uring instance with registered files and IOBuffer storage
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _IORing IORing;
+
+IORing *ioring_create(unsigned int entries, int slots);
+
+void ioring_destroy(IORing *ring);
+
+bool ioring_sqpoll(IORing *ring);
+
+int ioring_attach(IORing *ring, IOBuffer *buf, int fd);
+
+int ioring_detach(IORing *ring, int slot);
+
+int ioring_read(IORing *ring, int slot, size_t bytes, off_t offset,
+                void *tag);
+
+int ioring_complete(IORing *ring, IOCompletion *completions, int max);
+
+int ioring_wait(IORing *ring, unsigned int min);
+
+#endif /* IORING_H_ */
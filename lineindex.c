@@ -0,0 +1,529 @@
+/* agent <agent@local>
+ * Persistent sampled line-offset index of large text files.
+ *
+ * Jumping to line N of a multi-gigabyte log by reading from the start
+ * costs a scan of everything before it, every time.  A LineIndex
+ * records where some lines start, so that reading any line costs one
+ * pread() from the nearest recorded line before it.
+ *
+ * The index samples the first line starting in each LINEINDEX_SPAN-byte
+ * window of the file.  No line starts more than LINEINDEX_SPAN bytes
+ * after the sample before it, so a single buffer-sized pread() from the
+ * sample holds the start of the line, and the lines skipped to reach
+ * it are found with memchr().  Each sample is sixteen bytes, so the
+ * index is at most 1/256 of the file, and much less for files of
+ * short lines.
+ *
+ * The index is built by several threads, each counting and sampling
+ * the newlines of one chunk of the mapped file with SIMD compares.  The
+ * samples of a chunk carry line numbers relative to its start; a
+ * prefix sum of the chunk counts then makes them absolute.
+ *
+ * The index is saved as path.lidx, next to the file, and is reused as
+ * long as the file's size and modification time match those recorded
+ * in it.  If it cannot be saved (for example, in a read-only
+ * directory), it is rebuilt on each open.
+ *
+ * The AVX2 or SSE2 paths are used when compiling for them; otherwise
+ * equivalent scalar code is used.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "lineindex.h"
+
+/* Greatest distance from a sample to a line start it locates.  Half of
+ * an IOBuffer, so that one read from a sample holds the skipped lines
+ * and at least this much of the line. */
+static const uint64_t LINEINDEX_SPAN = 4096;
+
+/* Smallest chunk given its own thread; below this, thread start-up
+ * costs more than the scan. */
+static const size_t MIN_CHUNK = 1 << 20;
+
+/* Identifies an index file, and fails to match one written with the
+ * other byte order.  Bump the final digit ("LINEIDX1") on format
+ * changes. */
+static const uint64_t INDEX_MAGIC = 0x31584449454E494CULL;
+
+/* Bytes compared at once in the newline scan; also the width of the
+ * mask returned by newline_mask(). */
+#define SCAN_WIDTH 32
+
+/* The start of one line */
+typedef struct {
+    uint64_t line;
+    uint64_t offset;
+} LineSample;
+
+/* Header of a saved index, followed by nsamples LineSamples */
+typedef struct {
+    uint64_t magic;
+    uint64_t span;
+    uint64_t size;      // of the indexed file
+    int64_t mtime_sec;  // of the indexed file
+    int64_t mtime_nsec;
+    uint64_t lines;
+    uint64_t nsamples;
+} IndexHeader;
+
+/* One thread's share of the build */
+typedef struct {
+    const char *data;     // the whole file
+    size_t size;
+    size_t start;         // the chunk is [start, end)
+    size_t end;
+    uint64_t newlines;
+    LineSample *samples;  // lines relative to the chunk
+    size_t nsamples;
+    size_t capacity;
+    bool failed;          // out of memory
+    pthread_t thread;
+} ChunkScan;
+
+/* Line index */
+struct _LineIndex {
+    int fd;
+    uint64_t lines;
+    LineSample *samples;  // in line order; samples[0] is line 0
+    size_t nsamples;
+};
+
+/*
+ * Returns a bit mask of the newlines in SCAN_WIDTH bytes at p.
+ */
+static uint32_t newline_mask(const char *p) {
+#ifdef __AVX2__
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+#elif defined(__SSE2__)
+    __m128i nl = _mm_set1_epi8('\n');
+    __m128i lo = _mm_loadu_si128((const __m128i *)p);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(p + 16));
+
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, nl))
+           | (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, nl)) << 16;
+#else
+    uint32_t mask = 0;
+
+    for (int i = 0; i < SCAN_WIDTH; i++) {
+        mask |= (uint32_t)(p[i] == '\n') << i;
+    }
+    return mask;
+#endif /* __AVX2__ */
+}
+
+/*
+ * Counts a newline at pos, sampling the line after it if it is the
+ * first to start in its window.  window holds the window of the last
+ * sample.
+ */
+static void chunk_newline(ChunkScan *c, size_t pos, uint64_t *window) {
+    uint64_t start = pos + 1;
+    LineSample *grown;
+
+    c->newlines++;
+    if (start >= c->size || start / LINEINDEX_SPAN == *window) {
+        return;
+    }
+    if (c->nsamples == c->capacity) {
+        c->capacity = c->capacity > 0 ? 2 * c->capacity : 256;
+        grown = realloc(c->samples, c->capacity * sizeof(LineSample));
+        if (grown == NULL) {
+            c->failed = true;
+            return;
+        }
+        c->samples = grown;
+    }
+    *window = start / LINEINDEX_SPAN;
+    c->samples[c->nsamples].line = c->newlines;
+    c->samples[c->nsamples].offset = start;
+    c->nsamples++;
+}
+
+/*
+ * Thread body: counts and samples the newlines of one chunk.
+ */
+static void *chunk_scan(void *arg) {
+    ChunkScan *c = arg;
+    /* Line 0 at offset 0 is sampled by the caller. */
+    uint64_t window = c->start == 0 ? 0 : UINT64_MAX;
+    size_t pos = c->start;
+    uint32_t mask;
+
+    for (; pos + SCAN_WIDTH <= c->end && !c->failed; pos += SCAN_WIDTH) {
+        mask = newline_mask(c->data + pos);
+        while (mask != 0) {
+            chunk_newline(c, pos + __builtin_ctz(mask), &window);
+            mask &= mask - 1;
+        }
+    }
+    for (; pos < c->end && !c->failed; pos++) {
+        if (c->data[pos] == '\n') {
+            chunk_newline(c, pos, &window);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Builds the index of the size-byte file open as idx->fd with up to
+ * nthreads threads.  Returns < 0 with errno set on failure.
+ */
+static int index_build(LineIndex *idx, size_t size, int nthreads) {
+    ChunkScan *chunks;
+    LineSample *out;
+    char *data;
+    bool unterminated;
+    uint64_t base = 0;
+    size_t total = 1;
+    int result = 0;
+
+    idx->lines = 0;
+    idx->nsamples = 0;
+    if (size == 0) {
+        return 0;
+    }
+
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, idx->fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if ((size_t)nthreads > size / MIN_CHUNK) {
+        nthreads = size / MIN_CHUNK;
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    chunks = calloc(nthreads, sizeof(ChunkScan));
+    if (chunks == NULL) {
+        munmap(data, size);
+        return -1;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        chunks[i].data = data;
+        chunks[i].size = size;
+        chunks[i].start = size / nthreads * i;
+        chunks[i].end = i == nthreads - 1 ? size : size / nthreads * (i + 1);
+        /* Chunk 0 is scanned by this thread, as is any chunk whose
+         * thread cannot be started. */
+        if (i == 0 || pthread_create(&chunks[i].thread, NULL, chunk_scan,
+                                     &chunks[i]) != 0) {
+            chunks[i].thread = pthread_self();
+        }
+    }
+    chunk_scan(&chunks[0]);
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_equal(chunks[i].thread, pthread_self())) {
+            chunk_scan(&chunks[i]);
+        } else {
+            pthread_join(chunks[i].thread, NULL);
+        }
+    }
+    unterminated = data[size - 1] != '\n';
+    munmap(data, size);
+
+    /* Line 0 at offset 0, then each chunk's samples, made absolute by
+     * the prefix sum of the newline counts before the chunk.  A chunk
+     * boundary inside a window lets both chunks sample that window;
+     * only the earlier sample is kept, so there is at most one sample
+     * per window. */
+    for (int i = 0; i < nthreads; i++) {
+        total += chunks[i].nsamples;
+        if (chunks[i].failed) {
+            errno = ENOMEM;
+            result = -1;
+        }
+    }
+    idx->samples = out = result == 0 ? malloc(total * sizeof(LineSample))
+                                     : NULL;
+    if (out == NULL) {
+        result = -1;
+    } else {
+        out->line = 0;
+        out->offset = 0;
+        out++;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        for (size_t j = 0; out != NULL && j < chunks[i].nsamples; j++) {
+            if (chunks[i].samples[j].offset / LINEINDEX_SPAN
+                == out[-1].offset / LINEINDEX_SPAN) {
+                continue;
+            }
+            out->line = base + chunks[i].samples[j].line;
+            out->offset = chunks[i].samples[j].offset;
+            out++;
+        }
+        base += chunks[i].newlines;
+        free(chunks[i].samples);
+    }
+    free(chunks);
+
+    idx->nsamples = out != NULL ? (size_t)(out - idx->samples) : total;
+    /* The last line need not end with a newline. */
+    idx->lines = base + unterminated;
+
+    return result;
+}
+
+/*
+ * Writes or reads exactly len bytes, returning < 0 on error or a short
+ * transfer.
+ */
+static int write_all(int fd, const void *data, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n <= 0) {
+            return -1;
+        }
+        data = (const char *)data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *data, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, data, len);
+        if (n <= 0) {
+            return -1;
+        }
+        data = (char *)data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Loads the index saved at ipath, if it matches the file described by
+ * st.  Returns < 0 if there is no usable index.
+ */
+static int index_load(LineIndex *idx, const char *ipath,
+                      const struct stat *st) {
+    IndexHeader h;
+    int fd = open(ipath, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (read_all(fd, &h, sizeof(h)) < 0 || h.magic != INDEX_MAGIC
+        || h.span != LINEINDEX_SPAN || h.size != (uint64_t)st->st_size
+        || h.mtime_sec != st->st_mtim.tv_sec
+        || h.mtime_nsec != st->st_mtim.tv_nsec
+        || h.nsamples > h.size / LINEINDEX_SPAN + 1
+        || (h.nsamples == 0) != (h.size == 0)) {
+        close(fd);
+        return -1;
+    }
+    idx->samples = malloc((h.nsamples > 0 ? h.nsamples : 1)
+                          * sizeof(LineSample));
+    if (idx->samples == NULL
+        || read_all(fd, idx->samples, h.nsamples * sizeof(LineSample)) < 0) {
+        free(idx->samples);
+        idx->samples = NULL;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    idx->lines = h.lines;
+    idx->nsamples = h.nsamples;
+
+    return 0;
+}
+
+/*
+ * Saves the index as ipath for the file described by st.  The index is
+ * written to a temporary file and renamed into place, so that readers
+ * never see part of one.  Failure is not an error; the index is just
+ * rebuilt next time.
+ */
+static void index_save(LineIndex *idx, const char *ipath,
+                       const struct stat *st) {
+    size_t len = strlen(ipath) + 16;
+    char *tmp = malloc(len);
+    IndexHeader h;
+    int fd;
+
+    if (tmp == NULL) {
+        return;
+    }
+    snprintf(tmp, len, "%s.%d", ipath, (int)getpid());
+    memset(&h, 0, sizeof(h));
+    h.magic = INDEX_MAGIC;
+    h.span = LINEINDEX_SPAN;
+    h.size = st->st_size;
+    h.mtime_sec = st->st_mtim.tv_sec;
+    h.mtime_nsec = st->st_mtim.tv_nsec;
+    h.lines = idx->lines;
+    h.nsamples = idx->nsamples;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        if (write_all(fd, &h, sizeof(h)) < 0
+            || write_all(fd, idx->samples,
+                         idx->nsamples * sizeof(LineSample)) < 0
+            || close(fd) < 0 || rename(tmp, ipath) < 0) {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+}
+
+/* Open a file and its line index.
+ *
+ * The index saved next to the file is used if it is up to date, and
+ * otherwise built with up to nthreads threads and saved.  The file must
+ * not change while the index is open.
+ *
+ * This function returns NULL with errno set on error.
+ *
+ * path:     the text file to index
+ * nthreads: threads to build the index with, or <= 0 for one per CPU
+ */
+LineIndex *lineindex_open(const char *path, int nthreads) {
+    LineIndex *idx = calloc(1, sizeof(LineIndex));
+    size_t len = strlen(path) + sizeof(".lidx");
+    char *ipath = malloc(len);
+    struct stat st;
+    int saved;
+
+    if (idx == NULL || ipath == NULL) {
+        free(idx);
+        free(ipath);
+        return NULL;
+    }
+    snprintf(ipath, len, "%s.lidx", path);
+    idx->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (idx->fd < 0 || fstat(idx->fd, &st) < 0) {
+        goto fail;
+    }
+    if (index_load(idx, ipath, &st) < 0) {
+        if (index_build(idx, st.st_size, nthreads) < 0) {
+            goto fail;
+        }
+        index_save(idx, ipath, &st);
+    }
+    free(ipath);
+
+    return idx;
+
+fail:
+    saved = errno;
+    free(ipath);
+    lineindex_close(idx);
+    errno = saved;
+    return NULL;
+}
+
+/*
+ * Closes the file of a line index and frees the index.
+ */
+void lineindex_close(LineIndex *idx) {
+    if (idx == NULL) {
+        return;
+    }
+    if (idx->fd >= 0) {
+        close(idx->fd);
+    }
+    free(idx->samples);
+    free(idx);
+}
+
+/*
+ * Returns the number of lines in the indexed file.  A final line
+ * without a newline counts.
+ */
+uint64_t lineindex_lines(LineIndex *idx) {
+    return idx->lines;
+}
+
+/* Read from the start of a given line into an IOBuffer.
+ *
+ * One pread() fills the buffer from the sample before the line, and
+ * the lines before it are consumed, leaving the buffer holding the
+ * line and whatever follows it.  At least LINEINDEX_SPAN bytes of it
+ * are read unless the file ends first; a longer line is read onward
+ * from *offset + iobuffer_length(buf) as usual.
+ *
+ * This function returns < 0 with errno set on error (EINVAL if the
+ * line does not exist or buf is not empty), or the number of bytes in
+ * the buffer.
+ *
+ * idx:    the index
+ * line:   the line to read, counting from 0
+ * buf:    an empty buffer to read into
+ * offset: set to the file offset of the line, if not NULL
+ */
+int lineindex_read(LineIndex *idx, uint64_t line, IOBuffer *buf,
+                   off_t *offset) {
+    size_t lo = 0;
+    size_t hi = idx->nsamples;
+    size_t mid;
+    size_t pos = 0;
+    char *data;
+    char *nl;
+    int result;
+
+    if (line >= idx->lines || iobuffer_length(buf) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Find the last sample at or before the line. */
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (idx->samples[mid].line <= line) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    /* As much as the buffer holds. */
+    result = iobuffer_pread(buf, idx->fd, SIZE_MAX, idx->samples[lo].offset);
+    if (result < 0) {
+        return result;
+    }
+    data = iobuffer_data(buf);
+    for (uint64_t skip = line - idx->samples[lo].line; skip > 0; skip--) {
+        nl = memchr(data + pos, '\n', result - pos);
+        if (nl == NULL) {
+            /* The file changed under the index. */
+            iobuffer_consume(buf, result);
+            errno = ESTALE;
+            return -1;
+        }
+        pos = nl - data + 1;
+    }
+    iobuffer_consume(buf, pos);
+    if (offset != NULL) {
+        *offset = idx->samples[lo].offset + pos;
+    }
+
+    return iobuffer_length(buf);
+}
@@ -0,0 +1,31 @@
+/* agent <agent@local>
+ * Persistent sampled line-offset index of large text files.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in lineindex.c.
+ */
+
+#ifndef LINEINDEX_H_
+#define LINEINDEX_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "example.h"
+
+/* Line index of one open file
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _LineIndex LineIndex;
+
+LineIndex *lineindex_open(const char *path, int nthreads);
+
+void lineindex_close(LineIndex *idx);
+
+uint64_t lineindex_lines(LineIndex *idx);
+
+int lineindex_read(LineIndex *idx, uint64_t line, IOBuffer *buf,
+                   off_t *offset);
+
+#endif /* LINEINDEX_H_ */
@@ -0,0 +1,479 @@
+/* agent <agent@local>
+ * Streaming timestamp-ordered merge of many IOBuffer inputs.
+ *
+ * Each input is a newline-delimited stream of records in timestamp
+ * order, read by the caller into the input's IOBuffer.  The head record
+ * of every input sits at a leaf of a winner tree, so choosing the next
+ * record, or changing any one input's head, costs log2(k) comparisons
+ * instead of a scan of all k inputs.
+ *
+ * An input with no complete record is waiting, and would normally stop
+ * the merge until it produces one.  Instead, inputs are promised to be
+ * at most lateness behind the newest timestamp seen on any input, where
+ * the newest timestamp on an input is that of the last complete record
+ * in its buffer.  The watermark is that newest timestamp minus
+ * lateness, and a waiting input stands at the later of the watermark
+ * and its own last timestamp.  Waiting inputs are kept out of the tree,
+ * in a heap ordered by last timestamp, so the earliest of them is known
+ * at once however the watermark moves.  Records up to that point are
+ * emitted; records that later arrive behind already-emitted ones are
+ * counted as late and emitted immediately.
+ *
+ * Records are copied once, from the input's storage straight into the
+ * output IOBuffer.
+ */
+#define _GNU_SOURCE  /* for memrchr() */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "merge.h"
+
+/* State of an input.  Ties on timestamp go to the lowest state. */
+typedef enum {
+    INPUT_RECORD,     /* Head record is complete */
+    INPUT_WAITING,    /* No complete record; more data expected */
+    INPUT_EXHAUSTED   /* At EOF with no data */
+} InputState;
+
+/* One merge input */
+typedef struct {
+    IOBuffer *buf;
+    InputState state;
+    bool eof;
+    bool skipping;      // dropping the rest of an oversized line
+    uint64_t key;       // head timestamp, or UINT64_MAX without a record
+    uint64_t last_key;  // timestamp of the last record emitted
+    size_t head_len;    // length of the head record
+    int heap_pos;       // index in the waiting heap, or -1
+} MergeInput;
+
+/* k-way merger */
+struct _Merger {
+    MergeInput *inputs;
+    int *tree;          // subtree winners at 1..k-1, overall winner at 0
+    int *waiting;       // min-heap of waiting inputs by last_key
+    int nwaiting;
+    int k;
+    uint64_t lateness;
+    uint64_t newest;    // newest timestamp seen on any input
+    uint64_t last_emitted;
+    unsigned long late;
+    unsigned long oversized;
+    MergeKeyFunc keyfunc;
+    void *arg;
+};
+
+/*
+ * Returns true if input a's leaf beats input b's.
+ */
+static bool input_before(Merger *m, int a, int b) {
+    MergeInput *x = &m->inputs[a];
+    MergeInput *y = &m->inputs[b];
+
+    if (x->key != y->key) {
+        return x->key < y->key;
+    }
+    if (x->state != y->state) {
+        return x->state < y->state;
+    }
+    return a < b;
+}
+
+/*
+ * Returns the input that won at a given tree node.  Leaves are nodes k
+ * through 2k-1.
+ */
+static int tree_winner(Merger *m, int node) {
+    return node >= m->k ? node - m->k : m->tree[node];
+}
+
+/*
+ * Decides the match at an internal node between its two children.
+ */
+static void tree_play(Merger *m, int node) {
+    int left = tree_winner(m, 2 * node);
+    int right = tree_winner(m, 2 * node + 1);
+
+    m->tree[node] = input_before(m, left, right) ? left : right;
+}
+
+/*
+ * Plays every match of the tree.
+ */
+static void tree_build(Merger *m) {
+    for (int node = m->k - 1; node > 0; node--) {
+        tree_play(m, node);
+    }
+    m->tree[0] = tree_winner(m, 1);
+}
+
+/*
+ * Replays the matches on the path from an input's leaf to the root after
+ * its key or state has changed.  Each match is decided from the two
+ * subtree winners, so this is valid for any leaf.
+ */
+static void tree_update(Merger *m, int input) {
+    for (int node = (input + m->k) / 2; node > 0; node /= 2) {
+        tree_play(m, node);
+    }
+    m->tree[0] = tree_winner(m, 1);
+}
+
+/*
+ * Returns true if waiting input a stands before waiting input b.
+ */
+static bool heap_before(Merger *m, int a, int b) {
+    uint64_t x = m->inputs[a].last_key;
+    uint64_t y = m->inputs[b].last_key;
+
+    return x != y ? x < y : a < b;
+}
+
+/*
+ * Stores an input at a position of the waiting heap.
+ */
+static void heap_set(Merger *m, int pos, int input) {
+    m->waiting[pos] = input;
+    m->inputs[input].heap_pos = pos;
+}
+
+/*
+ * Moves the input at a position of the waiting heap toward the root
+ * until the heap is ordered.
+ */
+static void heap_sift_up(Merger *m, int pos) {
+    int input = m->waiting[pos];
+    int parent;
+
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (!heap_before(m, input, m->waiting[parent])) {
+            break;
+        }
+        heap_set(m, pos, m->waiting[parent]);
+        pos = parent;
+    }
+    heap_set(m, pos, input);
+}
+
+/*
+ * Moves the input at a position of the waiting heap toward the leaves
+ * until the heap is ordered.
+ */
+static void heap_sift_down(Merger *m, int pos) {
+    int input = m->waiting[pos];
+    int child;
+
+    for (;;) {
+        child = 2 * pos + 1;
+        if (child >= m->nwaiting) {
+            break;
+        }
+        if (child + 1 < m->nwaiting
+            && heap_before(m, m->waiting[child + 1], m->waiting[child])) {
+            child++;
+        }
+        if (!heap_before(m, m->waiting[child], input)) {
+            break;
+        }
+        heap_set(m, pos, m->waiting[child]);
+        pos = child;
+    }
+    heap_set(m, pos, input);
+}
+
+/*
+ * Adds an input to the waiting heap.
+ */
+static void heap_insert(Merger *m, int input) {
+    heap_set(m, m->nwaiting++, input);
+    heap_sift_up(m, m->nwaiting - 1);
+}
+
+/*
+ * Removes an input from the waiting heap.
+ */
+static void heap_remove(Merger *m, int input) {
+    int pos = m->inputs[input].heap_pos;
+    int last = m->waiting[--m->nwaiting];
+
+    m->inputs[input].heap_pos = -1;
+    if (pos == m->nwaiting) {
+        return;
+    }
+    heap_set(m, pos, last);
+    heap_sift_up(m, pos);
+    heap_sift_down(m, m->inputs[last].heap_pos);
+}
+
+/*
+ * Returns the current watermark.
+ */
+static uint64_t merger_watermark(Merger *m) {
+    return m->newest > m->lateness ? m->newest - m->lateness : 0;
+}
+
+/*
+ * Returns true if a record with a given timestamp may be emitted, that
+ * is, if no waiting input stands before it.  A waiting input stands at
+ * the later of the watermark and the timestamp of the last record it
+ * gave, so the earliest of them is found from the top of the heap and
+ * an advancing watermark touches no input at all.
+ */
+static bool merger_ready(Merger *m, uint64_t key) {
+    uint64_t watermark = merger_watermark(m);
+    uint64_t stand;
+
+    if (m->nwaiting == 0) {
+        return true;
+    }
+    stand = m->inputs[m->waiting[0]].last_key;
+
+    return key <= (stand > watermark ? stand : watermark);
+}
+
+/*
+ * Finds the head record of an input and sets its state and key, without
+ * touching the tree or the heap.  A line that fills the buffer without
+ * a newline cannot be held whole, and is dropped through its newline.
+ */
+static void input_parse(Merger *m, MergeInput *in) {
+    char *data = iobuffer_data(in->buf);
+    size_t length = iobuffer_length(in->buf);
+    char *newline = length > 0 ? memchr(data, '\n', length) : NULL;
+
+    while (in->skipping || (newline == NULL && !in->eof
+                            && iobuffer_status(in->buf) == IOBUFFER_FULL)) {
+        if (!in->skipping) {
+            in->skipping = true;
+            m->oversized++;
+        }
+        if (newline == NULL) {
+            iobuffer_consume(in->buf, length);
+            break;
+        }
+        iobuffer_consume(in->buf, newline - data + 1);
+        in->skipping = false;
+        data = iobuffer_data(in->buf);
+        length = iobuffer_length(in->buf);
+        newline = length > 0 ? memchr(data, '\n', length) : NULL;
+    }
+
+    if (in->skipping) {
+        in->head_len = 0;
+    } else if (newline != NULL) {
+        in->head_len = newline - data + 1;
+    } else if (length > 0 && in->eof) {
+        in->head_len = length;  // an unterminated final line
+    } else {
+        in->head_len = 0;
+    }
+
+    if (in->head_len > 0) {
+        in->state = INPUT_RECORD;
+        in->key = m->keyfunc(data, in->head_len, m->arg);
+        if (in->key > m->newest) {
+            m->newest = in->key;
+        }
+    } else {
+        in->state = in->eof ? INPUT_EXHAUSTED : INPUT_WAITING;
+        in->key = UINT64_MAX;
+    }
+}
+
+/*
+ * Parses an input's head record and moves it into or out of the waiting
+ * heap and along its path in the tree to match.
+ */
+static void input_refresh(Merger *m, int input) {
+    MergeInput *in = &m->inputs[input];
+
+    input_parse(m, in);
+    if (in->state == INPUT_WAITING && in->heap_pos < 0) {
+        heap_insert(m, input);
+    } else if (in->state != INPUT_WAITING && in->heap_pos >= 0) {
+        heap_remove(m, input);
+    }
+    tree_update(m, input);
+}
+
+/*
+ * Raises the newest timestamp seen to that of the last complete record
+ * in an input's buffer.
+ */
+static void input_scan_newest(Merger *m, MergeInput *in) {
+    char *data = iobuffer_data(in->buf);
+    size_t length = iobuffer_length(in->buf);
+    char *end = length > 0 ? memrchr(data, '\n', length) : NULL;
+    char *start;
+    uint64_t key;
+
+    if (end == NULL || in->skipping) {
+        return;
+    }
+    start = end > data ? memrchr(data, '\n', end - data) : NULL;
+    start = start != NULL ? start + 1 : data;
+    key = m->keyfunc(start, end - start + 1, m->arg);
+    if (key > m->newest) {
+        m->newest = key;
+    }
+}
+
+/* Create a merger.
+ *
+ * This function returns NULL if memory is exhausted.
+ *
+ * ninputs:  the number of inputs, at least 1
+ * lateness: how far behind the newest timestamp an input may be
+ * key:      function returning the timestamp of a record
+ * arg:      passed to key
+ */
+Merger *merger_create(int ninputs, uint64_t lateness, MergeKeyFunc key,
+                      void *arg) {
+    Merger *m = calloc(1, sizeof(Merger));
+
+    if (m == NULL || ninputs < 1) {
+        free(m);
+        return NULL;
+    }
+    m->k = ninputs;
+    m->lateness = lateness;
+    m->keyfunc = key;
+    m->arg = arg;
+    m->inputs = calloc(ninputs, sizeof(MergeInput));
+    m->tree = calloc(ninputs, sizeof(int));
+    m->waiting = calloc(ninputs, sizeof(int));
+    if (m->inputs == NULL || m->tree == NULL || m->waiting == NULL) {
+        merger_destroy(m);
+        return NULL;
+    }
+    for (int i = 0; i < ninputs; i++) {
+        m->inputs[i].buf = iobuffer_create();
+        if (m->inputs[i].buf == NULL) {
+            merger_destroy(m);
+            return NULL;
+        }
+        input_parse(m, &m->inputs[i]);
+        heap_insert(m, i);
+    }
+    tree_build(m);
+
+    return m;
+}
+
+/*
+ * Frees a merger and its input buffers.
+ */
+void merger_destroy(Merger *m) {
+    if (m == NULL) {
+        return;
+    }
+    if (m->inputs != NULL) {
+        for (int i = 0; i < m->k; i++) {
+            iobuffer_destroy(m->inputs[i].buf);
+        }
+    }
+    free(m->inputs);
+    free(m->tree);
+    free(m->waiting);
+    free(m);
+}
+
+/*
+ * Returns the IOBuffer for an input.  The caller reads the input's data
+ * into it and then calls merger_update(); the caller must not consume
+ * from it.
+ */
+IOBuffer *merger_input(Merger *m, int input) {
+    return m->inputs[input].buf;
+}
+
+/*
+ * Tells the merger that data has been read into an input's buffer.  This
+ * costs log2(k) comparisons if the input was waiting, and none
+ * otherwise.
+ */
+void merger_update(Merger *m, int input) {
+    MergeInput *in = &m->inputs[input];
+
+    if (in->state == INPUT_WAITING) {
+        input_refresh(m, input);
+    }
+    input_scan_newest(m, in);
+}
+
+/*
+ * Tells the merger that an input has reached EOF.  Data already in its
+ * buffer is still merged.
+ */
+void merger_input_eof(Merger *m, int input) {
+    m->inputs[input].eof = true;
+    merger_update(m, input);
+}
+
+/* Emit records in timestamp order to an output buffer.
+ *
+ * Records are emitted until the output is full, every input is
+ * exhausted, or the next record could still be preceded by one from a
+ * waiting input.
+ *
+ * A line that fills its input's buffer without a newline is too long to
+ * merge.  Its timestamp is readable but its end is not, so it is not
+ * emitted at all: it is dropped through its newline, and counted by
+ * merger_oversized().  An unterminated line at EOF is emitted as usual.
+ *
+ * This function returns the number of records emitted.
+ *
+ * m:   the merger
+ * out: the buffer to which records are appended
+ */
+int merger_emit(Merger *m, IOBuffer *out) {
+    MergeInput *in;
+    int count = 0;
+    int winner;
+
+    for (;;) {
+        winner = m->tree[0];
+        in = &m->inputs[winner];
+        if (in->state != INPUT_RECORD || !merger_ready(m, in->key)
+            || iobuffer_append(out, iobuffer_data(in->buf),
+                               in->head_len) < 0) {
+            break;
+        }
+        if (in->key < m->last_emitted) {
+            m->late++;
+        } else {
+            m->last_emitted = in->key;
+        }
+        in->last_key = in->key;
+        iobuffer_consume(in->buf, in->head_len);
+        input_refresh(m, winner);
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Returns true once every input is at EOF and fully merged.
+ */
+bool merger_done(Merger *m) {
+    return m->inputs[m->tree[0]].state == INPUT_EXHAUSTED;
+}
+
+/*
+ * Returns the number of records emitted behind an earlier record
+ * because their input exceeded the lateness bound.
+ */
+unsigned long merger_late(Merger *m) {
+    return m->late;
+}
+
+/*
+ * Returns the number of lines dropped because they were too long for an
+ * input buffer.
+ */
+unsigned long merger_oversized(Merger *m) {
+    return m->oversized;
+}
@@ -0,0 +1,47 @@
+/* agent <agent@local>
+ * Streaming timestamp-ordered merge of many IOBuffer inputs.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in merge.c.
+ */
+
+#ifndef MERGE_H_
+#define MERGE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "example.h"
+
+/* Returns the timestamp of a record.  record points to len bytes,
+ * including the record's terminating newline, if any. */
+typedef uint64_t (*MergeKeyFunc)(const char *record, size_t len,
+                                 void *arg);
+
+/* k-way merger of newline-delimited, individually sorted inputs
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _Merger Merger;
+
+Merger *merger_create(int ninputs, uint64_t lateness, MergeKeyFunc key,
+                      void *arg);
+
+void merger_destroy(Merger *m);
+
+IOBuffer *merger_input(Merger *m, int input);
+
+void merger_update(Merger *m, int input);
+
+void merger_input_eof(Merger *m, int input);
+
+int merger_emit(Merger *m, IOBuffer *out);
+
+bool merger_done(Merger *m);
+
+unsigned long merger_late(Merger *m);
+
+unsigned long merger_oversized(Merger *m);
+
+#endif /* MERGE_H_ */
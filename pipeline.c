@@ -0,0 +1,449 @@
+/* agent <agent@local>
+ * Staged processing pipeline over IOBuffers.
+ *
+ * A chain like read, decompress, validate, parse, checksum written as
+ * separate passes brings every byte into cache once per pass.  Here,
+ * stages declare whether they are byte-wise or block-wise.  Adjacent
+ * byte-wise stages are fused into one segment that runs every stage
+ * over one FUSE_BLOCK-sized piece before moving to the next, so each
+ * piece is loaded once and stays in L1 for the whole chain.  Block
+ * stages, which may change the size of the data, form segments of
+ * their own.
+ *
+ * Between segments are queues of at most credits buffers.  A segment
+ * runs only while the queue after it has a free credit, and the caller
+ * gets a new input buffer from pipeline_input() only while the first
+ * queue has one, so a slow stage pushes back all the way to the reader
+ * and the pipeline's memory is bounded.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "pipeline.h"
+
+/* Bytes processed by every stage of a fused segment before moving on.
+ * Small enough to stay in L1 across all the stages of a segment. */
+static const size_t FUSE_BLOCK = 4096;
+
+/* Kind of stage, and of the segment it ends up in */
+typedef enum {
+    STAGE_BYTEWISE,
+    STAGE_BLOCK
+} StageKind;
+
+/* One declared stage */
+typedef struct {
+    StageKind kind;
+    ByteStageFunc bytefn;
+    BlockStageFunc blockfn;
+    void *state;
+} Stage;
+
+/* Bounded FIFO of buffers between segments */
+typedef struct {
+    IOBuffer **slots;
+    int head;
+    int count;
+} BufferQueue;
+
+/* A run of stages executed together */
+typedef struct {
+    StageKind kind;
+    int first;        // index of the first stage
+    int nstages;
+    BufferQueue in;
+    IOBuffer *out;    // block segments: output being filled
+} Segment;
+
+/* Chain of processing stages */
+struct _Pipeline {
+    Stage *stages;
+    int nstages;
+    Segment *segments;  // built by pipeline_build()
+    int nsegments;
+    BufferQueue out;    // buffers for the sink
+    IOBuffer **free;    // idle buffers
+    int nfree;
+    int nbuffers;       // buffers allocated, at most maxbuffers
+    int maxbuffers;
+    int credits;
+    int inputs;         // buffers handed out by pipeline_input()
+    bool fuse;
+    SinkFunc sink;
+    void *arg;
+};
+
+/*
+ * Allocates the slots of a queue.  Returns < 0 if memory is exhausted.
+ */
+static int queue_init(BufferQueue *q, int credits) {
+    q->slots = calloc(credits, sizeof(IOBuffer *));
+    q->head = 0;
+    q->count = 0;
+
+    return q->slots == NULL ? -1 : 0;
+}
+
+/*
+ * Adds a buffer to the tail of a queue with a free credit.
+ */
+static void queue_push(Pipeline *p, BufferQueue *q, IOBuffer *buf) {
+    assert(q->count < p->credits);
+    q->slots[(q->head + q->count) % p->credits] = buf;
+    q->count++;
+}
+
+/*
+ * Removes and returns the buffer at the head of a non-empty queue.
+ */
+static IOBuffer *queue_pop(Pipeline *p, BufferQueue *q) {
+    IOBuffer *buf = q->slots[q->head];
+
+    q->head = (q->head + 1) % p->credits;
+    q->count--;
+
+    return buf;
+}
+
+/*
+ * Returns an idle buffer, allocating one if the pipeline is below its
+ * limit, or NULL if none is available.
+ */
+static IOBuffer *buffer_get(Pipeline *p) {
+    if (p->nfree > 0) {
+        return p->free[--p->nfree];
+    }
+    if (p->nbuffers == p->maxbuffers) {
+        return NULL;
+    }
+    p->free[p->nfree] = iobuffer_create();
+    if (p->free[p->nfree] == NULL) {
+        return NULL;
+    }
+    p->nbuffers++;
+
+    return p->free[p->nfree];
+}
+
+/*
+ * Empties a buffer and returns it to the idle list.
+ */
+static void buffer_put(Pipeline *p, IOBuffer *buf) {
+    iobuffer_consume(buf, iobuffer_length(buf));
+    p->free[p->nfree++] = buf;
+}
+
+/* Create an empty pipeline.
+ *
+ * This function returns NULL if memory is exhausted.
+ *
+ * credits: the most buffers queued between any two segments
+ * sink:    receives each buffer leaving the last stage
+ * arg:     passed to sink
+ */
+Pipeline *pipeline_create(int credits, SinkFunc sink, void *arg) {
+    Pipeline *p = calloc(1, sizeof(Pipeline));
+
+    if (p == NULL) {
+        return NULL;
+    }
+    p->credits = credits > 0 ? credits : 1;
+    p->fuse = true;
+    p->sink = sink;
+    p->arg = arg;
+
+    return p;
+}
+
+/*
+ * Frees a pipeline and all of its buffers.
+ */
+void pipeline_destroy(Pipeline *p) {
+    IOBuffer *buf;
+
+    if (p == NULL) {
+        return;
+    }
+    for (int i = 0; i < p->nsegments; i++) {
+        while (p->segments[i].in.count > 0) {
+            buffer_put(p, queue_pop(p, &p->segments[i].in));
+        }
+        if (p->segments[i].out != NULL) {
+            buffer_put(p, p->segments[i].out);
+        }
+        free(p->segments[i].in.slots);
+    }
+    while (p->out.count > 0) {
+        buffer_put(p, queue_pop(p, &p->out));
+    }
+    while (p->nfree > 0) {
+        buf = p->free[--p->nfree];
+        iobuffer_destroy(buf);
+    }
+    free(p->out.slots);
+    free(p->free);
+    free(p->segments);
+    free(p->stages);
+    free(p);
+}
+
+/*
+ * Appends a stage.  Returns < 0 if the pipeline has already started or
+ * memory is exhausted.
+ */
+static int pipeline_add(Pipeline *p, Stage *stage) {
+    Stage *stages;
+
+    if (p->segments != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    stages = realloc(p->stages, (p->nstages + 1) * sizeof(Stage));
+    if (stages == NULL) {
+        return -1;
+    }
+    stages[p->nstages++] = *stage;
+    p->stages = stages;
+
+    return 0;
+}
+
+/*
+ * Appends a byte-wise stage.  Returns < 0 on error.
+ */
+int pipeline_add_bytewise(Pipeline *p, ByteStageFunc fn, void *state) {
+    Stage stage = { STAGE_BYTEWISE, fn, NULL, state };
+
+    return pipeline_add(p, &stage);
+}
+
+/*
+ * Appends a block stage.  Returns < 0 on error.
+ */
+int pipeline_add_block(Pipeline *p, BlockStageFunc fn, void *state) {
+    Stage stage = { STAGE_BLOCK, NULL, fn, state };
+
+    return pipeline_add(p, &stage);
+}
+
+/*
+ * Enables or disables fusion of adjacent byte-wise stages; it is on by
+ * default.  Turning it off runs each stage as its own pass, for
+ * comparison.  Has no effect once the pipeline has started.
+ */
+void pipeline_set_fusion(Pipeline *p, bool fuse) {
+    p->fuse = fuse;
+}
+
+/*
+ * Frees what a failed pipeline_build() allocated, leaving the pipeline
+ * unstarted so that the next pipeline_input() tries again.
+ */
+static void pipeline_unbuild(Pipeline *p) {
+    for (int i = 0; i < p->nsegments; i++) {
+        free(p->segments[i].in.slots);
+    }
+    free(p->segments);
+    free(p->out.slots);
+    free(p->free);
+    p->segments = NULL;
+    p->nsegments = 0;
+    p->out.slots = NULL;
+    p->free = NULL;
+    p->maxbuffers = 0;
+}
+
+/*
+ * Groups the stages into segments and allocates the queues and buffer
+ * list.  Returns < 0 if memory is exhausted, with nothing allocated.
+ */
+static int pipeline_build(Pipeline *p) {
+    Segment *seg;
+
+    p->segments = calloc(p->nstages, sizeof(Segment));
+    if (p->segments == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < p->nstages; i++) {
+        if (p->fuse && p->nsegments > 0
+            && p->segments[p->nsegments - 1].kind == STAGE_BYTEWISE
+            && p->stages[i].kind == STAGE_BYTEWISE) {
+            p->segments[p->nsegments - 1].nstages++;
+            continue;
+        }
+        seg = &p->segments[p->nsegments++];
+        seg->kind = p->stages[i].kind;
+        seg->first = i;
+        seg->nstages = 1;
+        if (queue_init(&seg->in, p->credits) < 0) {
+            pipeline_unbuild(p);
+            return -1;
+        }
+    }
+
+    /* Every queue full, plus one output in progress per segment. */
+    p->maxbuffers = (p->nsegments + 1) * p->credits + p->nsegments;
+    p->free = calloc(p->maxbuffers, sizeof(IOBuffer *));
+    if (p->free == NULL || queue_init(&p->out, p->credits) < 0) {
+        pipeline_unbuild(p);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns an empty buffer for the caller to read pipeline input into,
+ * or NULL if the first stage has no free credit; the caller should stop
+ * reading until pipeline_run() frees one.  Each buffer handed out holds
+ * a credit of the first stage until it is submitted.  The first call
+ * fixes the list of stages.
+ */
+IOBuffer *pipeline_input(Pipeline *p) {
+    BufferQueue *first;
+    IOBuffer *buf;
+
+    if (p->segments == NULL && pipeline_build(p) < 0) {
+        return NULL;
+    }
+    first = p->nsegments > 0 ? &p->segments[0].in : &p->out;
+    if (first->count + p->inputs >= p->credits) {
+        return NULL;
+    }
+    buf = buffer_get(p);
+    if (buf != NULL) {
+        p->inputs++;
+    }
+
+    return buf;
+}
+
+/*
+ * Passes a buffer obtained from pipeline_input() into the pipeline,
+ * using the credit it holds.  Every buffer from pipeline_input() must
+ * be submitted exactly once.
+ */
+void pipeline_submit(Pipeline *p, IOBuffer *buf) {
+    BufferQueue *first = p->nsegments > 0 ? &p->segments[0].in : &p->out;
+
+    p->inputs--;
+    if (iobuffer_length(buf) == 0) {
+        buffer_put(p, buf);
+        return;
+    }
+    queue_push(p, first, buf);
+}
+
+/*
+ * Runs the stages of a byte-wise segment over a buffer, one FUSE_BLOCK
+ * at a time.
+ */
+static void run_bytewise(Pipeline *p, Segment *seg, IOBuffer *buf) {
+    char *data = iobuffer_data(buf);
+    size_t length = iobuffer_length(buf);
+    size_t block;
+    Stage *stage;
+
+    for (size_t offset = 0; offset < length; offset += block) {
+        block = length - offset < FUSE_BLOCK ? length - offset : FUSE_BLOCK;
+        for (int i = 0; i < seg->nstages; i++) {
+            stage = &p->stages[seg->first + i];
+            stage->bytefn(stage->state, data + offset, block);
+        }
+    }
+}
+
+/*
+ * Moves as much data as possible through one segment into the queue
+ * after it.  Returns < 0 on error, 0 if nothing moved, or 1 if
+ * something did.
+ */
+static int run_segment(Pipeline *p, Segment *seg, BufferQueue *next) {
+    Stage *stage = &p->stages[seg->first];
+    IOBuffer *in;
+    size_t inlen;
+    size_t outlen;
+    int moved = 0;
+
+    while (next->count < p->credits && seg->in.count > 0) {
+        if (seg->kind == STAGE_BYTEWISE) {
+            in = queue_pop(p, &seg->in);
+            run_bytewise(p, seg, in);
+            queue_push(p, next, in);
+            moved = 1;
+            continue;
+        }
+
+        if (seg->out == NULL) {
+            seg->out = buffer_get(p);
+            if (seg->out == NULL) {
+                break;
+            }
+        }
+        in = seg->in.slots[seg->in.head];
+        inlen = iobuffer_length(in);
+        outlen = iobuffer_length(seg->out);
+        if (stage->blockfn(stage->state, in, seg->out) < 0) {
+            return -1;
+        }
+        if (iobuffer_length(in) == 0) {
+            buffer_put(p, queue_pop(p, &seg->in));
+        }
+        if (iobuffer_length(in) == inlen
+            && iobuffer_length(seg->out) == outlen) {
+            if (outlen == 0) {
+                errno = EPROTO;  // the stage broke its contract
+                return -1;
+            }
+            /* Output is full; pass it on and continue with another. */
+            queue_push(p, next, seg->out);
+            seg->out = NULL;
+        }
+        moved = 1;
+    }
+
+    /* With no more input, pass on any partial output. */
+    if (seg->kind == STAGE_BLOCK && seg->in.count == 0 && seg->out != NULL
+        && iobuffer_length(seg->out) > 0 && next->count < p->credits) {
+        queue_push(p, next, seg->out);
+        seg->out = NULL;
+        moved = 1;
+    }
+
+    return moved;
+}
+
+/* Move submitted data through the pipeline.
+ *
+ * Segments are run from last to first, so that each frees credits for
+ * the one before it, until nothing more can move.  Buffers leaving the
+ * last segment are given to the sink.
+ *
+ * This function returns < 0 if a block stage fails, or 0.
+ */
+int pipeline_run(Pipeline *p) {
+    BufferQueue *next;
+    IOBuffer *buf;
+    int moved = 1;
+    int result;
+
+    while (moved) {
+        moved = 0;
+        while (p->out.count > 0) {
+            buf = queue_pop(p, &p->out);
+            p->sink(p->arg, buf);
+            buffer_put(p, buf);
+        }
+        for (int i = p->nsegments - 1; i >= 0; i--) {
+            next = i + 1 < p->nsegments ? &p->segments[i + 1].in : &p->out;
+            result = run_segment(p, &p->segments[i], next);
+            if (result < 0) {
+                return -1;
+            }
+            moved |= result;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+/* agent <agent@local>
+ * Staged processing pipeline over IOBuffers.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in pipeline.c.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "example.h"
+
+/* A byte-wise stage: transforms or inspects len bytes in place.  The
+ * output for each byte may depend only on that byte and on state, so
+ * the data may be presented in pieces of any size. */
+typedef void (*ByteStageFunc)(void *state, char *data, size_t len);
+
+/* A block stage: consumes data from in and appends results to out.
+ * Returns < 0 on error.  Whatever it consumes but cannot use yet (e.g.,
+ * a partial record) must be kept in state, so that every call either
+ * consumes input or fills out. */
+typedef int (*BlockStageFunc)(void *state, IOBuffer *in, IOBuffer *out);
+
+/* Receives each buffer leaving the pipeline.  The buffer is reused
+ * after the call returns. */
+typedef void (*SinkFunc)(void *arg, IOBuffer *buf);
+
+/* Chain of processing stages
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _Pipeline Pipeline;
+
+Pipeline *pipeline_create(int credits, SinkFunc sink, void *arg);
+
+void pipeline_destroy(Pipeline *p);
+
+int pipeline_add_bytewise(Pipeline *p, ByteStageFunc fn, void *state);
+
+int pipeline_add_block(Pipeline *p, BlockStageFunc fn, void *state);
+
+void pipeline_set_fusion(Pipeline *p, bool fuse);
+
+IOBuffer *pipeline_input(Pipeline *p);
+
+void pipeline_submit(Pipeline *p, IOBuffer *buf);
+
+int pipeline_run(Pipeline *p);
+
+#endif /* PIPELINE_H_ */
@@ -0,0 +1,244 @@
+/* agent <agent@local>
+ * Pipelined prefetching of sequential input into IOBuffers.
+ *
+ * A scanner that alternates iobuffer_read() with processing leaves the
+ * CPU idle while it waits for I/O and the device idle while it parses.
+ * A Prefetcher runs the reads on its own thread: while the consumer
+ * works on one buffer, the I/O thread fills the next, so a scan takes
+ * roughly max(I/O time, compute time) rather than their sum.
+ *
+ * Buffers circulate between the two threads through two single-
+ * producer, single-consumer rings: filled buffers go to the consumer,
+ * and released buffers come back to be refilled.  Handing a buffer over
+ * is a store and a load, with no lock.  A thread that finds its ring
+ * empty sleeps on a futex, and the other side only makes the wake-up
+ * system call when a sleeper has announced itself.
+ */
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+
+/* Single-producer, single-consumer ring of IOBuffer pointers.  Ring
+ * capacity exceeds the number of buffers in circulation, so a push
+ * never finds it full. */
+typedef struct {
+    IOBuffer **slots;
+    unsigned int size;
+    atomic_uint head;     // next slot to pop; written by the consumer
+    atomic_uint tail;     // next slot to push; written by the producer
+    atomic_int sleeping;  // nonzero while the consumer waits on tail
+} BufferRing;
+
+/* Background reader */
+struct _Prefetcher {
+    int fd;
+    int nbuffers;
+    IOBuffer **buffers;
+    BufferRing filled;    // I/O thread to consumer; NULL marks the end
+    BufferRing empty;     // consumer to I/O thread; NULL means stop
+    bool finished;        // consumer has seen the end marker
+    int error;            // errno of a failed read, or 0
+    pthread_t thread;
+};
+
+/*
+ * Allocates the slots of a ring.  Returns < 0 if memory is exhausted.
+ */
+static int ring_init(BufferRing *ring, unsigned int size) {
+    ring->slots = calloc(size, sizeof(IOBuffer *));
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->sleeping, 0);
+
+    return ring->slots == NULL ? -1 : 0;
+}
+
+/*
+ * Adds a buffer (or NULL) to a ring, waking the consumer if it sleeps.
+ * Called only by the ring's producer.
+ */
+static void ring_push(BufferRing *ring, IOBuffer *buf) {
+    unsigned int tail = atomic_load_explicit(&ring->tail,
+                                             memory_order_relaxed);
+
+    ring->slots[tail % ring->size] = buf;
+    atomic_store(&ring->tail, tail + 1);
+    if (atomic_load(&ring->sleeping)) {
+        syscall(SYS_futex, &ring->tail, FUTEX_WAKE_PRIVATE, 1, NULL,
+                NULL, 0);
+    }
+}
+
+/*
+ * Removes and returns the next entry from a ring, sleeping while it is
+ * empty.  Called only by the ring's consumer.
+ */
+static IOBuffer *ring_pop(BufferRing *ring) {
+    unsigned int head = atomic_load_explicit(&ring->head,
+                                             memory_order_relaxed);
+    IOBuffer *buf;
+
+    while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+        /* Announce the sleep, then recheck so that a push between the
+         * check above and the futex call is not missed; the futex call
+         * itself returns at once if tail has moved. */
+        atomic_store(&ring->sleeping, 1);
+        if (atomic_load(&ring->tail) == head) {
+            syscall(SYS_futex, &ring->tail, FUTEX_WAIT_PRIVATE, head, NULL,
+                    NULL, 0);
+        }
+        atomic_store(&ring->sleeping, 0);
+    }
+
+    buf = ring->slots[head % ring->size];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return buf;
+}
+
+/*
+ * I/O thread: fills empty buffers until EOF, an error, or a stop
+ * request, then pushes the end marker.  A buffer left empty at EOF is
+ * simply kept; prefetch_stop() frees every buffer.
+ */
+static void *prefetch_thread(void *arg) {
+    Prefetcher *pf = arg;
+    IOBuffer *buf;
+    int result = 1;
+
+    while (result > 0 && (buf = ring_pop(&pf->empty)) != NULL) {
+        iobuffer_consume(buf, iobuffer_length(buf));
+        while (iobuffer_status(buf) != IOBUFFER_FULL) {
+            result = iobuffer_read(buf, pf->fd, SIZE_MAX);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                break;
+            }
+        }
+        if (result < 0) {
+            pf->error = errno;
+        }
+        if (iobuffer_length(buf) > 0) {
+            ring_push(&pf->filled, buf);
+        }
+    }
+    ring_push(&pf->filled, NULL);
+
+    return NULL;
+}
+
+/* Start prefetching a sequential source.
+ *
+ * The I/O thread reads fd into nbuffers IOBuffers, filling each
+ * completely unless it hits EOF.  Two buffers give double buffering;
+ * more absorb variation in read latency.
+ *
+ * This function returns NULL on error.
+ *
+ * fd:       the file descriptor to read, positioned at the start
+ * nbuffers: the number of buffers in circulation, at least 2
+ */
+Prefetcher *prefetch_start(int fd, int nbuffers) {
+    Prefetcher *pf;
+
+    if (nbuffers < 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+    pf = calloc(1, sizeof(Prefetcher));
+    if (pf == NULL) {
+        return NULL;
+    }
+    pf->fd = fd;
+    pf->buffers = calloc(nbuffers, sizeof(IOBuffer *));
+    /* Each ring may hold every buffer plus a NULL marker. */
+    if (pf->buffers == NULL || ring_init(&pf->filled, nbuffers + 1) < 0
+        || ring_init(&pf->empty, nbuffers + 1) < 0) {
+        goto error;
+    }
+    for (pf->nbuffers = 0; pf->nbuffers < nbuffers; pf->nbuffers++) {
+        pf->buffers[pf->nbuffers] = iobuffer_create();
+        if (pf->buffers[pf->nbuffers] == NULL) {
+            goto error;
+        }
+        ring_push(&pf->empty, pf->buffers[pf->nbuffers]);
+    }
+    if (pthread_create(&pf->thread, NULL, prefetch_thread, pf) != 0) {
+        goto error;
+    }
+
+    return pf;
+
+error:
+    for (int i = 0; i < pf->nbuffers; i++) {
+        iobuffer_destroy(pf->buffers[i]);
+    }
+    free(pf->buffers);
+    free(pf->filled.slots);
+    free(pf->empty.slots);
+    free(pf);
+    return NULL;
+}
+
+/*
+ * Returns the next filled buffer, waiting for the I/O thread if
+ * necessary, or NULL at EOF or after a read error.  The consumer may
+ * consume from the buffer but must not read into it, and passes it to
+ * prefetch_release() when finished.  Data left unconsumed at release is
+ * discarded.
+ */
+IOBuffer *prefetch_next(Prefetcher *pf) {
+    IOBuffer *buf;
+
+    if (pf->finished) {
+        return NULL;
+    }
+    buf = ring_pop(&pf->filled);
+    if (buf == NULL) {
+        pf->finished = true;
+    }
+
+    return buf;
+}
+
+/*
+ * Returns a buffer obtained from prefetch_next() for refilling.
+ */
+void prefetch_release(Prefetcher *pf, IOBuffer *buf) {
+    ring_push(&pf->empty, buf);
+}
+
+/*
+ * Stops the I/O thread and frees a prefetcher and its buffers; buffers
+ * still held by the consumer must not be used afterward.  Must be
+ * called from the consumer thread.  Returns 0, or the errno value of a
+ * failed read.
+ */
+int prefetch_stop(Prefetcher *pf) {
+    int error;
+
+    ring_push(&pf->empty, NULL);
+    pthread_join(pf->thread, NULL);
+    error = pf->error;
+
+    for (int i = 0; i < pf->nbuffers; i++) {
+        iobuffer_destroy(pf->buffers[i]);
+    }
+    free(pf->buffers);
+    free(pf->filled.slots);
+    free(pf->empty.slots);
+    free(pf);
+
+    return error;
+}
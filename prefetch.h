@@ -0,0 +1,27 @@
+/* agent <agent@local>
+ * Pipelined prefetching of sequential input into IOBuffers.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in prefetch.c.
+ */
+
+#ifndef PREFETCH_H_
+#define PREFETCH_H_
+
+#include "example.h"
+
+/* Background reader filling IOBuffers ahead of the consumer
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _Prefetcher Prefetcher;
+
+Prefetcher *prefetch_start(int fd, int nbuffers);
+
+IOBuffer *prefetch_next(Prefetcher *pf);
+
+void prefetch_release(Prefetcher *pf, IOBuffer *buf);
+
+int prefetch_stop(Prefetcher *pf);
+
+#endif /* PREFETCH_H_ */
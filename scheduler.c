@@ -0,0 +1,191 @@
+/* agent <agent@local>
+ * Earliest-deadline-first scheduling of ready IOBuffers.
+ *
+ * Ready buffers are kept in a binary min-heap ordered by due time, so
+ * the event loop processes the most urgent buffer first in O(log n)
+ * rather than in arrival order.  A buffer is due at its deadline or
+ * max_delay after it became ready, whichever is sooner.  The second
+ * bound is the starvation protection: bulk work without a deadline, or
+ * with a distant one, still runs within max_delay of becoming ready.
+ *
+ * Times are in any monotonic unit the caller chooses (nanoseconds from
+ * CLOCK_MONOTONIC, for example), as long as it is used consistently.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+
+/* Initial heap capacity; the heap doubles as needed. */
+static const size_t INITIAL_HEAP_SIZE = 64;
+
+/* One ready buffer */
+typedef struct {
+    uint64_t due;       // heap key: min(deadline, ready time + max_delay)
+    uint64_t deadline;  // caller's deadline, for miss accounting
+    uint64_t seq;       // arrival order, to break ties first-come
+    IOBuffer *buf;
+} SchedEntry;
+
+/* Deadline-ordered queue of ready IOBuffers */
+struct _Scheduler {
+    SchedEntry *heap;
+    size_t count;
+    size_t size;
+    uint64_t max_delay;
+    uint64_t seq;
+    unsigned long misses;
+};
+
+/*
+ * Returns true if entry a should run before entry b.
+ */
+static bool entry_before(const SchedEntry *a, const SchedEntry *b) {
+    if (a->due != b->due) {
+        return a->due < b->due;
+    }
+    return a->seq < b->seq;
+}
+
+/*
+ * Allocates an empty scheduler, or returns NULL if memory is exhausted.
+ *
+ * max_delay: the longest any buffer waits once ready, in the caller's
+ *            time unit, regardless of its deadline
+ */
+Scheduler *scheduler_create(uint64_t max_delay) {
+    Scheduler *sched = malloc(sizeof(Scheduler));
+
+    if (sched == NULL) {
+        return NULL;
+    }
+    sched->heap = malloc(INITIAL_HEAP_SIZE * sizeof(SchedEntry));
+    if (sched->heap == NULL) {
+        free(sched);
+        return NULL;
+    }
+    sched->count = 0;
+    sched->size = INITIAL_HEAP_SIZE;
+    sched->max_delay = max_delay;
+    sched->seq = 0;
+    sched->misses = 0;
+
+    return sched;
+}
+
+/*
+ * Frees a scheduler.  Buffers still queued are not destroyed.
+ */
+void scheduler_destroy(Scheduler *sched) {
+    if (sched != NULL) {
+        free(sched->heap);
+        free(sched);
+    }
+}
+
+/* Queue a ready buffer.
+ *
+ * This function returns < 0 if memory is exhausted, or 0 on success.
+ *
+ * sched:    the scheduler
+ * buf:      the buffer with data ready to process
+ * deadline: when the buffer's data must be processed, or
+ *           SCHEDULER_NO_DEADLINE
+ * now:      the current time
+ */
+int scheduler_push(Scheduler *sched, IOBuffer *buf, uint64_t deadline,
+                   uint64_t now) {
+    SchedEntry entry;
+    SchedEntry *heap;
+    size_t child;
+    size_t parent;
+
+    if (sched->count == sched->size) {
+        heap = realloc(sched->heap, 2 * sched->size * sizeof(SchedEntry));
+        if (heap == NULL) {
+            return -1;
+        }
+        sched->heap = heap;
+        sched->size *= 2;
+    }
+
+    /* Saturate, so a huge max_delay means "never" rather than wrapping
+     * around to a time in the past. */
+    if (sched->max_delay > UINT64_MAX - now) {
+        entry.due = UINT64_MAX;
+    } else {
+        entry.due = now + sched->max_delay;
+    }
+    if (deadline != SCHEDULER_NO_DEADLINE && deadline < entry.due) {
+        entry.due = deadline;
+    }
+    entry.deadline = deadline;
+    entry.seq = sched->seq++;
+    entry.buf = buf;
+
+    /* Sift the new entry up from the end of the heap. */
+    child = sched->count++;
+    while (child > 0) {
+        parent = (child - 1) / 2;
+        if (!entry_before(&entry, &sched->heap[parent])) {
+            break;
+        }
+        sched->heap[child] = sched->heap[parent];
+        child = parent;
+    }
+    sched->heap[child] = entry;
+
+    return 0;
+}
+
+/*
+ * Removes and returns the most urgent queued buffer, or NULL if none
+ * is queued.  If the buffer's deadline has already passed at now, it is
+ * counted as a miss.
+ */
+IOBuffer *scheduler_pop(Scheduler *sched, uint64_t now) {
+    SchedEntry top;
+    SchedEntry last;
+    size_t parent = 0;
+    size_t child;
+
+    if (sched->count == 0) {
+        return NULL;
+    }
+    top = sched->heap[0];
+    last = sched->heap[--sched->count];
+
+    /* Sift the former last entry down from the root. */
+    while ((child = 2 * parent + 1) < sched->count) {
+        if (child + 1 < sched->count
+            && entry_before(&sched->heap[child + 1], &sched->heap[child])) {
+            child++;
+        }
+        if (!entry_before(&sched->heap[child], &last)) {
+            break;
+        }
+        sched->heap[parent] = sched->heap[child];
+        parent = child;
+    }
+    sched->heap[parent] = last;
+
+    if (top.deadline != SCHEDULER_NO_DEADLINE && now > top.deadline) {
+        sched->misses++;
+    }
+
+    return top.buf;
+}
+
+/*
+ * Returns the number of buffers queued.
+ */
+size_t scheduler_pending(Scheduler *sched) {
+    return sched->count;
+}
+
+/*
+ * Returns the number of buffers popped after their deadline.
+ */
+unsigned long scheduler_misses(Scheduler *sched) {
+    return sched->misses;
+}
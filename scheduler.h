@@ -0,0 +1,38 @@
+/* agent <agent@local>
+ * Earliest-deadline-first scheduling of ready IOBuffers.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in scheduler.c.
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "example.h"
+
+/* Deadline value meaning that a piece of work has no deadline */
+#define SCHEDULER_NO_DEADLINE 0
+
+/* Deadline-ordered queue of ready IOBuffers
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _Scheduler Scheduler;
+
+Scheduler *scheduler_create(uint64_t max_delay);
+
+void scheduler_destroy(Scheduler *sched);
+
+int scheduler_push(Scheduler *sched, IOBuffer *buf, uint64_t deadline,
+                   uint64_t now);
+
+IOBuffer *scheduler_pop(Scheduler *sched, uint64_t now);
+
+size_t scheduler_pending(Scheduler *sched);
+
+unsigned long scheduler_misses(Scheduler *sched);
+
+#endif /* SCHEDULER_H_ */
@@ -0,0 +1,154 @@
+/* agent <agent@local>
+ * Decoders generated from declarative fixed-layout message schemas.
+ *
+ * A message layout is declared once as a list of fields, each with a
+ * name, an integer type, and a wire byte order (big or little):
+ *
+ *     #define ORDER_FIELDS(F)          \
+ *         F(id,       uint32_t, big)   \
+ *         F(quantity, uint16_t, little) \
+ *         F(price,    int64_t,  big)
+ *
+ *     SCHEMA_DEFINE(Order, order, ORDER_FIELDS)
+ *
+ * SCHEMA_DEFINE then generates the message type Order, holding the
+ * decoded fields in host order, and these functions:
+ *
+ *     void order_load(const char *data, Order *msg);
+ *     int order_decode(IOBuffer *buf, Order *msg);
+ *     int order_decode_many(IOBuffer *buf, Order *msgs, int max);
+ *
+ * order_load() decodes one message from data without any bounds check.
+ * order_decode() checks the length of buf once, decodes one message
+ * from its contents, and consumes it, returning 1, or returns 0 if a
+ * whole message has not arrived yet.  order_decode_many() does the same
+ * for up to max back-to-back messages with a single check, returning
+ * the number decoded.
+ *
+ * All offsets and sizes are constants, so the compiler sees every field
+ * load as a fixed-size load at a fixed offset.  Each one becomes a
+ * single (possibly unaligned) load plus a byte swap only where the wire
+ * order differs from the host's.  No loops or per-field checks are left
+ * at run time.
+ *
+ * This file has no corresponding .c file; everything in it is a macro
+ * or a static inline function.
+ */
+
+#ifndef SCHEMA_H_
+#define SCHEMA_H_
+
+#include <endian.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "example.h"
+
+/*
+ * Loads an n-byte big-endian unsigned integer from p.  n is a constant
+ * at every call site, so the switch is resolved at compile time.
+ */
+static inline uint64_t schema_load_big(const char *p, size_t n) {
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    switch (n) {
+    case 1:
+        return (unsigned char)p[0];
+    case 2:
+        memcpy(&v16, p, sizeof(v16));
+        return be16toh(v16);
+    case 4:
+        memcpy(&v32, p, sizeof(v32));
+        return be32toh(v32);
+    default:
+        memcpy(&v64, p, sizeof(v64));
+        return be64toh(v64);
+    }
+}
+
+/*
+ * Loads an n-byte little-endian unsigned integer from p.
+ */
+static inline uint64_t schema_load_little(const char *p, size_t n) {
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    switch (n) {
+    case 1:
+        return (unsigned char)p[0];
+    case 2:
+        memcpy(&v16, p, sizeof(v16));
+        return le16toh(v16);
+    case 4:
+        memcpy(&v32, p, sizeof(v32));
+        return le32toh(v32);
+    default:
+        memcpy(&v64, p, sizeof(v64));
+        return le64toh(v64);
+    }
+}
+
+/* Field expanders used by SCHEMA_DEFINE.  Fields must be 1, 2, 4, or
+ * 8 byte integer types. */
+#define SCHEMA_MEMBER(name, type, order) type name;
+#define SCHEMA_WIRE(name, type, order) char name[sizeof(type)];
+#define SCHEMA_LOAD(name, type, order)                                  \
+    msg->name = (type)schema_load_##order(data + offsetof(SchemaWire, name), \
+                                          sizeof(type));
+#define SCHEMA_CHECK(name, type, order)                                 \
+    _Static_assert(sizeof(type) == 1 || sizeof(type) == 2               \
+                   || sizeof(type) == 4 || sizeof(type) == 8,           \
+                   "schema field " #name " has an unsupported size");
+
+/* Generate the message type Type, its wire layout Type##Wire (whose
+ * size is the size of a message on the wire), and the decoding
+ * functions prefix##_load(), prefix##_decode(), and
+ * prefix##_decode_many().  See the top of this file. */
+#define SCHEMA_DEFINE(Type, prefix, FIELDS)                             \
+    FIELDS(SCHEMA_CHECK)                                                \
+                                                                        \
+    typedef struct {                                                    \
+        FIELDS(SCHEMA_MEMBER)                                           \
+    } Type;                                                             \
+                                                                        \
+    typedef struct {                                                    \
+        FIELDS(SCHEMA_WIRE)                                             \
+    } Type##Wire;                                                       \
+                                                                        \
+    static inline void prefix##_load(const char *data, Type *msg) {     \
+        typedef Type##Wire SchemaWire;                                  \
+                                                                        \
+        FIELDS(SCHEMA_LOAD)                                             \
+    }                                                                   \
+                                                                        \
+    static inline int prefix##_decode(IOBuffer *buf, Type *msg) {       \
+        if (iobuffer_length(buf) < sizeof(Type##Wire)) {                \
+            return 0;                                                   \
+        }                                                               \
+        prefix##_load(iobuffer_data(buf), msg);                         \
+        iobuffer_consume(buf, sizeof(Type##Wire));                      \
+                                                                        \
+        return 1;                                                       \
+    }                                                                   \
+                                                                        \
+    static inline int prefix##_decode_many(IOBuffer *buf, Type *msgs,   \
+                                           int max) {                   \
+        size_t count = iobuffer_length(buf) / sizeof(Type##Wire);       \
+        const char *data = iobuffer_data(buf);                          \
+                                                                        \
+        if (count > (size_t)max) {                                      \
+            count = max;                                                \
+        }                                                               \
+        for (size_t i = 0; i < count; i++) {                            \
+            prefix##_load(data + i * sizeof(Type##Wire), &msgs[i]);     \
+        }                                                               \
+        iobuffer_consume(buf, count * sizeof(Type##Wire));              \
+                                                                        \
+        return count;                                                   \
+    }
+
+#endif /* SCHEMA_H_ */
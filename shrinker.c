@@ -0,0 +1,303 @@
+/* agent <agent@local>
+ * Memory-pressure-driven shrinking of IOBuffer memory.
+ *
+ * IOBuffer pools keep storage around after a burst so that the next
+ * burst does not pay for mmap().  Under memory pressure that cache is
+ * exactly what the kernel would like back.  A Shrinker watches one of
+ * three pressure sources:
+ *
+ *  - a PSI trigger on /proc/pressure/memory, which becomes readable
+ *    (POLLPRI) when memory stalls exceed a threshold,
+ *  - a cgroup v2 memory.events file, whose high, max, and oom counters
+ *    rise as the cgroup hits its limits, or
+ *  - a simulated source set by shrinker_simulate(), for tests.
+ *
+ * When pressure starts, idle pool storage is unmapped, the application
+ * is told to shrink its idle buffers, and shrinker_admit() starts
+ * refusing reads into empty buffers.  Once no pressure event has been
+ * seen for RELAX_DELAY_MS, those restrictions are lifted.
+ */
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shrinker.h"
+
+/* Default PSI trigger file */
+static const char *const PSI_MEMORY = "/proc/pressure/memory";
+
+/* Time without pressure events before restrictions are lifted.  Long
+ * enough that a workload oscillating around its limit is not allowed
+ * to regrow its pools between events. */
+static const long RELAX_DELAY_MS = 10000;
+
+/* Idle storage blocks each pool may keep while under pressure */
+static const int PRESSURE_POOL_KEEP = 0;
+
+/* Size of the buffer for reading memory.events, which is a handful of
+ * short lines.  This is an array size, and so must be a #define. */
+#define EVENTS_BUFSIZE 512
+
+/* Where pressure events come from */
+typedef enum {
+    SOURCE_PSI,
+    SOURCE_CGROUP,
+    SOURCE_SIMULATED
+} PressureSource;
+
+/* Memory pressure monitor */
+struct _Shrinker {
+    PressureSource source;
+    int fd;                        // PSI trigger or memory.events, or -1
+    unsigned long long events;     // last sum of memory.events counters
+    bool pressure;
+    bool simulated_event;          // set by shrinker_simulate()
+    long last_event_ms;
+    ShrinkerCallback callback;
+    void *arg;
+};
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in milliseconds.
+ */
+static long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Allocates a shrinker for a given source with no event file.
+ */
+static Shrinker *shrinker_alloc(PressureSource source) {
+    Shrinker *sh = malloc(sizeof(Shrinker));
+
+    if (sh == NULL) {
+        return NULL;
+    }
+    sh->source = source;
+    sh->fd = -1;
+    sh->events = 0;
+    sh->pressure = false;
+    sh->simulated_event = false;
+    sh->last_event_ms = 0;
+    sh->callback = NULL;
+    sh->arg = NULL;
+
+    return sh;
+}
+
+/*
+ * Reads a cgroup memory.events file and returns the sum of its high,
+ * max, and oom counters, or 0 if it cannot be read.
+ */
+static unsigned long long read_cgroup_events(int fd) {
+    char text[EVENTS_BUFSIZE];
+    unsigned long long total = 0;
+    unsigned long long value;
+    char name[32];
+    char *line;
+    int len;
+
+    len = pread(fd, text, sizeof(text) - 1, 0);
+    if (len <= 0) {
+        return 0;
+    }
+    text[len] = '\0';
+
+    for (line = text; line != NULL && *line != '\0'; ) {
+        if (sscanf(line, "%31s %llu", name, &value) == 2
+            && (strcmp(name, "high") == 0 || strcmp(name, "max") == 0
+                || strcmp(name, "oom") == 0)) {
+            total += value;
+        }
+        line = strchr(line, '\n');
+        if (line != NULL) {
+            line++;
+        }
+    }
+
+    return total;
+}
+
+/* Create a shrinker driven by a PSI memory trigger.
+ *
+ * This function returns NULL on error, e.g. if the kernel lacks PSI or
+ * the caller may not create triggers.
+ *
+ * path:      the PSI file, or NULL for /proc/pressure/memory; a cgroup's
+ *            memory.pressure file also works
+ * stall_us:  stall time within a window that counts as pressure
+ * window_us: the PSI tracking window
+ */
+Shrinker *shrinker_create_psi(const char *path, unsigned int stall_us,
+                              unsigned int window_us) {
+    Shrinker *sh = shrinker_alloc(SOURCE_PSI);
+    char trigger[64];
+    int len;
+
+    if (sh == NULL) {
+        return NULL;
+    }
+    sh->fd = open(path != NULL ? path : PSI_MEMORY,
+                  O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (sh->fd < 0) {
+        free(sh);
+        return NULL;
+    }
+    len = snprintf(trigger, sizeof(trigger), "some %u %u", stall_us,
+                   window_us);
+    if (write(sh->fd, trigger, len + 1) < 0) {
+        shrinker_destroy(sh);
+        return NULL;
+    }
+
+    return sh;
+}
+
+/*
+ * Creates a shrinker driven by the counters in a cgroup v2
+ * memory.events file.  Returns NULL if the file cannot be opened.
+ */
+Shrinker *shrinker_create_cgroup(const char *path) {
+    Shrinker *sh = shrinker_alloc(SOURCE_CGROUP);
+
+    if (sh == NULL) {
+        return NULL;
+    }
+    sh->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (sh->fd < 0) {
+        free(sh);
+        return NULL;
+    }
+    sh->events = read_cgroup_events(sh->fd);
+
+    return sh;
+}
+
+/*
+ * Creates a shrinker whose pressure is set with shrinker_simulate().
+ */
+Shrinker *shrinker_create_simulated(void) {
+    return shrinker_alloc(SOURCE_SIMULATED);
+}
+
+/*
+ * Frees a shrinker and closes its event file.
+ */
+void shrinker_destroy(Shrinker *sh) {
+    if (sh == NULL) {
+        return;
+    }
+    if (sh->fd >= 0) {
+        close(sh->fd);
+    }
+    free(sh);
+}
+
+/*
+ * Sets the function called when pressure starts or clears.
+ */
+void shrinker_set_callback(Shrinker *sh, ShrinkerCallback callback,
+                           void *arg) {
+    sh->callback = callback;
+    sh->arg = arg;
+}
+
+/*
+ * Returns a descriptor that becomes ready (POLLPRI) when a pressure
+ * event may have occurred, or -1 for a simulated source.  Event loops
+ * should call shrinker_poll() when it is ready, and also periodically
+ * so that pressure can be seen to clear.
+ */
+int shrinker_fd(Shrinker *sh) {
+    return sh->fd;
+}
+
+/*
+ * Returns true if a pressure event has occurred since the last check.
+ */
+static bool pressure_event(Shrinker *sh) {
+    struct pollfd pfd = { .fd = sh->fd, .events = POLLPRI };
+    unsigned long long events;
+    bool event;
+
+    switch (sh->source) {
+    case SOURCE_PSI:
+        return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLPRI);
+    case SOURCE_CGROUP:
+        events = read_cgroup_events(sh->fd);
+        event = events > sh->events;
+        sh->events = events;
+        return event;
+    case SOURCE_SIMULATED:
+        event = sh->simulated_event;
+        sh->simulated_event = false;
+        return event;
+    }
+
+    return false;
+}
+
+/* Check for pressure and apply or relax restrictions.
+ *
+ * On the transition into pressure, idle pool storage is unmapped and
+ * the callback is called with true.  After RELAX_DELAY_MS without an
+ * event, the callback is called with false.
+ *
+ * This function returns true if memory is under pressure.
+ */
+bool shrinker_poll(Shrinker *sh) {
+    long now = now_ms();
+
+    if (pressure_event(sh)) {
+        sh->last_event_ms = now;
+        if (!sh->pressure) {
+            sh->pressure = true;
+            if (sh->callback != NULL) {
+                sh->callback(sh->arg, true);
+            }
+        }
+        /* Trim on every event; pools refill as buffers are released. */
+        iobuffer_pool_trim(PRESSURE_POOL_KEEP);
+    } else if (sh->pressure && now - sh->last_event_ms >= RELAX_DELAY_MS) {
+        sh->pressure = false;
+        if (sh->callback != NULL) {
+            sh->callback(sh->arg, false);
+        }
+    }
+
+    return sh->pressure;
+}
+
+/*
+ * Sets the state of a simulated pressure source.  Raising pressure
+ * produces one event at the next shrinker_poll(); clearing it lifts
+ * restrictions there immediately rather than after RELAX_DELAY_MS.
+ */
+void shrinker_simulate(Shrinker *sh, bool pressure) {
+    if (sh->source != SOURCE_SIMULATED) {
+        return;
+    }
+    sh->simulated_event = pressure;
+    if (!pressure) {
+        sh->last_event_ms = now_ms() - RELAX_DELAY_MS;
+    }
+}
+
+/*
+ * Returns true if the application should read into a given buffer now.
+ * Under pressure, reads into empty buffers are deferred, since anything
+ * beyond the buffer's small inline storage would take a new block from
+ * the pool; buffers already holding data may continue so that partial
+ * messages can complete and be released.
+ */
+bool shrinker_admit(Shrinker *sh, IOBuffer *buf) {
+    return !sh->pressure || iobuffer_status(buf) != IOBUFFER_EMPTY;
+}
@@ -0,0 +1,45 @@
+/* agent <agent@local>
+ * Memory-pressure-driven shrinking of IOBuffer memory.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in shrinker.c.
+ */
+
+#ifndef SHRINKER_H_
+#define SHRINKER_H_
+
+#include <stdbool.h>
+
+#include "example.h"
+
+/* Memory pressure monitor
+ *
+ * The internal fields of this structure are private.
+ */
+typedef struct _Shrinker Shrinker;
+
+/* Called when pressure starts (true) or clears (false), so that the
+ * application can iobuffer_shrink() its idle buffers. */
+typedef void (*ShrinkerCallback)(void *arg, bool pressure);
+
+Shrinker *shrinker_create_psi(const char *path, unsigned int stall_us,
+                              unsigned int window_us);
+
+Shrinker *shrinker_create_cgroup(const char *path);
+
+Shrinker *shrinker_create_simulated(void);
+
+void shrinker_destroy(Shrinker *sh);
+
+void shrinker_set_callback(Shrinker *sh, ShrinkerCallback callback,
+                           void *arg);
+
+int shrinker_fd(Shrinker *sh);
+
+bool shrinker_poll(Shrinker *sh);
+
+void shrinker_simulate(Shrinker *sh, bool pressure);
+
+bool shrinker_admit(Shrinker *sh, IOBuffer *buf);
+
+#endif /* SHRINKER_H_ */
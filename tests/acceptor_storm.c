@@ -0,0 +1,203 @@
+/* agent <agent@local>
+ * Connection-storm test for the batched acceptor.
+ *
+ * A client thread opens and closes connections to a loopback listener
+ * as fast as it can while the main thread accepts them with
+ * acceptor_drain(), and the accept rate is printed.  Then the process
+ * is left without spare descriptors while clients wait in the backlog,
+ * and the test checks that acceptor_drain() sheds them with the
+ * table's spare descriptor instead of leaving them to keep the
+ * listening socket readable.
+ *
+ * Build from the top of the tree with:
+ *   gcc -O2 -pthread -I. tests/acceptor_storm.c acceptor.c example.c \
+ *       epoch.c
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "acceptor.h"
+
+/* Connections accepted per acceptor_drain() call; an array size */
+#define BATCH 64
+
+/* Clients left waiting when descriptors run out; an array size */
+#define STRANDED 32
+
+/* Connections opened in the storm */
+static const int STORM = 10000;
+
+static struct sockaddr_in server;
+
+/*
+ * Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns a socket connected to the server, or -1.
+ */
+static int client_connect(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Opens and closes STORM connections to the server.
+ */
+static void *storm(void *arg) {
+    int fd;
+
+    for (int i = 0; i < STORM; i++) {
+        fd = client_connect();
+        if (fd < 0) {
+            perror("connect");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/*
+ * Accepts the storm and returns the number of connections accepted.
+ */
+static int run_storm(int listenfd, ConnectionTable *table) {
+    struct pollfd pfd = { listenfd, POLLIN, 0 };
+    int fds[BATCH];
+    pthread_t thread;
+    double start;
+    int accepted = 0;
+    int n;
+
+    pthread_create(&thread, NULL, storm, NULL);
+    start = now();
+    while (accepted < STORM) {
+        if (poll(&pfd, 1, 1000) <= 0) {
+            break;
+        }
+        n = acceptor_drain(listenfd, table, fds, BATCH);
+        if (n < 0) {
+            perror("acceptor_drain");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            conntable_close(table, fds[i]);
+        }
+        accepted += n;
+    }
+    printf("storm: %d connections, %.0f accepts/s\n", accepted,
+           accepted / (now() - start));
+    pthread_join(thread, NULL);
+
+    return accepted;
+}
+
+/*
+ * Leaves STRANDED clients in the backlog with no descriptors to spare
+ * and returns the number of problems found.
+ */
+static int run_stranded(int listenfd, ConnectionTable *table) {
+    int clients[STRANDED];
+    int fds[BATCH];
+    struct rlimit saved;
+    struct rlimit tight;
+    int accepted;
+    int shed = 0;
+    int problems = 0;
+    int top = listenfd;
+    char byte;
+
+    for (int i = 0; i < STRANDED; i++) {
+        clients[i] = client_connect();
+        if (clients[i] < 0) {
+            perror("connect");
+            return 1;
+        }
+        top = clients[i] > top ? clients[i] : top;
+    }
+
+    /* Room for one accepted connection, then EMFILE. */
+    getrlimit(RLIMIT_NOFILE, &saved);
+    tight = saved;
+    tight.rlim_cur = top + 2;
+    setrlimit(RLIMIT_NOFILE, &tight);
+    accepted = acceptor_drain(listenfd, table, fds, BATCH);
+    if (accepted < 0 || acceptor_drain(listenfd, table, fds, BATCH) != 0) {
+        problems++;  // the backlog was not emptied
+    }
+    setrlimit(RLIMIT_NOFILE, &saved);
+
+    for (int i = 0; i < STRANDED; i++) {
+        if (recv(clients[i], &byte, 1, MSG_DONTWAIT) == 0) {
+            shed++;
+        }
+        close(clients[i]);
+    }
+    for (int i = 0; i < accepted; i++) {
+        conntable_close(table, fds[i]);
+    }
+    printf("stranded: %d accepted, %d shed of %d\n", accepted, shed,
+           STRANDED);
+    if (accepted + shed != STRANDED || shed == 0) {
+        problems++;
+    }
+
+    return problems;
+}
+
+int main(void) {
+    socklen_t len = sizeof(server);
+    ConnectionTable *table;
+    int listenfd;
+    int failed = 0;
+
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listenfd < 0
+        || bind(listenfd, (struct sockaddr *)&server, sizeof(server)) < 0
+        || listen(listenfd, 1024) < 0
+        || getsockname(listenfd, (struct sockaddr *)&server, &len) < 0) {
+        perror("listen");
+        return EXIT_FAILURE;
+    }
+    table = conntable_create();
+    if (table == NULL) {
+        perror("conntable_create");
+        return EXIT_FAILURE;
+    }
+
+    if (run_storm(listenfd, table) != STORM) {
+        failed++;
+    }
+    failed += run_stranded(listenfd, table);
+
+    conntable_destroy(table);
+    close(listenfd);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,119 @@
+/* agent <agent@local>
+ * Benchmark of erasure encoding and reconstruction.
+ *
+ * A 10+4 code is encoded over shards of SHARD_BYTES, and then the first
+ * four data shards are dropped and rebuilt, and the throughput of each
+ * is printed in GB/s of data shards.  The kernels are chosen when
+ * erasure.c is compiled, so build it once per instruction set to
+ * compare them:
+ *
+ *   scalar: gcc -O2 -pthread -I. tests/erasure_bench.c erasure.c \
+ *               example.c epoch.c
+ *   SSSE3:  add -mssse3
+ *   AVX2:   add -mavx2
+ *   GFNI:   add -mavx2 -mgfni
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "erasure.h"
+
+/* Data shards in the code; an array size */
+#define K 10
+
+/* Parity shards in the code; an array size */
+#define M 4
+
+/* Bytes per shard */
+static const size_t SHARD_BYTES = 64 << 10;
+
+/* Data bytes encoded or reconstructed per run */
+static const size_t TOTAL_BYTES = (size_t)1 << 30;
+
+static const int RUNS = 3;
+
+/*
+ * Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns the name of the kernels erasure.c was built with, assuming
+ * it was built with the same flags as this file.
+ */
+static const char *kernel(void) {
+#if defined(__GFNI__) && defined(__AVX2__)
+    return "GFNI";
+#elif defined(__AVX2__)
+    return "AVX2";
+#elif defined(__SSSE3__)
+    return "SSSE3";
+#else
+    return "scalar";
+#endif
+}
+
+int main(void) {
+    ErasureCode *ec = erasure_create(K, M);
+    char *shards[K + M];
+    bool present[K + M];
+    size_t rounds = TOTAL_BYTES / (K * SHARD_BYTES);
+    double encode = 0;
+    double rebuild = 0;
+    double start;
+    double rate;
+
+    if (ec == NULL) {
+        perror("erasure_create");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < K + M; i++) {
+        shards[i] = malloc(SHARD_BYTES);
+        if (shards[i] == NULL) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+        for (size_t j = 0; j < SHARD_BYTES; j++) {
+            shards[i][j] = (char)rand();
+        }
+        present[i] = i >= M;
+    }
+
+    for (int r = 0; r < RUNS; r++) {
+        start = now();
+        for (size_t i = 0; i < rounds; i++) {
+            erasure_encode(ec, shards, shards + K, SHARD_BYTES);
+        }
+        rate = rounds * K * SHARD_BYTES / (now() - start) / 1e9;
+        encode = rate > encode ? rate : encode;
+
+        start = now();
+        for (size_t i = 0; i < rounds; i++) {
+            if (erasure_reconstruct(ec, shards, present,
+                                    SHARD_BYTES) < 0) {
+                perror("erasure_reconstruct");
+                return EXIT_FAILURE;
+            }
+        }
+        rate = rounds * K * SHARD_BYTES / (now() - start) / 1e9;
+        rebuild = rate > rebuild ? rate : rebuild;
+    }
+    printf("%s %d+%d, %zu KiB shards\n", kernel(), K, M,
+           SHARD_BYTES >> 10);
+    printf("encode:      %6.2f GB/s\n", encode);
+    printf("reconstruct: %6.2f GB/s\n", rebuild);
+
+    for (int i = 0; i < K + M; i++) {
+        free(shards[i]);
+    }
+    erasure_destroy(ec);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,193 @@
+/* agent <agent@local>
+ * Regression test for the ordering of merged records.
+ *
+ * Several inputs of individually sorted timestamps are fed to a merger
+ * in random pieces, in random order, and the output is checked to be
+ * sorted wherever the merger did not count a record as late.  With a
+ * lateness bound larger than any timestamp, no record may be late, so
+ * the output must be sorted throughout.
+ *
+ * A further run gives one input a line longer than an IOBuffer, made of
+ * digits so that any piece of it parsed as a record would have a wild
+ * timestamp, and checks that the line is dropped whole.
+ *
+ * Build from the top of the tree with:
+ *   gcc -pthread -I. tests/merge_test.c merge.c example.c epoch.c
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "merge.h"
+
+/* Inputs per run and records per input; array sizes */
+#define MAX_INPUTS 5
+#define RECORDS 200
+
+/* Length of the oversized line, longer than an IOBuffer; an array size */
+#define LONG_LINE 20000
+
+static const int RUNS = 2000;
+
+/*
+ * Returns the decimal timestamp at the start of a record.
+ */
+static uint64_t record_key(const char *record, size_t len, void *arg) {
+    uint64_t key = 0;
+
+    for (size_t i = 0; i < len && record[i] >= '0' && record[i] <= '9';
+         i++) {
+        key = key * 10 + (record[i] - '0');
+    }
+    return key;
+}
+
+/*
+ * Appends the emitted records in out to keys, consuming them.
+ */
+static void collect(IOBuffer *out, uint64_t *keys, int *nkeys) {
+    char *data = iobuffer_data(out);
+    size_t length = iobuffer_length(out);
+    char *newline;
+
+    while ((newline = memchr(data, '\n', length)) != NULL) {
+        keys[(*nkeys)++] = record_key(data, newline - data, NULL);
+        length -= newline - data + 1;
+        data = newline + 1;
+    }
+    iobuffer_consume(out, iobuffer_length(out) - length);
+}
+
+/*
+ * Runs one random merge and returns the number of records found out of
+ * order, less those the merger counted as late.
+ */
+static long run(uint64_t lateness) {
+    static char text[MAX_INPUTS][RECORDS * 8];
+    static uint64_t keys[MAX_INPUTS * RECORDS];
+    size_t len[MAX_INPUTS];
+    size_t fed[MAX_INPUTS] = { 0 };
+    int k = 1 + rand() % MAX_INPUTS;
+    IOBuffer *out = iobuffer_create();
+    Merger *m = merger_create(k, lateness, record_key, NULL);
+    uint64_t t;
+    size_t bytes;
+    int nkeys = 0;
+    int i;
+    long unordered = 0;
+
+    for (i = 0; i < k; i++) {
+        t = 0;
+        len[i] = 0;
+        for (int r = 0; r < RECORDS; r++) {
+            t += rand() % 20;
+            len[i] += sprintf(text[i] + len[i], "%" PRIu64 "\n", t);
+        }
+    }
+
+    while (!merger_done(m)) {
+        i = rand() % k;
+        bytes = 1 + rand() % 16;
+        if (bytes > len[i] - fed[i]) {
+            bytes = len[i] - fed[i];
+        }
+        if (bytes > 0
+            && iobuffer_append(merger_input(m, i), text[i] + fed[i],
+                               bytes) == 0) {
+            fed[i] += bytes;
+            merger_update(m, i);
+        } else if (fed[i] == len[i]) {
+            merger_input_eof(m, i);
+        }
+        merger_emit(m, out);
+        collect(out, keys, &nkeys);
+    }
+
+    for (i = 1; i < nkeys; i++) {
+        if (keys[i] < keys[i - 1]) {
+            unordered++;
+        }
+    }
+    unordered -= merger_late(m);
+    if (nkeys != k * RECORDS) {
+        unordered++;
+    }
+    merger_destroy(m);
+    iobuffer_destroy(out);
+
+    return unordered;
+}
+
+/*
+ * Merges two inputs, one of which holds a line too long for its buffer,
+ * and returns the number of problems found.
+ */
+static long run_oversized(void) {
+    static char text[2][LONG_LINE + 64];
+    static uint64_t keys[64];
+    size_t len[2];
+    size_t fed[2] = { 0 };
+    IOBuffer *out = iobuffer_create();
+    Merger *m = merger_create(2, UINT64_MAX, record_key, NULL);
+    size_t bytes;
+    int nkeys = 0;
+    long problems = 0;
+
+    len[0] = sprintf(text[0], "2\n4\n6\n8\n10\n12\n");
+    len[1] = sprintf(text[1], "1\n5\n");
+    memset(text[1] + len[1], '7', LONG_LINE);
+    len[1] += LONG_LINE;
+    len[1] += sprintf(text[1] + len[1], "\n9\n11\n");
+
+    while (!merger_done(m)) {
+        for (int i = 0; i < 2; i++) {
+            /* Halve the piece until it fits, so the buffer can fill. */
+            bytes = len[i] - fed[i] < 1000 ? len[i] - fed[i] : 1000;
+            while (bytes > 0
+                   && iobuffer_append(merger_input(m, i), text[i] + fed[i],
+                                      bytes) < 0) {
+                bytes /= 2;
+            }
+            if (bytes > 0) {
+                fed[i] += bytes;
+                merger_update(m, i);
+            } else if (fed[i] == len[i]) {
+                merger_input_eof(m, i);
+            }
+        }
+        merger_emit(m, out);
+        collect(out, keys, &nkeys);
+    }
+
+    for (int i = 1; i < nkeys; i++) {
+        if (keys[i] < keys[i - 1]) {
+            problems++;
+        }
+    }
+    if (nkeys != 10 || merger_oversized(m) != 1 || merger_late(m) != 0) {
+        problems++;
+    }
+    merger_destroy(m);
+    iobuffer_destroy(out);
+
+    return problems;
+}
+
+int main(void) {
+    int failed = 0;
+
+    srand(1);
+    for (int i = 0; i < RUNS; i++) {
+        if (run(UINT64_MAX) != 0 || run(rand() % 50) > 0) {
+            failed++;
+        }
+    }
+    printf("%d of %d runs out of order\n", failed, RUNS);
+    if (run_oversized() != 0) {
+        printf("oversized line not dropped cleanly\n");
+        failed++;
+    }
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
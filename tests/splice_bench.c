@@ -0,0 +1,138 @@
+/* agent <agent@local>
+ * Benchmark of iobuffer_splice() against write() into a pipe.
+ *
+ * A writer fills IOBuffers and sends them into a pipe, which a reader
+ * thread drains with read().  It is run once with write() and once with
+ * iobuffer_splice(), which gifts each full buffer's pages to the kernel
+ * with vmsplice() and gives the buffer a freshly mapped block, and the
+ * throughput of each is printed in MB/s.  Filling the buffers costs the
+ * same in both runs; the difference is the copy that write() makes
+ * against the unmap and map of every gifted block.
+ *
+ * Build from the top of the tree with:
+ *   gcc -O2 -pthread -I. tests/splice_bench.c example.c epoch.c
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "example.h"
+
+/* Bytes per buffer, the size of a full IOBuffer; an array size */
+#define BUFFER_BYTES 8192
+
+/* Bytes the reader takes per read(); an array size */
+#define READ_BYTES 65536
+
+/* Bytes sent through the pipe per run */
+static const size_t TOTAL_BYTES = (size_t)1 << 30;
+
+static const int RUNS = 3;
+
+/*
+ * Reads and discards everything from a pipe until EOF.
+ */
+static void *reader(void *arg) {
+    static char sink[READ_BYTES];
+    int fd = *(int *)arg;
+
+    while (read(fd, sink, sizeof(sink)) > 0) {
+        continue;
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Sends TOTAL_BYTES through a pipe to a reader thread and returns the
+ * throughput in MB/s, or < 0 on error.
+ */
+static double run(bool splice) {
+    static char pattern[BUFFER_BYTES];
+    IOBufferSplicer *sp = NULL;
+    IOBuffer *buf = iobuffer_create();
+    pthread_t thread;
+    size_t done = 0;
+    double start;
+    double elapsed;
+    int pipefd[2];
+    int result = 0;
+
+    if (buf == NULL || pipe(pipefd) < 0) {
+        return -1;
+    }
+    if (splice && (sp = iobuffer_splicer_create(pipefd[1])) == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < BUFFER_BYTES; i++) {
+        pattern[i] = (char)rand();
+    }
+    pthread_create(&thread, NULL, reader, &pipefd[0]);
+
+    start = now();
+    while (done < TOTAL_BYTES && result >= 0) {
+        if (iobuffer_append(buf, pattern, BUFFER_BYTES) < 0) {
+            result = -1;
+            break;
+        }
+        while (iobuffer_length(buf) > 0 && result >= 0) {
+            if (splice) {
+                result = iobuffer_splice(sp, buf);
+            } else {
+                result = write(pipefd[1], iobuffer_data(buf),
+                               iobuffer_length(buf));
+                if (result > 0) {
+                    iobuffer_consume(buf, result);
+                }
+            }
+        }
+        done += BUFFER_BYTES;
+    }
+    close(pipefd[1]);
+    pthread_join(thread, NULL);
+    elapsed = now() - start;
+
+    iobuffer_splicer_destroy(sp);
+    iobuffer_destroy(buf);
+    close(pipefd[0]);
+
+    return result < 0 ? -1 : TOTAL_BYTES / elapsed / 1e6;
+}
+
+int main(void) {
+    double spliced = 0;
+    double written = 0;
+    double rate;
+
+    for (int i = 0; i < RUNS; i++) {
+        rate = run(false);
+        if (rate < 0) {
+            perror("write run");
+            return EXIT_FAILURE;
+        }
+        written = rate > written ? rate : written;
+        rate = run(true);
+        if (rate < 0) {
+            perror("splice run");
+            return EXIT_FAILURE;
+        }
+        spliced = rate > spliced ? rate : spliced;
+    }
+    printf("write():          %8.1f MB/s\n", written);
+    printf("iobuffer_splice(): %7.1f MB/s\n", spliced);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,305 @@
+/* agent <agent@local>
+ * Topology-aware placement of reactor and worker threads.
+ *
+ * A reactor fills IOBuffers and a worker parses them, so every buffer
+ * crosses from one CPU's cache to another's.  If both CPUs share an L3
+ * cache that transfer stays on-chip; if they are on different sockets
+ * it crosses the interconnect, and so does every access to storage
+ * allocated on the far node.  This file reads the CPU, cache, and NUMA
+ * layout from sysfs, pairs CPUs that share an L3, and pins threads to
+ * those pairs with their IOBuffer pool bound to the local node.
+ */
+#define _GNU_SOURCE  /* for pthread_setaffinity_np() */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "example.h"
+#include "topology.h"
+
+/* Root of the per-CPU sysfs hierarchy */
+static const char *const SYSFS_CPU = "/sys/devices/system/cpu";
+
+/* Longest sysfs path or configuration line handled.  Used as array
+ * sizes, so these must be #defines. */
+#define MAX_PATH 256
+#define MAX_LINE 256
+
+/* What is known about one online CPU */
+typedef struct {
+    int cpu;
+    int node;
+    int llc;  // identifier of its last-level cache, unique per machine
+} CPUInfo;
+
+/*
+ * Reads the first line of a sysfs file into line, without its newline.
+ * Returns < 0 if the file cannot be read.
+ */
+static int read_line(const char *path, char *line, int size) {
+    FILE *file = fopen(path, "r");
+    char *result;
+
+    if (file == NULL) {
+        return -1;
+    }
+    result = fgets(line, size, file);
+    fclose(file);
+    if (result == NULL) {
+        return -1;
+    }
+    line[strcspn(line, "\n")] = '\0';
+
+    return 0;
+}
+
+/*
+ * Parses a sysfs CPU list such as "0-3,8-11" into cpus.  Returns the
+ * number of CPUs stored, at most maxcpus.
+ */
+static int parse_cpulist(const char *list, int *cpus, int maxcpus) {
+    int count = 0;
+    int first;
+    int last;
+    char *end;
+
+    while (*list != '\0') {
+        first = strtol(list, &end, 10);
+        if (end == list) {
+            break;
+        }
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+        for (int cpu = first; cpu <= last && count < maxcpus; cpu++) {
+            cpus[count++] = cpu;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+
+    return count;
+}
+
+/*
+ * Returns the NUMA node of a CPU, found as a nodeN link in its sysfs
+ * directory, or 0 on machines without NUMA information.
+ */
+static int cpu_node(int cpu) {
+    char path[MAX_PATH];
+    struct dirent *entry;
+    DIR *dir;
+    int node = 0;
+
+    snprintf(path, sizeof(path), "%s/cpu%d", SYSFS_CPU, cpu);
+    dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0
+            && sscanf(entry->d_name + 4, "%d", &node) == 1) {
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node;
+}
+
+/*
+ * Returns an identifier for a CPU's L3 cache: the lowest CPU sharing
+ * it.  Without L3 information, every CPU on a node is assumed to share
+ * one, and the result is derived from the node instead.
+ */
+static int cpu_llc(int cpu, int node) {
+    int cpus[CPU_SETSIZE];
+    char path[MAX_PATH];
+    char line[MAX_LINE];
+    int level;
+
+    for (int index = 0; ; index++) {
+        snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/level",
+                 SYSFS_CPU, cpu, index);
+        if (read_line(path, line, sizeof(line)) < 0) {
+            break;
+        }
+        level = atoi(line);
+        if (level != 3) {
+            continue;
+        }
+        snprintf(path, sizeof(path),
+                 "%s/cpu%d/cache/index%d/shared_cpu_list",
+                 SYSFS_CPU, cpu, index);
+        if (read_line(path, line, sizeof(line)) == 0
+            && parse_cpulist(line, cpus, CPU_SETSIZE) > 0) {
+            return cpus[0];
+        }
+    }
+
+    return -1 - node;
+}
+
+/*
+ * Orders CPUInfo by cache, then CPU number, for qsort().
+ */
+static int cpuinfo_compare(const void *a, const void *b) {
+    const CPUInfo *x = a;
+    const CPUInfo *y = b;
+
+    if (x->llc != y->llc) {
+        return x->llc < y->llc ? -1 : 1;
+    }
+    return x->cpu - y->cpu;
+}
+
+/* Compute reactor/worker pairs from the machine's topology.
+ *
+ * Online CPUs are grouped by L3 cache, and consecutive CPUs within a
+ * group are paired.  A group with an odd number of CPUs leaves one
+ * unpaired.  Each pair's node is the node of its reactor CPU.
+ *
+ * This function returns < 0 if the CPU list cannot be read, or the
+ * number of pairs stored.
+ *
+ * pairs:    array receiving the pairs
+ * maxpairs: size of pairs
+ */
+int topology_pairs(PlacementPair *pairs, int maxpairs) {
+    int cpus[CPU_SETSIZE];
+    CPUInfo info[CPU_SETSIZE];
+    char path[MAX_PATH];
+    char line[MAX_LINE];
+    int ncpus;
+    int count = 0;
+
+    snprintf(path, sizeof(path), "%s/online", SYSFS_CPU);
+    if (read_line(path, line, sizeof(line)) < 0) {
+        return -1;
+    }
+    ncpus = parse_cpulist(line, cpus, CPU_SETSIZE);
+    for (int i = 0; i < ncpus; i++) {
+        info[i].cpu = cpus[i];
+        info[i].node = cpu_node(cpus[i]);
+        info[i].llc = cpu_llc(cpus[i], info[i].node);
+    }
+    qsort(info, ncpus, sizeof(CPUInfo), cpuinfo_compare);
+
+    for (int i = 0; i + 1 < ncpus && count < maxpairs; i++) {
+        if (info[i].llc != info[i + 1].llc) {
+            continue;
+        }
+        pairs[count].reactor_cpu = info[i].cpu;
+        pairs[count].worker_cpu = info[i + 1].cpu;
+        pairs[count].node = info[i].node;
+        count++;
+        i++;
+    }
+
+    return count;
+}
+
+/* Read reactor/worker pairs from an override configuration file.
+ *
+ * Each line holds a reactor CPU, a worker CPU, and optionally a node,
+ * separated by whitespace; the node defaults to 0.  Blank lines and
+ * text after a # are ignored.
+ *
+ * This function returns < 0 if the file cannot be read or contains a
+ * malformed line, or the number of pairs stored.
+ *
+ * path:     the configuration file
+ * pairs:    array receiving the pairs
+ * maxpairs: size of pairs
+ */
+int topology_read_config(const char *path, PlacementPair *pairs,
+                         int maxpairs) {
+    FILE *file = fopen(path, "r");
+    char line[MAX_LINE];
+    PlacementPair pair;
+    int count = 0;
+    int fields;
+
+    if (file == NULL) {
+        return -1;
+    }
+    while (count < maxpairs && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "#\n")] = '\0';
+        pair.node = 0;
+        fields = sscanf(line, "%d %d %d", &pair.reactor_cpu,
+                        &pair.worker_cpu, &pair.node);
+        if (fields == EOF) {
+            continue;
+        }
+        if (fields < 2) {
+            fclose(file);
+            return -1;
+        }
+        pairs[count++] = pair;
+    }
+    fclose(file);
+
+    return count;
+}
+
+/* Place the calling thread as one half of a reactor/worker pair.
+ *
+ * The thread is pinned to the pair's CPU for its role, and its IOBuffer
+ * pool is bound to the pair's node so that the buffers it creates are
+ * local to both threads.
+ *
+ * This function returns < 0 with errno set on error, or 0 on success.
+ * On error the thread keeps the CPU affinity it had.
+ *
+ * pair: the pair to join
+ * role: whether this thread is the pair's reactor or worker
+ */
+int placement_enter(const PlacementPair *pair, PlacementRole role) {
+    cpu_set_t saved;
+    cpu_set_t set;
+    int cpu = -1;
+    int err;
+
+    switch (role) {
+    case PLACEMENT_REACTOR:
+        cpu = pair->reactor_cpu;
+        break;
+    case PLACEMENT_WORKER:
+        cpu = pair->worker_cpu;
+        break;
+    }
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* pthread affinity calls return an error number without setting
+     * errno. */
+    err = pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    if (iobuffer_pool_bind_node(pair->node) < 0) {
+        err = errno;
+        pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
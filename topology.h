@@ -0,0 +1,33 @@
+/* agent <agent@local>
+ * Topology-aware placement of reactor and worker threads.
+ *
+ * This file contains the type declarations and function prototypes for
+ * the functions in topology.c.
+ */
+
+#ifndef TOPOLOGY_H_
+#define TOPOLOGY_H_
+
+/* A reactor (I/O) thread and the worker that consumes its buffers.
+ * The two CPUs share a last-level cache, and node is the NUMA node
+ * from which the pair's IOBuffer storage is allocated. */
+typedef struct {
+    int reactor_cpu;
+    int worker_cpu;
+    int node;
+} PlacementPair;
+
+/* Which thread of a pair is being placed */
+typedef enum {
+    PLACEMENT_REACTOR,
+    PLACEMENT_WORKER
+} PlacementRole;
+
+int topology_pairs(PlacementPair *pairs, int maxpairs);
+
+int topology_read_config(const char *path, PlacementPair *pairs,
+                         int maxpairs);
+
+int placement_enter(const PlacementPair *pair, PlacementRole role);
+
+#endif /* TOPOLOGY_H_ */